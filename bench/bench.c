@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <simplefs.h>
+
+/*
+   Microbenchmarks of the layers of the file system, printed as JSON:
+
+     {"suite": ..., "results": [{"bench": ..., "params": {...}, "ops": ...,
+                                 "ns_per_op": ..., "ops_per_sec": ..., "mb_per_sec": ...}]}
+
+   mb_per_sec is only there for the benchmarks moving data. Every benchmark
+   runs on a new disk image, removed when it ends; the random choices come
+   from a fixed seed, so two runs of a build do the same operations.
+   -q shrinks the sizes for a quick check, -f runs only the benchmarks
+   whose name contains the given string, -r puts the disks in memory
+   (DiskDriver_initMemory) to leave the page cache out of the numbers.
+*/
+
+#define BENCH_IMAGE     "bench.img"
+#define BENCH_BITMAP    (1 << 20)       // bits of the bitmap searched
+#define BENCH_DISK      (1 << 16)       // blocks of the disk of the block and file benchmarks
+#define BENCH_FILE      (1 << 20)       // bytes of the file of the file benchmarks
+#define BENCH_BATCH     1000            // files created by each SimpleFS_createFiles when filling
+#define BENCH_BUDGET_NS 500000000ull    // time after which a loop of slow operations stops early
+
+static FILE* out;
+static int results = 0;
+static int quick = 0;
+static int memory = 0;
+static const char* filter = NULL;
+static uint64_t seed = 0x9e3779b97f4a7c15ull;
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-q] [-r] [-f name] [-o file]\n", prog);
+    fprintf(stderr, "  -q       smaller sizes, for a quick run\n");
+    fprintf(stderr, "  -r       RAM disks instead of image files\n");
+    fprintf(stderr, "  -f name  only the benchmarks whose name contains name\n");
+    fprintf(stderr, "  -o file  write the results to file instead of stdout\n");
+}
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// xorshift64, enough to scatter the accesses
+static uint64_t rnd(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static int selected(const char* bench) {
+    return filter == NULL || strstr(bench, filter) != NULL;
+}
+
+// appends a result; params is the inside of a JSON object, bytes 0 if no data moved
+static void result(const char* bench, const char* params, int64_t ops, uint64_t ns, int64_t bytes) {
+    double seconds = (double) ns / 1e9;
+    fprintf(out, "%s\n    {\"bench\": \"%s\", \"params\": {%s}, \"ops\": %" PRId64 ", \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f",
+            results ? "," : "", bench, params, ops,
+            ops > 0 ? (double) ns / (double) ops : 0.0, seconds > 0 ? (double) ops / seconds : 0.0);
+    if (bytes > 0)
+        fprintf(out, ", \"mb_per_sec\": %.1f", seconds > 0 ? (double) bytes / (1024.0 * 1024.0) / seconds : 0.0);
+    fprintf(out, "}");
+    fflush(out);
+    results ++;
+    fprintf(stderr, "%-14s %-40s %12.1f ns/op\n", bench, params, ops > 0 ? (double) ns / (double) ops : 0.0);
+}
+
+/* disks */
+
+typedef struct {
+  DiskDriver disk;
+  SimpleFS fs;
+  DirectoryHandle* root;
+} BenchDisk;
+
+// makes a new image of num_blocks blocks, formatted if format is set
+static void openDisk(BenchDisk* bd, int64_t num_blocks, int format) {
+    if (memory) {
+        DiskDriver_initMemory(&bd->disk, num_blocks, 0);
+    }
+    else {
+        unlink(BENCH_IMAGE);
+        DiskDriver_init(&bd->disk, BENCH_IMAGE, num_blocks);
+    }
+    bd->root = NULL;
+    if (!format)
+        return;
+    // the handle given by init was read before the format
+    DirectoryHandle* old = SimpleFS_init(&bd->fs, &bd->disk);
+    SimpleFS_format(&bd->fs);
+    bd->root = SimpleFS_openDir(old, "/");
+    SimpleFS_closeDir(old);
+}
+
+// closes and removes the image, so the next one doesn't add to it
+static void closeDisk(BenchDisk* bd) {
+    if (bd->root != NULL)
+        SimpleFS_closeDir(bd->root);
+    DiskDriver_close(&bd->disk);
+    if (!memory)
+        unlink(BENCH_IMAGE);
+}
+
+// creates the files named prefix0 .. prefix(n-1) in d, in batches
+static int fillDir(DirectoryHandle* d, const char* prefix, int64_t n) {
+    char (*buf)[32] = malloc(BENCH_BATCH * sizeof(*buf));
+    const char* names[BENCH_BATCH];
+    int64_t done = 0;
+    int ret = 0;
+    while (ret == 0 && done < n) {
+        int idx, num = n - done < BENCH_BATCH ? (int) (n - done) : BENCH_BATCH;
+        for (idx = 0; idx < num; idx++) {
+            snprintf(buf[idx], sizeof(buf[idx]), "%s%07" PRId64, prefix, done + idx);
+            names[idx] = buf[idx];
+        }
+        ret = SimpleFS_createFiles(d, names, num);
+        done += num;
+    }
+    free(buf);
+    return ret;
+}
+
+/* benchmarks */
+
+// BitMap_get looking for a free bit from a random point, with a share of the bits set at random
+static void benchBitmap(void) {
+    if (!selected("bitmap_get"))
+        return;
+
+    static const int fills[] = { 0, 50, 90, 99, 100 };
+    int64_t bits = quick ? BENCH_BITMAP / 16 : BENCH_BITMAP;
+    int64_t ops = quick ? 10000 : 100000;
+    BitMap bmap = {
+        .num_bits = bits,
+        .entries = malloc((size_t) bits / 8)
+    };
+    int idx;
+    for (idx = 0; idx < (int) (sizeof(fills) / sizeof(fills[0])); idx++) {
+        int64_t pos, op;
+        memset(bmap.entries, 0, (size_t) bits / 8);
+        for (pos = 0; pos < bits; pos++)
+            if ((int) (rnd() % 100) < fills[idx])
+                BitMap_set(&bmap, pos, 1);
+
+        // a full bitmap is scanned to the end by every call
+        volatile int64_t found = 0;
+        uint64_t start = now();
+        for (op = 0; op < ops && (op % 256 != 0 || now() - start < BENCH_BUDGET_NS); op++)
+            found += BitMap_get(&bmap, (int64_t) (rnd() % (uint64_t) bits), 0);
+        uint64_t ns = now() - start;
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"fill_pct\": %d, \"bits\": %" PRId64, fills[idx], bits);
+        result("bitmap_get", params, op, ns, 0);
+    }
+    free(bmap.entries);
+}
+
+// DiskDriver_writeBlock and DiskDriver_readBlock, in order and at random
+static void benchBlocks(void) {
+    if (!selected("block_"))
+        return;
+
+    int64_t num_blocks = quick ? BENCH_DISK / 8 : BENCH_DISK;
+    int64_t ops = quick ? 50000 : 500000;
+    BenchDisk bd;
+    openDisk(&bd, num_blocks, 0);
+    char data[BLOCK_SIZE];
+    memset(data, 0x5a, BLOCK_SIZE);
+    int64_t op;
+    uint64_t start;
+    char params[64];
+    snprintf(params, sizeof(params), "\"blocks\": %" PRId64, num_blocks);
+
+    start = now();
+    for (op = 0; op < num_blocks; op++)
+        DiskDriver_writeBlock(&bd.disk, data, op);
+    result("block_write_seq", params, num_blocks, now() - start, num_blocks * BLOCK_SIZE);
+
+    start = now();
+    for (op = 0; op < ops; op++)
+        DiskDriver_writeBlock(&bd.disk, data, (int64_t) (rnd() % (uint64_t) num_blocks));
+    result("block_write_rand", params, ops, now() - start, ops * BLOCK_SIZE);
+
+    start = now();
+    for (op = 0; op < num_blocks; op++)
+        DiskDriver_readBlock(&bd.disk, data, op);
+    result("block_read_seq", params, num_blocks, now() - start, num_blocks * BLOCK_SIZE);
+
+    start = now();
+    for (op = 0; op < ops; op++)
+        DiskDriver_readBlock(&bd.disk, data, (int64_t) (rnd() % (uint64_t) num_blocks));
+    result("block_read_rand", params, ops, now() - start, ops * BLOCK_SIZE);
+
+    closeDisk(&bd);
+}
+
+// createFile, openFile, readDir and a listing with SimpleFS_nextEntry
+// in a directory already holding entries files
+static void benchDir(int tree, int64_t entries) {
+    int64_t extra = entries < 1000 ? entries : 1000;
+    BenchDisk bd;
+    // leaves split in half, so a tree takes up to a node every 7 entries
+    openDisk(&bd, entries + (tree ? entries / 4 : entries / 32) + 2 * extra + 1024, 1);
+    char name[32];
+    char params[80];
+    snprintf(params, sizeof(params), "\"dir\": \"%s\", \"entries\": %" PRId64,
+             tree ? "tree" : "list", entries);
+
+    int ret = tree ? SimpleFS_mkDirTree(bd.root, "d") : SimpleFS_mkDir(bd.root, "d");
+    DirectoryHandle* d = ret == 0 ? SimpleFS_openDir(bd.root, "d") : NULL;
+    if (d == NULL || fillDir(d, "f", entries) == -1) {
+        fprintf(stderr, "cannot fill a directory of %" PRId64 " entries\n", entries);
+        if (d != NULL)
+            SimpleFS_closeDir(d);
+        closeDisk(&bd);
+        return;
+    }
+
+    int64_t op;
+    uint64_t start;
+    if (selected("create_file")) {
+        start = now();
+        for (op = 0; op < extra; op++) {
+            snprintf(name, sizeof(name), "g%07" PRId64, op);
+            SimpleFS_createFile(d, name);
+        }
+        result("create_file", params, extra, now() - start, 0);
+    }
+
+    if (selected("open_file")) {
+        start = now();
+        for (op = 0; op < extra; op++) {
+            snprintf(name, sizeof(name), "f%07" PRId64, (int64_t) (rnd() % (uint64_t) entries));
+            FileHandle* f = SimpleFS_openFile(d, name);
+            if (f != NULL)
+                SimpleFS_closeFile(f);
+        }
+        result("open_file", params, extra, now() - start, 0);
+    }
+
+    if (selected("read_dir")) {
+        int num = d->dcb->num_entries;
+        char** names = malloc(num * sizeof(char*));
+        int64_t calls = entries >= 100000 ? 1 : 100000 / entries;
+        uint64_t ns = 0;
+        for (op = 0; op < calls; op++) {
+            start = now();
+            SimpleFS_readDir(names, d);
+            ns += now() - start;
+            int idx;
+            for (idx = 0; idx < num; idx++)
+                free(names[idx]);
+        }
+        free(names);
+        result("read_dir", params, calls, ns, 0);
+    }
+
+    if (selected("iterate_dir")) {
+        SimpleFSEntry entry;
+        int64_t calls = entries >= 100000 ? 1 : 100000 / entries;
+        start = now();
+        for (op = 0; op < calls; op++) {
+            SimpleFS_rewindDir(d);
+            while (SimpleFS_nextEntry(d, &entry) == 1)
+                ;
+        }
+        result("iterate_dir", params, calls, now() - start, 0);
+    }
+
+    SimpleFS_closeDir(d);
+    closeDisk(&bd);
+}
+
+static void benchDirs(void) {
+    if (!selected("create_file") && !selected("open_file") && !selected("read_dir") &&
+            !selected("iterate_dir"))
+        return;
+
+    // a list directory scans all of its entries for each name
+    int64_t max_list = quick ? 1000 : 10000;
+    int64_t max_tree = quick ? 10000 : 1000000;
+    int64_t entries;
+    for (entries = 10; entries <= max_list; entries *= 10)
+        benchDir(0, entries);
+    for (entries = 10; entries <= max_tree; entries *= 10)
+        benchDir(1, entries);
+}
+
+// read, write, pread and pwrite of chunks of size bytes on a file of BENCH_FILE bytes
+static void benchFileSize(int size) {
+    int reps = quick ? 2 : 8;
+    int64_t chunks = BENCH_FILE / size;
+    int64_t ops = quick ? 200 : 2000;
+    BenchDisk bd;
+    openDisk(&bd, BENCH_DISK, 1);
+    char* data = malloc(size);
+    memset(data, 0x33, size);
+    char params[64];
+    snprintf(params, sizeof(params), "\"size\": %d, \"file_bytes\": %d", size, BENCH_FILE);
+    int64_t op;
+    int rep;
+    uint64_t start, ns;
+    FileHandle* f;
+
+    // a new file each time, to time the appends and not the overwrites
+    ns = 0;
+    for (rep = 0; rep < reps; rep++) {
+        SimpleFS_remove(bd.root, "f");
+        SimpleFS_createFile(bd.root, "f");
+        f = SimpleFS_openFile(bd.root, "f");
+        start = now();
+        for (op = 0; op < chunks; op++)
+            SimpleFS_write(f, data, size);
+        SimpleFS_closeFile(f);
+        ns += now() - start;
+    }
+    if (selected("file_write_seq"))
+        result("file_write_seq", params, reps * chunks, ns, (int64_t) reps * BENCH_FILE);
+
+    f = SimpleFS_openFile(bd.root, "f");
+    if (selected("file_read_seq")) {
+        ns = 0;
+        for (rep = 0; rep < reps; rep++) {
+            SimpleFS_seek(f, 0);
+            start = now();
+            for (op = 0; op < chunks; op++)
+                SimpleFS_read(f, data, size);
+            ns += now() - start;
+        }
+        result("file_read_seq", params, reps * chunks, ns, (int64_t) reps * BENCH_FILE);
+    }
+
+    if (selected("file_read_rand")) {
+        start = now();
+        for (op = 0; op < ops; op++)
+            SimpleFS_pread(f, data, size, (int64_t) (rnd() % (uint64_t) chunks) * size);
+        result("file_read_rand", params, ops, now() - start, ops * size);
+    }
+
+    if (selected("file_write_rand")) {
+        start = now();
+        for (op = 0; op < ops; op++)
+            SimpleFS_pwrite(f, data, size, (int64_t) (rnd() % (uint64_t) chunks) * size);
+        result("file_write_rand", params, ops, now() - start, ops * size);
+    }
+    SimpleFS_closeFile(f);
+
+    free(data);
+    closeDisk(&bd);
+}
+
+static void benchFiles(void) {
+    if (!selected("file_"))
+        return;
+
+    static const int sizes[] = { 64, 512, 4096, 65536 };
+    int idx;
+    for (idx = 0; idx < (int) (sizeof(sizes) / sizeof(sizes[0])); idx++)
+        benchFileSize(sizes[idx]);
+}
+
+// SimpleFS_removeTree of a directory holding files in subdirectories of 100
+static void benchRemoveTree(void) {
+    if (!selected("remove_tree"))
+        return;
+
+    int64_t max_files = quick ? 10000 : 100000;
+    int64_t files;
+    for (files = 1000; files <= max_files; files *= 10) {
+        BenchDisk bd;
+        openDisk(&bd, files + files / 50 + 1024, 1);
+        SimpleFS_mkDir(bd.root, "t");
+        DirectoryHandle* t = SimpleFS_openDir(bd.root, "t");
+        int64_t dirs = files / 100;
+        int64_t idx;
+        for (idx = 0; idx < dirs; idx++) {
+            char name[32];
+            snprintf(name, sizeof(name), "d%05" PRId64, idx);
+            SimpleFS_mkDir(t, name);
+            DirectoryHandle* d = SimpleFS_openDir(t, name);
+            fillDir(d, "f", 100);
+            SimpleFS_closeDir(d);
+        }
+        SimpleFS_closeDir(t);
+
+        uint64_t start = now();
+        int ret = SimpleFS_removeTree(bd.root, "/t");
+        uint64_t ns = now() - start;
+        if (ret == 0) {
+            char params[64];
+            snprintf(params, sizeof(params), "\"files\": %" PRId64 ", \"dirs\": %" PRId64, files, dirs);
+            // one op per entry removed
+            result("remove_tree", params, files + dirs + 1, ns, 0);
+        }
+        closeDisk(&bd);
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    const char* output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "qrf:o:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quick = 1;
+            break;
+        case 'r':
+            memory = 1;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "{\n  \"suite\": \"simplefs\",\n  \"block_size\": %d,\n  \"stats\": %d,\n  \"trace\": %d,\n"
+                 "  \"quick\": %d,\n  \"memory\": %d,\n  \"time\": %lld,\n  \"results\": [",
+            BLOCK_SIZE, SFS_STATS, SFS_TRACE, quick, memory, (long long) time(NULL));
+    benchBitmap();
+    benchBlocks();
+    benchDirs();
+    benchFiles();
+    benchRemoveTree();
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+    return EXIT_SUCCESS;
+}
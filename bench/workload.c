@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <simplefs.h>
+
+/*
+   Workload driver: threads running a random mix of create, write, read and
+   remove on SimpleFS for a number of operations or seconds, to see how the
+   allocator and the directories behave after a long churn.
+
+   Each thread works in its own directory w<thread>, below which it makes
+   a tree of directories with the given fan out and depth, and picks its
+   operations, files and sizes from its own generator seeded by the seed
+   and the thread number: a run with the same options does the same
+   operations (with one thread, on the same blocks).
+
+   Every interval the throughput and the space used are sampled; at the end
+   the results are printed as JSON with the latency percentiles of each
+   operation and the space amplification (blocks taken by the files and
+   directories made by the run, over the bytes stored in the files).
+*/
+
+#define WL_IMAGE        "workload.img"
+#define WL_MAX_THREADS  32
+#define WL_CHUNK        4096              // bytes moved by each read and write call
+#define WL_MAX_SIZE     (64 << 20)        // sizes drawn are capped to this
+#define WL_MAX_SAMPLES  1024              // intervals kept for the report
+#define WL_SUB_BITS     4                 // sub buckets of the histogram for each power of 2
+
+typedef enum {
+  WL_CREATE,
+  WL_WRITE,
+  WL_READ,
+  WL_REMOVE,
+  WL_NUM_OPS
+} WorkloadOp;
+
+static const char* op_names[WL_NUM_OPS] = { "create", "write", "read", "remove" };
+
+typedef enum {
+  WL_FIXED,
+  WL_ZIPF,
+  WL_LOGNORMAL
+} SizeDist;
+
+// latencies on a log scale, 2^WL_SUB_BITS buckets for each power of 2
+typedef struct {
+  int64_t count;
+  int64_t failed;
+  int64_t max_ns;
+  int64_t buckets[64 << WL_SUB_BITS];
+} Histogram;
+
+typedef struct {
+  uint64_t seed;
+  int threads;
+  int64_t ops;                    // per thread, 0 to run for seconds
+  double seconds;
+  int mix[WL_NUM_OPS];            // weights of the operations
+  SizeDist dist;
+  double dist_a, dist_b;          // fixed: size; zipf: max, exponent; lognormal: median, sigma
+  int fanout, depth;
+  int tree_dirs;                  // directories made with SimpleFS_mkDirTree
+  int64_t disk_blocks;
+  int memory;                     // RAM disk instead of an image file
+  double interval;
+} Config;
+
+typedef struct {
+  int32_t dir;
+  uint32_t id;
+  int64_t size;
+} LiveFile;
+
+typedef struct {
+  int id;
+  pthread_t thread;
+  uint64_t rng;
+  DirectoryHandle** dirs;          // leaf directories of the thread
+  int num_dirs;
+  LiveFile* files;
+  int64_t num_files, capacity;
+  uint32_t next_id;
+  Histogram hist[WL_NUM_OPS];
+} Worker;
+
+typedef struct {
+  double time;
+  int64_t ops;
+  int64_t used_blocks;
+  int64_t live_bytes;
+} Sample;
+
+static Config cfg;
+static DiskDriver disk;
+static SimpleFS fs;
+static DirectoryHandle* root;
+static Worker workers[WL_MAX_THREADS];
+static int64_t done_ops = 0;            // operations done by all the threads
+static int64_t live_bytes = 0;          // bytes stored in the files alive
+static int64_t base_used = 0;           // blocks used before the run
+static int running = 1;
+static char* chunk;
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  -s seed        seed of the run (default 1)\n");
+    fprintf(stderr, "  -t threads     threads, up to %d (default 1)\n", WL_MAX_THREADS);
+    fprintf(stderr, "  -n ops         operations per thread (default 100000)\n");
+    fprintf(stderr, "  -d seconds     run for seconds instead of a number of operations\n");
+    fprintf(stderr, "  -m c:w:r:d     weights of create, write, read and remove (default 30:20:40:10)\n");
+    fprintf(stderr, "  -z dist        sizes of the files: fixed:<bytes>, zipf:<max bytes>:<exponent>\n");
+    fprintf(stderr, "                 or lognormal:<median bytes>:<sigma> (default lognormal:4096:1.5)\n");
+    fprintf(stderr, "  -f fanout      subdirectories of each directory (default 4)\n");
+    fprintf(stderr, "  -l depth       levels of directories below the one of a thread (default 2)\n");
+    fprintf(stderr, "  -T             make the directories as B+trees\n");
+    fprintf(stderr, "  -b blocks      blocks of the disk (default 262144)\n");
+    fprintf(stderr, "  -r             keep the disk in memory instead of %s\n", WL_IMAGE);
+    fprintf(stderr, "  -k image       save the disk to image at the end, to look at it later\n");
+    fprintf(stderr, "  -i seconds     interval between samples (default 1)\n");
+    fprintf(stderr, "  -o file        write the results to file instead of stdout\n");
+}
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* random numbers */
+
+// splitmix64, spreads the seed of each thread
+static uint64_t mixSeed(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// xorshift64*
+static uint64_t rnd(Worker* w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545f4914f6cdd1dull;
+}
+
+// uniform in (0, 1)
+static double rndUnit(Worker* w) {
+    return ((double) (rnd(w) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static int64_t drawSize(Worker* w) {
+    double size;
+    double u = rndUnit(w);
+    switch (cfg.dist) {
+    case WL_ZIPF:
+        // inverse of the continuous power law on [1, max + 1)
+        if (fabs(cfg.dist_b - 1.0) < 1e-9)
+            size = exp(u * log(cfg.dist_a + 1.0));
+        else
+            size = pow((pow(cfg.dist_a + 1.0, 1.0 - cfg.dist_b) - 1.0) * u + 1.0, 1.0 / (1.0 - cfg.dist_b));
+        size -= 1.0;
+        break;
+    case WL_LOGNORMAL:
+        // Box-Muller
+        size = cfg.dist_a * exp(cfg.dist_b * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * rndUnit(w)));
+        break;
+    default:
+        size = cfg.dist_a;
+    }
+    if (size > WL_MAX_SIZE)
+        size = WL_MAX_SIZE;
+    return size < 0 ? 0 : (int64_t) size;
+}
+
+static WorkloadOp drawOp(Worker* w) {
+    int total = cfg.mix[WL_CREATE] + cfg.mix[WL_WRITE] + cfg.mix[WL_READ] + cfg.mix[WL_REMOVE];
+    int pick = (int) (rnd(w) % (uint64_t) total);
+    int op;
+    for (op = 0; op < WL_NUM_OPS - 1; op++) {
+        if (pick < cfg.mix[op])
+            break;
+        pick -= cfg.mix[op];
+    }
+    return op;
+}
+
+/* histograms */
+
+static void Histogram_add(Histogram* h, int64_t ns, int ok) {
+    uint64_t v = ns > 0 ? (uint64_t) ns : 1;
+    int msb = 63 - __builtin_clzll(v);
+    int sub = msb >= WL_SUB_BITS ? (int) (v >> (msb - WL_SUB_BITS)) & ((1 << WL_SUB_BITS) - 1)
+                                 : (int) (v << (WL_SUB_BITS - msb)) & ((1 << WL_SUB_BITS) - 1);
+    h->buckets[(msb << WL_SUB_BITS) | sub] ++;
+    h->count ++;
+    if (!ok)
+        h->failed ++;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+}
+
+static void Histogram_merge(Histogram* dest, const Histogram* src) {
+    int idx;
+    for (idx = 0; idx < (64 << WL_SUB_BITS); idx++)
+        dest->buckets[idx] += src->buckets[idx];
+    dest->count += src->count;
+    dest->failed += src->failed;
+    if (src->max_ns > dest->max_ns)
+        dest->max_ns = src->max_ns;
+}
+
+// upper bound of the bucket holding the fraction-th latency
+static int64_t Histogram_percentile(const Histogram* h, double fraction) {
+    int64_t wanted = (int64_t) ceil(fraction * (double) h->count);
+    int64_t seen = 0;
+    int idx;
+    if (wanted < 1)
+        wanted = 1;
+    for (idx = 0; idx < (64 << WL_SUB_BITS); idx++) {
+        seen += h->buckets[idx];
+        if (seen >= wanted)
+            break;
+    }
+    if (idx == (64 << WL_SUB_BITS))
+        return h->max_ns;
+    int msb = idx >> WL_SUB_BITS;
+    int sub = idx & ((1 << WL_SUB_BITS) - 1);
+    double upper = ldexp(1.0 + (double) (sub + 1) / (1 << WL_SUB_BITS), msb);
+    return upper < (double) h->max_ns ? (int64_t) upper : h->max_ns;
+}
+
+/* operations */
+
+static void fileName(char* name, size_t len, uint32_t id) {
+    snprintf(name, len, "f%08" PRIx32, id);
+}
+
+// writes size bytes from the cursor, 0 if all of them were written
+static int writeBytes(FileHandle* f, int64_t size) {
+    while (size > 0) {
+        int len = size < WL_CHUNK ? (int) size : WL_CHUNK;
+        if (SimpleFS_write(f, chunk, len) != len)
+            return -1;
+        size -= len;
+    }
+    return 0;
+}
+
+static int opCreate(Worker* w) {
+    LiveFile file = {
+        .dir = (int32_t) (rnd(w) % (uint64_t) w->num_dirs),
+        .id = w->next_id++,
+        .size = drawSize(w)
+    };
+    char name[16];
+    fileName(name, sizeof(name), file.id);
+    DirectoryHandle* d = w->dirs[file.dir];
+    if (SimpleFS_createFile(d, name) == -1)
+        return -1;
+    FileHandle* f = SimpleFS_openFile(d, name);
+    if (f == NULL)
+        return -1;
+    int ret = writeBytes(f, file.size);
+    SimpleFS_closeFile(f);
+    if (ret == -1) {
+        SimpleFS_remove(d, name);
+        return -1;
+    }
+
+    if (w->num_files == w->capacity) {
+        w->capacity = w->capacity ? 2 * w->capacity : 1024;
+        w->files = realloc(w->files, w->capacity * sizeof(LiveFile));
+    }
+    w->files[w->num_files++] = file;
+    __atomic_add_fetch(&live_bytes, file.size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// rewrites a piece of a file from a random point, growing it if it goes past the end
+static int opWrite(Worker* w, LiveFile* file) {
+    char name[16];
+    fileName(name, sizeof(name), file->id);
+    FileHandle* f = SimpleFS_openFile(w->dirs[file->dir], name);
+    if (f == NULL)
+        return -1;
+    int64_t pos = file->size ? (int64_t) (rnd(w) % (uint64_t) (file->size + 1)) : 0;
+    int64_t size = drawSize(w);
+    int ret = SimpleFS_seek(f, pos) == pos ? writeBytes(f, size) : -1;
+    SimpleFS_closeFile(f);
+    if (ret == 0 && pos + size > file->size) {
+        __atomic_add_fetch(&live_bytes, pos + size - file->size, __ATOMIC_RELAXED);
+        file->size = pos + size;
+    }
+    return ret;
+}
+
+static int opRead(Worker* w, LiveFile* file) {
+    char name[16];
+    char buf[WL_CHUNK];
+    fileName(name, sizeof(name), file->id);
+    FileHandle* f = SimpleFS_openFile(w->dirs[file->dir], name);
+    if (f == NULL)
+        return -1;
+    int64_t left = file->size;
+    int ret = 0;
+    while (left > 0 && ret == 0) {
+        int len = left < WL_CHUNK ? (int) left : WL_CHUNK;
+        ret = SimpleFS_read(f, buf, len) == len ? 0 : -1;
+        left -= len;
+    }
+    SimpleFS_closeFile(f);
+    return ret;
+}
+
+static int opRemove(Worker* w, int64_t idx) {
+    LiveFile* file = &w->files[idx];
+    char name[16];
+    fileName(name, sizeof(name), file->id);
+    if (SimpleFS_remove(w->dirs[file->dir], name) == -1)
+        return -1;
+    __atomic_sub_fetch(&live_bytes, file->size, __ATOMIC_RELAXED);
+    w->files[idx] = w->files[--w->num_files];
+    return 0;
+}
+
+/* threads */
+
+// makes the directories of w: fanout^depth leaves below w<id>
+static int makeDirs(Worker* w) {
+    char path[64];
+    snprintf(path, sizeof(path), "w%d", w->id);
+    int ret = cfg.tree_dirs ? SimpleFS_mkDirTree(root, path) : SimpleFS_mkDir(root, path);
+    if (ret == -1)
+        return -1;
+
+    w->num_dirs = 1;
+    w->dirs = malloc(sizeof(DirectoryHandle*));
+    w->dirs[0] = SimpleFS_openDir(root, path);
+    int level;
+    for (level = 0; level < cfg.depth && w->dirs[0] != NULL; level++) {
+        DirectoryHandle** next = malloc(w->num_dirs * cfg.fanout * sizeof(DirectoryHandle*));
+        int idx, sub, num = 0;
+        for (idx = 0; idx < w->num_dirs; idx++) {
+            for (sub = 0; sub < cfg.fanout; sub++) {
+                snprintf(path, sizeof(path), "d%d", sub);
+                if (cfg.tree_dirs)
+                    SimpleFS_mkDirTree(w->dirs[idx], path);
+                else
+                    SimpleFS_mkDir(w->dirs[idx], path);
+                next[num] = SimpleFS_openDir(w->dirs[idx], path);
+                if (next[num] == NULL)
+                    return -1;
+                num ++;
+            }
+            SimpleFS_closeDir(w->dirs[idx]);
+        }
+        free(w->dirs);
+        w->dirs = next;
+        w->num_dirs = num;
+    }
+    return w->dirs[0] == NULL ? -1 : 0;
+}
+
+static void* work(void* arg) {
+
+    Worker* w = arg;
+    int64_t op_num;
+    for (op_num = 0; cfg.ops == 0 || op_num < cfg.ops; op_num++) {
+        if (!__atomic_load_n(&running, __ATOMIC_RELAXED))
+            break;
+
+        WorkloadOp op = drawOp(w);
+        if (w->num_files == 0)
+            op = WL_CREATE;
+        int64_t idx = op == WL_CREATE ? 0 : (int64_t) (rnd(w) % (uint64_t) w->num_files);
+
+        uint64_t start = now();
+        int ret;
+        switch (op) {
+        case WL_CREATE:
+            ret = opCreate(w);
+            break;
+        case WL_WRITE:
+            ret = opWrite(w, &w->files[idx]);
+            break;
+        case WL_READ:
+            ret = opRead(w, &w->files[idx]);
+            break;
+        default:
+            ret = opRemove(w, idx);
+        }
+        Histogram_add(&w->hist[op], (int64_t) (now() - start), ret == 0);
+        __atomic_add_fetch(&done_ops, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int64_t usedBlocks(void) {
+    return disk.header->num_blocks - __atomic_load_n(&disk.header->free_blocks, __ATOMIC_RELAXED);
+}
+
+static double amplification(int64_t used, int64_t bytes) {
+    return bytes > 0 ? (double) (used - base_used) * BLOCK_SIZE / (double) bytes : 0.0;
+}
+
+/* options */
+
+static int parseMix(const char* arg) {
+    return sscanf(arg, "%d:%d:%d:%d", &cfg.mix[WL_CREATE], &cfg.mix[WL_WRITE],
+                  &cfg.mix[WL_READ], &cfg.mix[WL_REMOVE]) == 4 &&
+           cfg.mix[WL_CREATE] > 0 && cfg.mix[WL_WRITE] >= 0 &&
+           cfg.mix[WL_READ] >= 0 && cfg.mix[WL_REMOVE] >= 0 ? 0 : -1;
+}
+
+static int parseDist(const char* arg) {
+    if (sscanf(arg, "fixed:%lf", &cfg.dist_a) == 1) {
+        cfg.dist = WL_FIXED;
+        return cfg.dist_a >= 0 ? 0 : -1;
+    }
+    if (sscanf(arg, "zipf:%lf:%lf", &cfg.dist_a, &cfg.dist_b) == 2) {
+        cfg.dist = WL_ZIPF;
+        return cfg.dist_a >= 1 && cfg.dist_b > 0 ? 0 : -1;
+    }
+    if (sscanf(arg, "lognormal:%lf:%lf", &cfg.dist_a, &cfg.dist_b) == 2) {
+        cfg.dist = WL_LOGNORMAL;
+        return cfg.dist_a > 0 && cfg.dist_b >= 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+static const char* distName(void) {
+    return cfg.dist == WL_ZIPF ? "zipf" : cfg.dist == WL_LOGNORMAL ? "lognormal" : "fixed";
+}
+
+int main(int argc, char* argv[]) {
+
+    cfg.seed = 1;
+    cfg.threads = 1;
+    cfg.ops = 100000;
+    cfg.seconds = 0;
+    parseMix("30:20:40:10");
+    parseDist("lognormal:4096:1.5");
+    cfg.fanout = 4;
+    cfg.depth = 2;
+    cfg.tree_dirs = 0;
+    cfg.disk_blocks = 1 << 18;
+    cfg.interval = 1.0;
+    const char* output = NULL;
+    const char* keep = NULL;
+
+    int opt, bad = 0;
+    while ((opt = getopt(argc, argv, "s:t:n:d:m:z:f:l:Tb:rk:i:o:")) != -1) {
+        switch (opt) {
+        case 's': cfg.seed = strtoull(optarg, NULL, 0); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'n': cfg.ops = atoll(optarg); break;
+        case 'd': cfg.seconds = atof(optarg); cfg.ops = 0; break;
+        case 'm': bad |= parseMix(optarg); break;
+        case 'z': bad |= parseDist(optarg); break;
+        case 'f': cfg.fanout = atoi(optarg); break;
+        case 'l': cfg.depth = atoi(optarg); break;
+        case 'T': cfg.tree_dirs = 1; break;
+        case 'b': cfg.disk_blocks = atoll(optarg); break;
+        case 'r': cfg.memory = 1; break;
+        case 'k': keep = optarg; break;
+        case 'i': cfg.interval = atof(optarg); break;
+        case 'o': output = optarg; break;
+        default: bad = 1;
+        }
+    }
+    if (bad || optind != argc || cfg.threads < 1 || cfg.threads > WL_MAX_THREADS ||
+            (cfg.ops <= 0 && cfg.seconds <= 0) || cfg.fanout < 1 || cfg.depth < 0 ||
+            cfg.disk_blocks <= 0 || cfg.interval <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    FILE* out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    if (cfg.memory) {
+        DiskDriver_initMemory(&disk, cfg.disk_blocks, 0);
+    }
+    else {
+        unlink(WL_IMAGE);
+        DiskDriver_init(&disk, WL_IMAGE, cfg.disk_blocks);
+    }
+    DirectoryHandle* old = SimpleFS_init(&fs, &disk);
+    SimpleFS_format(&fs);
+    root = SimpleFS_openDir(old, "/");
+    SimpleFS_closeDir(old);
+    chunk = malloc(WL_CHUNK);
+    memset(chunk, 0x77, WL_CHUNK);
+
+    int idx;
+    for (idx = 0; idx < cfg.threads; idx++) {
+        Worker* w = &workers[idx];
+        w->id = idx;
+        w->rng = mixSeed(cfg.seed + (uint64_t) idx) | 1;
+        if (makeDirs(w) == -1) {
+            fprintf(stderr, "cannot make the directories, the disk is too small\n");
+            return EXIT_FAILURE;
+        }
+    }
+    base_used = usedBlocks();
+
+    static Sample samples[WL_MAX_SAMPLES];
+    int num_samples = 0;
+    uint64_t start = now();
+    for (idx = 0; idx < cfg.threads; idx++)
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+
+    // samples until the threads are done or the time is over
+    int64_t total_ops = cfg.ops * cfg.threads;
+    uint64_t next = start;
+    while (1) {
+        next += (uint64_t) (cfg.interval * 1e9);
+        while (now() < next && __atomic_load_n(&done_ops, __ATOMIC_RELAXED) != total_ops)
+            usleep(10000);
+        double elapsed = (double) (now() - start) / 1e9;
+        int64_t ops = __atomic_load_n(&done_ops, __ATOMIC_RELAXED);
+        Sample sample = { elapsed, ops, usedBlocks(), __atomic_load_n(&live_bytes, __ATOMIC_RELAXED) };
+        if (num_samples < WL_MAX_SAMPLES)
+            samples[num_samples++] = sample;
+        fprintf(stderr, "%8.1f s %12" PRId64 " ops %10" PRId64 " blocks used, amplification %.2f\n",
+                elapsed, ops, sample.used_blocks, amplification(sample.used_blocks, sample.live_bytes));
+        if (ops == total_ops || (cfg.seconds > 0 && elapsed >= cfg.seconds))
+            break;
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    for (idx = 0; idx < cfg.threads; idx++)
+        pthread_join(workers[idx].thread, NULL);
+    double seconds = (double) (now() - start) / 1e9;
+
+    Histogram* all = calloc(WL_NUM_OPS, sizeof(Histogram));
+    int64_t files = 0;
+    for (idx = 0; idx < cfg.threads; idx++) {
+        int op;
+        for (op = 0; op < WL_NUM_OPS; op++)
+            Histogram_merge(&all[op], &workers[idx].hist[op]);
+        files += workers[idx].num_files;
+    }
+    int64_t used = usedBlocks();
+
+    fprintf(out, "{\n  \"config\": {\"seed\": %" PRIu64 ", \"threads\": %d, \"ops_per_thread\": %" PRId64
+                 ", \"seconds\": %.1f, \"mix\": [%d, %d, %d, %d], \"size_dist\": \"%s\", \"size_params\": [%g, %g]"
+                 ", \"fanout\": %d, \"depth\": %d, \"tree_dirs\": %d, \"disk_blocks\": %" PRId64 ", \"memory\": %d},\n",
+            cfg.seed, cfg.threads, cfg.ops, cfg.seconds, cfg.mix[WL_CREATE], cfg.mix[WL_WRITE],
+            cfg.mix[WL_READ], cfg.mix[WL_REMOVE], distName(), cfg.dist_a, cfg.dist_b,
+            cfg.fanout, cfg.depth, cfg.tree_dirs, cfg.disk_blocks, cfg.memory);
+    fprintf(out, "  \"ops\": %" PRId64 ",\n  \"elapsed_s\": %.3f,\n  \"ops_per_sec\": %.0f,\n",
+            __atomic_load_n(&done_ops, __ATOMIC_RELAXED), seconds,
+            (double) __atomic_load_n(&done_ops, __ATOMIC_RELAXED) / seconds);
+    fprintf(out, "  \"latency_ns\": {");
+    int op;
+    for (op = 0; op < WL_NUM_OPS; op++)
+        fprintf(out, "%s\n    \"%s\": {\"count\": %" PRId64 ", \"failed\": %" PRId64 ", \"p50\": %" PRId64
+                     ", \"p99\": %" PRId64 ", \"p999\": %" PRId64 ", \"max\": %" PRId64 "}",
+                op ? "," : "", op_names[op], all[op].count, all[op].failed,
+                Histogram_percentile(&all[op], 0.5), Histogram_percentile(&all[op], 0.99),
+                Histogram_percentile(&all[op], 0.999), all[op].max_ns);
+    fprintf(out, "\n  },\n  \"space\": {\"files\": %" PRId64 ", \"live_bytes\": %" PRId64
+                 ", \"used_blocks\": %" PRId64 ", \"amplification\": %.3f},\n",
+            files, live_bytes, used - base_used, amplification(used, live_bytes));
+    fprintf(out, "  \"samples\": [");
+    for (idx = 0; idx < num_samples; idx++) {
+        int64_t ops = samples[idx].ops - (idx ? samples[idx - 1].ops : 0);
+        double span = samples[idx].time - (idx ? samples[idx - 1].time : 0.0);
+        fprintf(out, "%s\n    {\"time_s\": %.3f, \"ops_per_sec\": %.0f, \"used_blocks\": %" PRId64
+                     ", \"live_bytes\": %" PRId64 ", \"amplification\": %.3f}",
+                idx ? "," : "", samples[idx].time, span > 0 ? (double) ops / span : 0.0,
+                samples[idx].used_blocks - base_used, samples[idx].live_bytes,
+                amplification(samples[idx].used_blocks, samples[idx].live_bytes));
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+
+    free(all);
+    free(chunk);
+    SimpleFS_closeDir(root);
+    int ret = EXIT_SUCCESS;
+    if (keep != NULL && DiskDriver_save(&disk, keep) == -1) {
+        perror(keep);
+        ret = EXIT_FAILURE;
+    }
+    DiskDriver_close(&disk);
+    if (!cfg.memory)
+        unlink(WL_IMAGE);
+    return ret;
+}
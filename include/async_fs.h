@@ -0,0 +1,81 @@
+#pragma once
+#include <pthread.h>
+#include "simplefs.h"
+
+#define ASYNCFS_MAX_WORKERS 32
+
+typedef enum {
+  ASYNCFS_OPEN,     // opens path, the handle is stored in file
+  ASYNCFS_CLOSE,
+  ASYNCFS_READ,
+  ASYNCFS_WRITE,
+  ASYNCFS_PREAD,
+  ASYNCFS_PWRITE,
+  ASYNCFS_FLUSH,
+  ASYNCFS_CREATE,   // creates the file path
+  ASYNCFS_REMOVE    // removes the file or empty directory path
+} AsyncFSOp;
+
+typedef struct AsyncFSRequest AsyncFSRequest;
+
+// called by a worker thread when the request is completed
+typedef void (*AsyncFSCallback)(AsyncFSRequest* req);
+
+// a request, owned by the caller: it must stay valid until it completes
+// requests using the cursor of the same handle may complete in any order
+struct AsyncFSRequest {
+  AsyncFSOp op;
+  FileHandle* file;             // handle of the file (set by ASYNCFS_OPEN)
+  const char* path;             // absolute path, for open, create and remove
+  void* data;                   // buffer of read and write operations
+  int size;
+  int64_t offset;               // position for pread and pwrite
+  AsyncFSCallback callback;     // if NULL the request is returned by AsyncFS_reap
+  void* user_data;
+  int result;                   // what the SimpleFS function returned
+  AsyncFSRequest* next;         // link in the queues
+};
+
+typedef struct AsyncFS AsyncFS;
+
+typedef struct {
+  AsyncFS* afs;
+  pthread_t thread;
+  DirectoryHandle* root;        // private handle on the top level directory
+} AsyncFSWorker;
+
+// runs SimpleFS operations on a pool of worker threads
+struct AsyncFS {
+  SimpleFS* fs;
+  AsyncFSWorker workers[ASYNCFS_MAX_WORKERS];
+  int num_workers;
+  pthread_mutex_t lock;         // guards the queues and stopping
+  pthread_cond_t submitted;
+  AsyncFSRequest* head;         // submitted requests, oldest first
+  AsyncFSRequest* tail;
+  AsyncFSRequest* done_head;    // completed requests without callback
+  AsyncFSRequest* done_tail;
+  int stopping;
+  int event_fd;                 // eventfd counting the requests to reap
+};
+
+// starts num_workers threads serving the file system of the handle d
+// returns 0 on success, -1 on error
+int AsyncFS_init(AsyncFS* afs, DirectoryHandle* d, int num_workers);
+
+// queues the request, it is completed by a worker: then its callback is
+// called, or if there is none it can be collected with AsyncFS_reap
+// returns 0 on success, -1 if afs is stopping
+int AsyncFS_submit(AsyncFS* afs, AsyncFSRequest* req);
+
+// returns a descriptor that becomes readable when there are completed
+// requests to reap, to be used with poll/epoll
+int AsyncFS_fd(AsyncFS* afs);
+
+// moves up to max completed requests (without callback) in reqs,
+// in completion order; never blocks. Returns how many were moved
+int AsyncFS_reap(AsyncFS* afs, AsyncFSRequest** reqs, int max);
+
+// completes the requests already submitted and stops the workers
+// requests still to be reaped remain valid
+void AsyncFS_destroy(AsyncFS* afs);
@@ -1,25 +1,38 @@
 #pragma once
 #include <stdint.h>
 typedef struct{
-  int num_bits;
+  int64_t num_bits;
   char* entries;
 }  BitMap;
 
 typedef struct {
-  int entry_num;
+  int64_t entry_num;
   char bit_num;
 } BitMapEntryKey;
 
 // converts a block index to an index in the array,
 // and a char that indicates the offset of the bit inside the array
-BitMapEntryKey BitMap_blockToIndex(int num);
+BitMapEntryKey BitMap_blockToIndex(int64_t num);
 
 // converts a bit to a linear index
-int BitMap_indexToBlock(int entry, uint8_t bit_num);
+int64_t BitMap_indexToBlock(int64_t entry, uint8_t bit_num);
 
 // returns the index of the first bit having status "status"
 // in the bitmap bmap, and starts looking from position start
-int BitMap_get(BitMap* bmap, int start, int status);
+int64_t BitMap_get(BitMap* bmap, int64_t start, int status);
+
+// returns the status of the bit at index pos, -1 if pos is out of the bitmap
+int BitMap_test(BitMap* bmap, int64_t pos);
+
+// returns the index of the first run of len consecutive bits having
+// status "status" in the bitmap bmap, starting from position start
+// -1 if there is none
+int64_t BitMap_getRun(BitMap* bmap, int64_t start, int64_t len, int status);
 
 // sets the bit at index pos in bmap to status
-int BitMap_set(BitMap* bmap, int pos, int status);
+int BitMap_set(BitMap* bmap, int64_t pos, int status);
+
+// sets the bit at index pos in bmap to status and returns its previous
+// status, -1 if pos is out of the bitmap
+// bits are read and changed atomically, so threads can claim bits without locks
+int BitMap_testAndSet(BitMap* bmap, int64_t pos, int status);
@@ -8,3 +8,5 @@
                                     } while(0)
 
 #define DEBUG 0
+#define SFS_STATS 1   // 0 builds without the instrumentation of stats.h
+#define SFS_TRACE 1   // 0 builds without the block trace of trace.h
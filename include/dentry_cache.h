@@ -0,0 +1,44 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+#define DENTRY_CACHE_SIZE 256
+#define DENTRY_NAME_LEN   128
+
+// a cached directory entry, keyed by (parent, name)
+// a negative entry (block == -1) records that the name doesn't exist
+typedef struct {
+  int valid;
+  int64_t parent;             // first block of the directory holding the entry
+  int64_t block;              // first block of the entry, -1 if negative
+  int is_dir;
+  char name[DENTRY_NAME_LEN];
+} DentryCacheEntry;
+
+// bounded, direct mapped cache of name lookups
+// every operation takes lock, so the cache can be shared between threads
+typedef struct {
+  DentryCacheEntry entries[DENTRY_CACHE_SIZE];
+  pthread_mutex_t lock;
+} DentryCache;
+
+// empties the cache
+void DentryCache_init(DentryCache* cache);
+
+// drops every entry of a cache already initialized
+void DentryCache_clear(DentryCache* cache);
+
+// copies the entry cached for name in the directory parent to block and is_dir
+// returns 1 on a hit, 0 if there is none
+int DentryCache_lookup(DentryCache* cache, int64_t parent, const char* name, int64_t* block, int* is_dir);
+
+// caches the result of a lookup, replacing whatever was in its slot
+// block is -1 to remember that name doesn't exist in parent
+void DentryCache_insert(DentryCache* cache, int64_t parent, const char* name, int64_t block, int is_dir);
+
+// drops the entry cached for name in the directory parent
+void DentryCache_invalidate(DentryCache* cache, int64_t parent, const char* name);
+
+// drops every entry in the directory dir and every entry pointing to it,
+// to be called when dir is removed and its block can be reused
+void DentryCache_purgeDir(DentryCache* cache, int64_t dir);
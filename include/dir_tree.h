@@ -0,0 +1,83 @@
+#pragma once
+#include "simplefs.h"
+
+/*
+   Directories with fcb.is_dir == SFS_DIR_TREE keep their entries in an
+   on-disk B+tree ordered by name, instead of the list of DirectoryBlock.
+   The root node is in file_blocks[0] of the FirstDirectoryBlock, the other
+   slots are unused; num_entries still counts the entries and size_in_blocks
+   the blocks (first block and nodes).
+
+   A key holds the first DIRTREE_PREFIX bytes of the name and the first block
+   of the entry: names that don't fit in the prefix are compared reading the
+   name in the FirstFileBlock of the entry. Every key of an internal node is
+   the first key of the subtree on its right, so it always names a live entry.
+   Nodes of the same level are chained in name order by the header links.
+   Nodes are not merged: a node is released when it gets empty, and the root
+   is dropped while it has a single child.
+
+   The functions don't lock: the caller holds the lock of the directory
+   (read for lookups and scans, write for changes) and writes fdb back
+   on disk after changing it.
+*/
+
+#define DIRTREE_PREFIX     16   // bytes of the name stored in a key
+#define DIRTREE_FANOUT     15   // children of an internal node
+#define DIRTREE_MAX_HEIGHT 16   // levels of the tree, leaves included
+
+typedef struct {
+  char prefix[DIRTREE_PREFIX]; // start of the name, zero padded
+  int64_t block;               // first block of the entry
+} DirTreeKey;
+
+/******************* stuff on disk BEGIN *******************/
+// a node of the tree. A leaf has num_keys entries, an internal node
+// num_keys separators and num_keys + 1 children:
+// the subtree children[i + 1] holds the names >= keys[i]
+typedef struct {
+  BlockHeader header;          // previous_block/next_block: nodes on the same level
+  int is_leaf;
+  int num_keys;
+  int64_t children[DIRTREE_FANOUT];
+  DirTreeKey keys[DIRTREE_FANOUT - 1];
+  char padding[BLOCK_SIZE - sizeof(BlockHeader) - 2 * sizeof(int)
+               - DIRTREE_FANOUT * sizeof(int64_t) - (DIRTREE_FANOUT - 1) * sizeof(DirTreeKey)];
+} DirTreeNode;
+/******************* stuff on disk END *******************/
+
+// position of a scan, valid while the directory lock is held
+typedef struct {
+  int64_t leaf;                // block of the current leaf, -1 at the end
+  int pos;                     // next key in the leaf
+} DirTreeCursor;
+
+// makes fdb an empty tree directory, allocating its root
+// 0 on success, -1 if the disk is full
+int DirTree_init(DiskDriver* disk, FirstDirectoryBlock* fdb);
+
+// returns the first block of the entry called name, -1 if there is none or on error
+int64_t DirTree_lookup(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name);
+
+// adds the entry name, whose first block is block_num and already on disk
+// 0 on success, -1 on error (name already there, disk full, a key unreadable)
+int DirTree_insert(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name, int64_t block_num);
+
+// removes the entry name, returns its first block or -1 if there is none or on error
+int64_t DirTree_remove(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name);
+
+// makes the entry name point to block_num, where its first block was moved,
+// also in the separators naming it. The old first block must still be readable
+// 0 on success, -1 if there is no such entry or on error
+int DirTree_relocate(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name, int64_t block_num);
+
+// places the cursor on the first entry whose name is >= from ("" for the first one)
+// 0 on success, -1 on error
+int DirTree_seek(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* from, DirTreeCursor* cursor);
+
+// returns the first block of the entry under the cursor and moves it forward,
+// -1 at the end. If name isn't NULL the name of the entry is copied in it
+int64_t DirTree_next(DiskDriver* disk, DirTreeCursor* cursor, char* name);
+
+// frees all the nodes of the tree of fdb (not fdb itself nor the entries)
+// 0 on success, -1 on error
+int DirTree_destroy(DiskDriver* disk, FirstDirectoryBlock* fdb);
@@ -1,51 +1,168 @@
 #pragma once
+#include <pthread.h>
 #include "bitmap.h"
+#include "trace.h"
 
 #define BLOCK_SIZE 512
+#define DISK_MAGIC   0x31534653        // "SFS1", first bytes of every disk
+#define DISK_VERSION 4                 // 64 bit block numbers, region summaries, clean flag and packed files
+#define DISK_OLDEST_VERSION 3          // oldest format mounted, upgraded to DISK_VERSION by the mount
+#define DISK_MAX_BLOCKS (INT64_C(1) << 48)  // keeps the size in bytes of a disk well in 64 bits
+#define DISK_REGION_BLOCKS 1024        // blocks counted by an entry of the summary, a multiple of 8
+#define DISK_DATA_ALIGN    4096        // the blocks start at a page boundary of the file
+
+// options of DiskDriver_open
+#define DISK_POPULATE      0x1         // read in the whole image while mounting (MAP_POPULATE)
+#define DISK_PRELOAD_META  0x2         // read in the bitmap and the summary while mounting
+#define DISK_HUGEPAGES     0x4         // ask for transparent huge pages on the mapping
+
 // this is stored in the 1st block of the disk
 typedef struct {
-  int num_blocks;
-  int bitmap_blocks;   // how many blocks in the bitmap
-  int bitmap_entries;  // how many bytes are needed to store the bitmap
+  int magic;             // DISK_MAGIC
+  int version;           // DISK_VERSION of the format the disk was made with
+  int64_t num_blocks;
+  int64_t bitmap_blocks;   // how many blocks in the bitmap
+  int64_t bitmap_entries;  // how many bytes are needed to store the bitmap
   
-  int free_blocks;     // free blocks
-  int first_free_block;// first block index
+  int64_t free_blocks;     // free blocks
+  int64_t first_free_block;// first block index
+  int64_t num_regions;     // entries of the summary
+  int clean;               // set by DiskDriver_close, cleared while the disk is mounted
+  int padding;
 } DiskHeader; 
 
 typedef struct {
   DiskHeader* header; // mmapped
   char* bitmap_data;  // mmapped (bitmap)
-  int fd; // for us
+  int32_t* summary;   // mmapped, used blocks of each region of DISK_REGION_BLOCKS blocks
+  char* block_data;   // mmapped, first block
+  char* region_valid; // regions recounted since an unclean mount, NULL if the summary is trusted
+  pthread_mutex_t region_lock; // serializes the recounts
+  int fd; // for us, -1 for a RAM disk
+  Trace* trace;       // NULL unless a trace is running
 } DiskDriver;
 
+/**
+   The allocator takes no locks: bits of the bitmap are claimed and released
+   atomically and the counters in the header are updated with atomic operations,
+   so blocks can be allocated and freed by several threads at once.
+   Concurrent writes to the same block must be serialized by the caller
+*/
+
 /**
    The blocks indices seen by the read/write functions 
    have to be calculated after the space occupied by the bitmap
 */
 
+/**
+   Mounting reads only the header: the rest of the image is mapped and
+   faulted in when touched. The allocator skips full regions looking at
+   the summary, which the bitmap changes keep up to date; a disk closed
+   with DiskDriver_close is marked clean and its summary is trusted at the
+   next mount. After a crash each region is recounted from the bitmap the
+   first time the allocator touches it, and the ones never touched are
+   recounted by DiskDriver_close before marking the disk clean again.
+*/
+
 // opens the file (creating it if necessary_
 // allocates the necessary space on the disk
 // calculates how big the bitmap should be
 // if the file was new
 // compiles a disk header, and fills in the bitmap of appropriate size
 // with all 0 (to denote the free space);
-void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks);
+// an existing disk keeps the number of blocks it was made with, and is
+// refused if it has another format or is shorter than its header says;
+// a disk of an older format that can be read is upgraded on mount.
+// The whole disk is mmapped, so it must fit in the address space
+void DiskDriver_init(DiskDriver* disk, const char* filename, int64_t num_blocks);
+
+// same as DiskDriver_init, with the DISK_* options in flags for the services
+// that would rather pay the page faults while mounting than on the first accesses
+void DiskDriver_open(DiskDriver* disk, const char* filename, int64_t num_blocks, int flags);
+
+// makes a disk of num_blocks blocks in anonymous memory instead of a file,
+// for scratch data that is never kept: no page cache and no space on a
+// file system. flags as in DiskDriver_open; DiskDriver_close frees it
+void DiskDriver_initMemory(DiskDriver* disk, int64_t num_blocks, int flags);
+
+// makes a RAM disk with a copy of the image in filename,
+// which is not changed; exits if it can't be read like DiskDriver_init
+void DiskDriver_load(DiskDriver* disk, const char* filename, int flags);
+
+// writes a copy of the disk (RAM or file) to filename, an image
+// DiskDriver_init or DiskDriver_load can open; no other thread may change
+// the disk meanwhile. 0 on success, -1 if the file couldn't be written
+int DiskDriver_save(DiskDriver* disk, const char* filename);
+
+// writes everything back, marks the disk clean and unmaps it
+// (stopping the trace if one is running); the disk can't be used any more
+// 0 on success, -1 if the data couldn't be written
+int DiskDriver_close(DiskDriver* disk);
+
+// frees every block of the disk, for a format
+void DiskDriver_clear(DiskDriver* disk);
+
+// recomputes the summary, free_blocks and first_free_block from the bitmap,
+// after it has been written directly (see fsck)
+void DiskDriver_rebuild(DiskDriver* disk);
 
 // reads the block in position block_num
 // returns -1 if the block is free accrding to the bitmap
 // 0 otherwise
-int DiskDriver_readBlock(DiskDriver* disk, void* dest, int block_num);
+int DiskDriver_readBlock(DiskDriver* disk, void* dest, int64_t block_num);
+
+// reads the block in position block_num whatever the bitmap says,
+// for checkers that can't trust it. -1 if the block is out of the disk
+int DiskDriver_peekBlock(DiskDriver* disk, void* dest, int64_t block_num);
 
 // writes a block in position block_num, and alters the bitmap accordingly
 // returns -1 if operation not possible
-int DiskDriver_writeBlock(DiskDriver* disk, void* src, int block_num);
+int DiskDriver_writeBlock(DiskDriver* disk, void* src, int64_t block_num);
 
 // frees a block in position block_num, and alters the bitmap accordingly
 // returns -1 if operation not possible
-int DiskDriver_freeBlock(DiskDriver* disk, int block_num);
+int DiskDriver_freeBlock(DiskDriver* disk, int64_t block_num);
+
+// frees the num blocks listed in blocks, updating the header once
+// returns -1 if some block was out of the disk
+int DiskDriver_freeBlocks(DiskDriver* disk, int64_t* blocks, int num);
 
 // returns the first free blockin the disk from position (checking the bitmap)
-int DiskDriver_getFreeBlock(DiskDriver* disk, int start);
+// the answer may be stale as soon as it is returned if other threads allocate,
+// use DiskDriver_allocBlock or DiskDriver_claimBlock to own a block
+int64_t DiskDriver_getFreeBlock(DiskDriver* disk, int64_t start);
+
+// atomically marks block_num as used if it is free
+// returns 0 if the block now belongs to the caller, -1 if it was taken
+int DiskDriver_claimBlock(DiskDriver* disk, int64_t block_num);
+
+// finds and claims the first free block from position start,
+// wrapping to the beginning of the disk; returns -1 if the disk is full
+int64_t DiskDriver_allocBlock(DiskDriver* disk, int64_t start);
+
+// returns the first block of a run of len contiguous free blocks
+// starting from position start, -1 if there is none
+int64_t DiskDriver_getFreeRun(DiskDriver* disk, int64_t start, int64_t len);
+
+// returns a pointer to the block in position block_num inside the mmapped zone,
+// NULL if the block is free. Later writes to the block are seen through it
+void* DiskDriver_mapBlock(DiskDriver* disk, int64_t block_num);
+
+// asks the CPU to load the start of the block in position block_num,
+// header and control block, ahead of a read. Only a hint, nothing is checked
+void DiskDriver_prefetchBlock(DiskDriver* disk, int64_t block_num);
+
+// 1 if ptr points inside the mmapped zone of the disk, 0 otherwise
+int DiskDriver_contains(DiskDriver* disk, const void* ptr);
 
 // writes the data (flushing the mmaps)
 int DiskDriver_flush(DiskDriver* disk);
+
+// starts recording every read, write, allocation and free of the disk
+// in filename (see trace.h); start and stop the trace while no other
+// thread uses the disk. -1 if a trace is running or it can't be started
+int DiskDriver_startTrace(DiskDriver* disk, const char* filename);
+
+// stops the trace, returns the number of records dropped
+// or -1 if there was no trace or its file couldn't be written
+int64_t DiskDriver_stopTrace(DiskDriver* disk);
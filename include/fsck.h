@@ -0,0 +1,40 @@
+#pragma once
+#include "simplefs.h"
+#include <stdio.h>
+
+/*
+   Offline checker. The tree is walked from the top level directory (block 0)
+   by a pool of threads: every thread keeps the directories it still has to
+   visit in its own deque and, when it runs out of them, steals from the
+   other threads. Files are checked by the thread visiting their directory.
+
+   Every chain is checked (links, block_in_file, block_in_disk, length
+   against size_in_blocks) together with the fcb of every entry (parent,
+   idx_in_directory, is_dir) and the order of the B+tree directories.
+   The pack blocks of a directory (see pack.h) must belong to it and count
+   the packed files pointing to them, each slot pointed to once.
+   The blocks reached are collected in a bitmap, that is compared with the
+   one on disk and, on request, written over it.
+
+   The disk must not be in use by a SimpleFS while it is checked.
+*/
+
+#define FSCK_MAX_THREADS 64
+
+typedef struct {
+  int64_t dirs;            // directories reached, the top level included
+  int64_t files;           // files reached
+  int64_t used_blocks;     // blocks reached from the top level
+  int64_t errors;          // inconsistencies found in the tree
+  int64_t leaked_blocks;   // used in the bitmap but not reached
+  int64_t lost_blocks;     // reached but free in the bitmap
+  int64_t bad_regions;     // entries of the summary not matching the bitmap
+  int repaired;            // the bitmap and the header were rebuilt
+} FsckReport;
+
+// checks the file system on disk with num_threads threads (0 for one per cpu),
+// printing every problem found on out (NULL to stay quiet).
+// If repair is set the bitmap, its summary, free_blocks and first_free_block
+// are rebuilt from the blocks reached, when they don't match.
+// 0 if the check ran, -1 if the disk holds no file system
+int Fsck_check(DiskDriver* disk, int num_threads, int repair, FILE* out, FsckReport* report);
@@ -0,0 +1,82 @@
+#pragma once
+#include "simplefs.h"
+
+/*
+   Small files packed together. A file whose name and data take little room
+   can leave its FirstFileBlock for a slot of a PackBlock shared with other
+   small files of the same directory (see SimpleFS_pack). The directory entry
+   is then a reference: the pack block in the low 48 bits and the slot + 1
+   above them, so it is never a block number of the disk (DISK_MAX_BLOCKS).
+   The first block of a packed file is rebuilt in memory by Pack_read: its
+   header.block_in_disk and fcb.block_in_disk are the reference, it has no
+   other block and size_in_blocks is 1.
+
+   The slots grow from the start of bytes, the names and data of the files
+   from its end, each name followed by the data of its file. A slot with
+   name_len 0 is free; removing a file compacts the records of the others,
+   and the block is released with its last file.
+
+   A packed file is opened like the others, and moved back to a block of its
+   own before it is changed (see SimpleFS_write). The functions don't lock:
+   the caller holds the write lock of the directory, the only one whose
+   files the block holds (the read lock for Pack_read and Pack_readEntry).
+*/
+
+#define PACK_MARK -2                                   // block_in_file of a pack block
+#define PACK_REF(block, slot) ((block) | (((int64_t) (slot) + 1) << 48))
+#define PACK_IS_REF(ref)      ((ref) >= DISK_MAX_BLOCKS)
+#define PACK_BLOCK(ref)       ((ref) & (DISK_MAX_BLOCKS - 1))
+#define PACK_SLOT(ref)        ((int) ((ref) >> 48) - 1)
+
+typedef struct {
+  int idx_in_directory;        // as in the fcb of the file
+  uint16_t offset;             // of the name in bytes, the data follows it
+  uint16_t size;               // bytes of data
+  uint8_t name_len;            // without the terminator, 0 if the slot is free
+} PackSlot;
+
+/******************* stuff on disk BEGIN *******************/
+typedef struct {
+  BlockHeader header;          // block_in_file is PACK_MARK, no previous or next block
+  int64_t directory_block;     // the directory of the files packed here
+  int num_slots;               // slots used or free at the start of bytes
+  int num_files;               // slots used
+  char bytes[BLOCK_SIZE - sizeof(BlockHeader) - sizeof(int64_t) - 2 * sizeof(int)];
+} PackBlock;
+/******************* stuff on disk END *******************/
+
+#define PACK_BYTES      ((int) sizeof(((PackBlock*) 0)->bytes))
+#define PACK_MAX_RECORD (PACK_BYTES / 2)   // slot, name and data of a file that can be packed
+
+// 1 if the file of ffb (an unpacked first block) is small enough to be packed
+int Pack_fits(const FirstFileBlock* ffb);
+
+// makes pack an empty pack block in position block_num for the directory dir_block
+void Pack_init(PackBlock* pack, int64_t block_num, int64_t dir_block);
+
+// reads in pack the block block_num, which must be a pack of the directory
+// dir_block. 0 on success, -1 otherwise
+int Pack_load(DiskDriver* disk, PackBlock* pack, int64_t block_num, int64_t dir_block);
+
+// adds the file of ffb to pack (in memory), returns its slot or -1 if it doesn't fit
+int Pack_add(PackBlock* pack, const FirstFileBlock* ffb);
+
+// rebuilds in ffb the first block of the packed file ref, from pack (in memory)
+// 0 on success, -1 if the slot isn't a file of pack
+int Pack_get(const PackBlock* pack, int64_t ref, FirstFileBlock* ffb);
+
+// rebuilds in ffb the first block of the packed file ref, reading its pack block
+// 0 on success, -1 on error
+int Pack_read(DiskDriver* disk, int64_t ref, FirstFileBlock* ffb);
+
+// reads the first block of the entry block_num of a directory, packed or not,
+// like DiskDriver_readBlock. 0 on success, -1 on error
+int Pack_readEntry(DiskDriver* disk, void* dest, int64_t block_num);
+
+// stores idx as idx_in_directory of the packed file ref
+// 0 on success, -1 on error
+int Pack_setIndex(DiskDriver* disk, int64_t ref, int idx);
+
+// removes the packed file ref from its block, releasing the block if it was the last one
+// 0 on success, -1 on error
+int Pack_remove(DiskDriver* disk, int64_t ref);
@@ -1,34 +1,41 @@
 #pragma once
 #include "bitmap.h"
 #include "disk_driver.h"
+#include "dentry_cache.h"
+#include "stats.h"
 #include <common.h>
 /*these are structures stored on disk*/
 
 // header, occupies the first portion of each block in the disk
 // represents a chained list of blocks
 typedef struct {
-  int previous_block; // chained list (previous block)
-  int next_block;     // chained list (next_block)
-  int block_in_file; // position in the file, if 0 we have a file control block
-  int block_in_disk;
+  int64_t previous_block; // chained list (previous block)
+  int64_t next_block;     // chained list (next_block)
+  int64_t block_in_file; // position in the file, if 0 we have a file control block
+  int64_t block_in_disk;
 } BlockHeader;
 
 
 // this is in the first block of a chain, after the header
 typedef struct {
-  int directory_block; // first block of the parent directory
-  int block_in_disk;   // repeated position of the block on the disk
-  int idx_in_directory;
+  int64_t directory_block; // first block of the parent directory
+  int64_t block_in_disk;   // repeated position of the block on the disk
+  int idx_in_directory; // position in the parent, -1 if it is a B+tree directory
   char name[128];
-  int  size_in_bytes;
-  int size_in_blocks;
-  int is_dir;          // 0 for file, 1 for dir
+  int64_t size_in_bytes;
+  int64_t size_in_blocks;
+  int is_dir;          // 0 for file, 1 for dir, SFS_DIR_TREE for dir stored as a B+tree
 } FileControlBlock;
 
+#define SFS_DIR_TREE 2     // is_dir of a directory indexed by name, see dir_tree.h
+
 // this is the first physical block of a file
 // it has a header
 // an FCB storing file infos
 // and can contain some data
+// files up to max_data_ffb bytes are stored inline here and use no other
+// block. SimpleFS_pack moves the smallest ones into blocks shared with
+// other files of their directory, see pack.h
 
 /******************* stuff on disk BEGIN *******************/
 typedef struct {
@@ -48,37 +55,85 @@ typedef struct {
   BlockHeader header;
   FileControlBlock fcb;
   int num_entries;
-  int file_blocks[ (BLOCK_SIZE
+  int64_t file_blocks[ (BLOCK_SIZE
 		   -sizeof(BlockHeader)
 		   -sizeof(FileControlBlock)
-		    -sizeof(int))/sizeof(int) ];
+		    -sizeof(int))/sizeof(int64_t) ];
 } FirstDirectoryBlock;
 
 // this is remainder block of a directory
 typedef struct {
   BlockHeader header;
-  int file_blocks[ (BLOCK_SIZE-sizeof(BlockHeader))/sizeof(int) ];
+  int64_t file_blocks[ (BLOCK_SIZE-sizeof(BlockHeader))/sizeof(int64_t) ];
 } DirectoryBlock;
 /******************* stuff on disk END *******************/
 
 
 
 
+#define SFS_OPEN_BUCKETS 16        // first size of the open file table, doubled as it fills
+#define SFS_MAX_PENDING_BLOCKS 64  // pending data a handle keeps before allocating
+#define SFS_DIR_LOCKS 64           // directory locks, a directory uses first block % SFS_DIR_LOCKS
+
+/*
+   Locking. A SimpleFS can be used by several threads at once, as long as
+   a single handle is used by one thread at a time (SimpleFS_pread and
+   SimpleFS_pwrite excepted); SimpleFS_format needs the file system for itself. Locks are always taken in this order:
+     1. directory locks (dir_locks), read while looking a name up, write
+        while changing the entries. Operations needing several of them
+        take them by increasing slot (see SimpleFS_removeTree)
+     2. the open file table (table_lock)
+     3. the lock of an open file (OpenFileEntry.lock), held by every
+        operation on a FileHandle, shared only by SimpleFS_pread
+     4. the dentry cache lock, internal to DentryCache
+   the block allocator of DiskDriver is lock free.
+*/
+
+// in memory copy of the first block of an open file,
+// shared by all the handles opened on it
+typedef struct OpenFileEntry {
+  FirstFileBlock* fcb;             // the table is keyed by its header.block_in_disk
+  int refcount;                    // number of handles using it
+  int dirty;                       // changed since it was last written on disk
+  int generation;                  // bumped when the chain is cut by SimpleFS_truncate
+  int data_version;                // bumped whenever a handle writes a data block
+  pthread_rwlock_t lock;           // shared by SimpleFS_pread, exclusive for the rest
+  struct OpenFileEntry* next;      // next entry in the same bucket
+} OpenFileEntry;
   
 typedef struct {
   DiskDriver* disk;
+  DentryCache dcache;              // recently resolved names, see SimpleFS_lookupPath
+  OpenFileEntry** open_files;      // buckets of open files hashed on the first block, NULL if none
+  int open_buckets;                // size of open_files, a power of 2
+  int num_open;                    // entries in open_files
+  pthread_mutex_t table_lock;      // guards open_files and the refcounts of its entries
+  pthread_rwlock_t dir_locks[SFS_DIR_LOCKS];   // guard the entries of the directories
   // add more fields if needed
 } SimpleFS;
 
 // this is a file handle, used to refer to open files
 typedef struct {
   SimpleFS* sfs;                   // pointer to memory file system structure
-  FirstFileBlock* fcb;             // pointer to the first block of the file(read it)
-  FirstDirectoryBlock* directory;  // pointer to the directory where the file is stored
+  FirstFileBlock* fcb;             // pointer to the first block of the file (shared)
+  OpenFileEntry* entry;            // entry of the file in the open file table
   BlockHeader* current_block;      // current block in the file
-  int pos_in_file;                 // position of the cursor
+  int64_t pos_in_file;             // position of the cursor
+  int block_dirty;                 // current_block changed and not written yet
+  int write_back;                  // if set writes are buffered until a flush
+  FileBlock block_buf;             // holds current_block when it isn't the first one
+  int generation;                  // generation of the entry seen by the cursor
+  int block_version;               // data_version of the entry when block_buf was loaded
+  char* pending;                   // data appended in write back mode, not allocated yet
+  int64_t pending_start;           // position in the file of the pending data
+  int pending_size;
+  int pending_capacity;
 } FileHandle;
 
+// dcb is a private copy, operations on the handle reload it
+// under the directory lock before using it. The cursor is moved by
+// SimpleFS_nextEntry: in a tree directory current_block is unused and the
+// cursor is the leaf tree_leaf, with pos_in_block the next key in it
 typedef struct {
   SimpleFS* sfs;                   // pointer to memory file system structure
   FirstDirectoryBlock* dcb;        // pointer to the first block of the directory(read it)
@@ -86,8 +141,24 @@ typedef struct {
   BlockHeader* current_block;      // current block in the directory
   int pos_in_dir;                  // absolute position of the cursor in the directory
   int pos_in_block;                // relative position of the cursor in the block
+  DirectoryBlock block_buf;        // holds current_block when it isn't the first one
+  int64_t tree_leaf;               // leaf of the cursor in a tree directory
+  int64_t last_entry;              // first block of the last entry returned
+  char last_name[128];             // and its name, to find the place again
 } DirectoryHandle;
 
+// an entry of a directory, filled by SimpleFS_nextEntry
+typedef struct {
+  char name[128];
+  int64_t block;                   // first block of the entry
+  int64_t size_in_bytes;
+  int is_dir;                      // as in FileControlBlock
+} SimpleFSEntry;
+
+// called by SimpleFS_walk for each entry, path is relative to the directory
+// the walk started from. 0 to go on, any other value stops the walk
+typedef int (*SimpleFSWalkFn)(const char* path, const SimpleFSEntry* entry, void* arg);
+
 // initializes a file system on an already made disk
 // returns a handle to the top level directory stored in the first block
 DirectoryHandle* SimpleFS_init(SimpleFS* fs, DiskDriver* disk);
@@ -104,33 +175,128 @@ void SimpleFS_format(SimpleFS* fs);
 // an empty file consists only of a block of type FirstBlock
 int SimpleFS_createFile(DirectoryHandle* d, const char* filename);
 
+// creates the n empty files named in names in the directory d, all or none:
+// the directory is read once to check that none of them exists, their first
+// blocks are taken as a run and each directory block changed is written once
+// 0 on success, -1 on error (a name existing or repeated, no free blocks)
+int SimpleFS_createFiles(DirectoryHandle* d, const char** names, int n);
+
 // reads in the (preallocated) blocks array, the name of all files in a directory 
+// (in name order if it is a tree directory)
 int SimpleFS_readDir(char** names, DirectoryHandle* d);
 
+// reads in names up to max names (allocated with malloc) of the entries of d
+// starting with prefix ("" or NULL for all), in name order and only the ones
+// after the name after if it isn't NULL: a large directory is listed in pages
+// passing the last name of a page as after of the next one.
+// A tree directory is read from the first match on, the others are read whole
+// and sorted. Returns the number of names read, -1 on error
+int SimpleFS_scanDir(DirectoryHandle* d, const char* prefix, const char* after,
+                     char** names, int max);
+
+
+// moves the cursor of d back before the first entry, where SimpleFS_openDir
+// and SimpleFS_changeDir leave it. 0 on success, -1 on error
+int SimpleFS_rewindDir(DirectoryHandle* d);
+
+// copies in entry the entry after the cursor of d and moves the cursor past it.
+// Directory blocks are read one at a time into the handle, so listing takes
+// constant memory whatever the size of the directory; a tree directory is
+// read in name order. As with readdir, entries added or removed after the
+// last rewind may or may not be returned.
+// Returns 1 if an entry was read, 0 at the end, -1 on error
+int SimpleFS_nextEntry(DirectoryHandle* d, SimpleFSEntry* entry);
+
+// calls fn for every file and directory below the directory at path
+// (relative to d), depth first and each directory before its entries.
+// Memory grows with the depth of the tree, not with the size of the
+// directories; the next directory block and entries are prefetched while
+// fn runs. Returns 0 after the whole tree, -1 on error, or the value of fn
+// that stopped the walk
+int SimpleFS_walk(DirectoryHandle* d, const char* path, SimpleFSWalkFn fn, void* arg);
 
 // opens a file in the  directory d. The file should be exisiting
+// handles opened on the same file share its first block in memory
 FileHandle* SimpleFS_openFile(DirectoryHandle* d, const char* filename);
 
 
 // closes a file handle (destroyes it)
-int SimpleFS_close(FileHandle* f);
+// the first block is written back when its last handle is closed
+int SimpleFS_closeFile(FileHandle* f);
+
+// opens a new handle on the directory at path, relative to d ("/" for the top level)
+// each thread should use its own handles. Returns NULL on error
+DirectoryHandle* SimpleFS_openDir(DirectoryHandle* d, const char* path);
+
+// closes a directory handle (destroyes it)
+int SimpleFS_closeDir(DirectoryHandle* d);
 
 // writes in the file, at current position for size bytes stored in data
 // overwriting and allocating new space if necessary
 // returns the number of bytes written
+// in write back mode the block under the cursor and the first block
+// are only written when the cursor leaves them, on flush or on close.
+// Data appended past the last block isn't given blocks until the handle
+// is flushed, read, seeked or has SFS_MAX_PENDING_BLOCKS of it, so a
+// full disk may only be reported then
 int SimpleFS_write(FileHandle* f, void* data, int size);
 
+// writes on disk the data buffered by the handle and the file metadata
+// 0 on success, -1 on error
+int SimpleFS_flush(FileHandle* f);
+
+// enables (1) or disables (0) write back mode on the handle,
+// disabling it flushes the pending data. Handles start in write through mode
+int SimpleFS_setWriteBack(FileHandle* f, int enable);
+
 // writes in the file, at current position size bytes stored in data
 // overwriting and allocating new space if necessary
 // returns the number of bytes read
 int SimpleFS_read(FileHandle* f, void* data, int size);
 
+// reads up to size bytes from position offset of the file, without using
+// or moving the cursor. Several threads can call it at once on one handle,
+// reads of the same file run in parallel
+// returns the number of bytes read, 0 past the end of the file, -1 on error
+int SimpleFS_pread(FileHandle* f, void* data, int size, int64_t offset);
+
+// writes size bytes of data at position offset of the file, growing it if
+// needed, without moving the cursor. Safe to call from several threads on
+// one handle; writes to the same file are serialized
+// returns the number of bytes written, -1 on error
+int SimpleFS_pwrite(FileHandle* f, void* data, int size, int64_t offset);
+
+// returns a read only view of len bytes from position offset of the file,
+// NULL if the range isn't all in the file. A range inside a single block
+// points straight into the disk (or the shared first block), without copying;
+// a longer one is gathered into a private copy. The view must be released with
+// SimpleFS_unmapFile before the handle is closed; a view without copy shows
+// later writes to its block, and is invalidated by truncating the file
+const void* SimpleFS_mapFile(FileHandle* f, int64_t offset, int len);
+
+// releases a view returned by SimpleFS_mapFile
+void SimpleFS_unmapFile(FileHandle* f, const void* view);
+
 // returns the number of bytes read (moving the current pointer to pos)
 // returns pos on success
 // -1 on error (file too short)
-int SimpleFS_seek(FileHandle* f, int pos);
+int64_t SimpleFS_seek(FileHandle* f, int64_t pos);
+
+// preallocates the blocks needed to store size bytes, without writing
+// data or changing the size of the file. New blocks are taken as a single
+// contiguous run when the disk has one
+// 0 on success, -1 on error (not enough free blocks)
+int SimpleFS_reserve(FileHandle* f, int64_t size);
+
+// sets the size of the file to size bytes. Growing a file fills it with
+// zeros, shrinking it releases all the blocks after the new end
+// (also the ones preallocated by SimpleFS_reserve) in batches.
+// The cursor is moved to the new end if it was past it
+// 0 on success, -1 on error
+int SimpleFS_truncate(FileHandle* f, int64_t size);
 
 // seeks for a directory in d. If dirname is equal to ".." it goes one level up
+// dirname can also be a path, resolved with SimpleFS_lookupPath
 // 0 on success, negative value on error
 // it does side effect on the provided handle
  int SimpleFS_changeDir(DirectoryHandle* d, char* dirname);
@@ -140,11 +306,91 @@ int SimpleFS_seek(FileHandle* f, int pos);
 // -1 on error
 int SimpleFS_mkDir(DirectoryHandle* d, char* dirname);
 
+// same as SimpleFS_mkDir, but the new directory keeps its entries in a
+// B+tree ordered by name (see dir_tree.h): lookups, inserts and removals
+// take a logarithmic number of block reads, meant for directories with
+// very many entries. Its entries don't move, and are read in name order
+int SimpleFS_mkDirTree(DirectoryHandle* d, char* dirname);
+
 // removes the file in the current directory
-// returns -1 on failure 0 on success
+// returns -1 on failure (also if the file is open) 0 on success
 // if a directory, it removes recursively all contained files
 int SimpleFS_remove(DirectoryHandle* d, char* filename);
 
+// resolves path to the first block of the file or directory it names
+// absolute paths start from "/", relative ones from the directory d
+// "." and ".." are allowed as components
+// returns -1 if some component doesn't exist or isn't a directory
+int64_t SimpleFS_lookupPath(DirectoryHandle* d, const char* path);
+
+// same as SimpleFS_openFile, SimpleFS_createFile and SimpleFS_remove
+// but the last component of path is looked up in the directory
+// named by the rest of the path
+FileHandle* SimpleFS_openFilePath(DirectoryHandle* d, const char* path);
+int SimpleFS_createFilePath(DirectoryHandle* d, const char* path);
+int SimpleFS_removePath(DirectoryHandle* d, const char* path);
+
+// removes the file or directory at path with everything below it, walking the
+// tree without recursion. The whole tree is locked, nothing is removed if a file
+// in it is open; the parent directory is written once and blocks are freed in batches
+// 0 on success, -1 on error
+int SimpleFS_removeTree(DirectoryHandle* d, const char* path);
+
+// fragmentation of the files below a point of the tree. The blocks of a
+// chain that follow each other on disk form an extent, so a file laid out
+// in a single run has one extent
+typedef struct {
+  int64_t files;
+  int64_t blocks;                  // blocks in the chains of the files
+  int64_t extents;                 // runs of contiguous blocks in the chains
+  int64_t free_extents;            // runs of free blocks on the whole disk
+  double score;                    // 0 if every file is a single extent,
+                                   // 1 if no two of their blocks are contiguous
+} SimpleFSFragmentation;
+
+// fills frag for the file at path, or for every file below it if it is a
+// directory ("/" for the whole disk). Chains are read without stopping
+// writers, so the result is a snapshot. 0 on success, -1 on error
+int SimpleFS_fragmentation(DirectoryHandle* d, const char* path, SimpleFSFragmentation* frag);
+
+// moves the chain of the file at path, or of every file below it if it is a
+// directory, into a contiguous run of free blocks taken from the start of the
+// disk: the links of the blocks and the entry in the parent directory are
+// rewritten, then the old blocks are freed. A file is left in place when it
+// is open, a directory or already a single extent, or when no better
+// layout is free. Returns the number of files moved, -1 on error
+int SimpleFS_defrag(DirectoryHandle* d, const char* path);
+
+// packs the small files at path, or below it if it is a directory, into
+// blocks shared by the files of a directory (see pack.h): a packed file takes
+// a slot with its name and data instead of a whole first block. A file is
+// left as it is when it is open or bigger than PACK_MAX_RECORD with its name,
+// and is moved back to a block of its own the first time it is changed.
+// Returns the number of files packed, -1 on error
+int SimpleFS_pack(DirectoryHandle* d, const char* path);
+
+// copies the host file at host_path into the file at path, relative to d,
+// which is created or emptied. A host directory is copied with everything
+// below it into the directory at path, made if missing; other kinds of
+// files are skipped. Data is streamed a large buffer at a time, so files of
+// any size are copied in constant memory. Returns the bytes copied, -1 on
+// error (what was copied before the error stays)
+int64_t SimpleFS_importFile(DirectoryHandle* d, const char* host_path, const char* path);
+
+// copies the file at path, relative to d, into the host file host_path,
+// created or truncated; a directory is copied with everything below it.
+// The data goes to the host straight from the mapping of the disk, without
+// copying it first. Returns the bytes copied, -1 on error
+int64_t SimpleFS_exportFile(DirectoryHandle* d, const char* path, const char* host_path);
+
+// fills stats with the calls, bytes and latencies of every SimpleFS_* and
+// DiskDriver_* function and the counters of the disk since the last reset,
+// for all the threads of the process (see stats.h)
+void SimpleFS_getStats(Stats* stats);
+
+// starts counting the statistics again from zero
+void SimpleFS_resetStats(void);
+
 
   
 
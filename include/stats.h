@@ -0,0 +1,151 @@
+#pragma once
+#include <stdint.h>
+#include <common.h>
+
+/*
+   Statistics of the public SimpleFS_* and DiskDriver_* functions: calls,
+   bytes moved and a histogram of the latencies on a log scale, plus a few
+   counters of the disk (blocks read, written, allocated, freed and bits of
+   the bitmap scanned). Entry points calling each other are counted each.
+
+   Calls, bytes and counters are exact; reading the clock costs as much as
+   a block copy, so only one call every STATS_SAMPLE of each function (per
+   thread, the first one included) is timed and goes in the histogram.
+   Every thread updates its own shard without locks or atomic read-modify-write;
+   Stats_get sums the shards and a thread leaving folds its shard in the
+   ones of the threads gone. Stats_reset doesn't touch the shards, it only
+   moves the baseline subtracted by Stats_get.
+   Building with SFS_STATS set to 0 removes the instrumentation.
+*/
+
+#define STATS_BUCKETS 32     // bucket i counts calls taking [2^(i-1), 2^i) ns, the last one more
+#define STATS_SAMPLE  16     // one call every STATS_SAMPLE is timed, 1 to time them all
+
+typedef enum {
+  STATS_SFS_INIT,
+  STATS_SFS_FORMAT,
+  STATS_SFS_CREATE_FILE,
+  STATS_SFS_CREATE_FILES,
+  STATS_SFS_READ_DIR,
+  STATS_SFS_SCAN_DIR,
+  STATS_SFS_REWIND_DIR,
+  STATS_SFS_NEXT_ENTRY,
+  STATS_SFS_WALK,
+  STATS_SFS_OPEN_FILE,
+  STATS_SFS_CLOSE_FILE,
+  STATS_SFS_OPEN_DIR,
+  STATS_SFS_CLOSE_DIR,
+  STATS_SFS_CHANGE_DIR,
+  STATS_SFS_MKDIR,
+  STATS_SFS_MKDIR_TREE,
+  STATS_SFS_REMOVE,
+  STATS_SFS_REMOVE_TREE,
+  STATS_SFS_LOOKUP_PATH,
+  STATS_SFS_OPEN_FILE_PATH,
+  STATS_SFS_CREATE_FILE_PATH,
+  STATS_SFS_REMOVE_PATH,
+  STATS_SFS_READ,
+  STATS_SFS_WRITE,
+  STATS_SFS_PREAD,
+  STATS_SFS_PWRITE,
+  STATS_SFS_MAP_FILE,
+  STATS_SFS_UNMAP_FILE,
+  STATS_SFS_SEEK,
+  STATS_SFS_FLUSH,
+  STATS_SFS_SET_WRITE_BACK,
+  STATS_SFS_RESERVE,
+  STATS_SFS_TRUNCATE,
+  STATS_SFS_FRAGMENTATION,
+  STATS_SFS_DEFRAG,
+  STATS_SFS_PACK,
+  STATS_SFS_IMPORT_FILE,
+  STATS_SFS_EXPORT_FILE,
+  STATS_DD_OPEN,
+  STATS_DD_READ_BLOCK,
+  STATS_DD_PEEK_BLOCK,
+  STATS_DD_MAP_BLOCK,
+  STATS_DD_PREFETCH_BLOCK,
+  STATS_DD_CONTAINS,
+  STATS_DD_WRITE_BLOCK,
+  STATS_DD_FREE_BLOCK,
+  STATS_DD_FREE_BLOCKS,
+  STATS_DD_GET_FREE_BLOCK,
+  STATS_DD_GET_FREE_RUN,
+  STATS_DD_CLAIM_BLOCK,
+  STATS_DD_ALLOC_BLOCK,
+  STATS_DD_FLUSH,
+  STATS_DD_CLOSE,
+  STATS_DD_SAVE,
+  STATS_DD_CLEAR,
+  STATS_DD_REBUILD,
+  STATS_DD_PRINT,
+  STATS_DD_START_TRACE,
+  STATS_DD_STOP_TRACE,
+  STATS_NUM_OPS
+} StatsOpId;
+
+typedef enum {
+  STATS_BLOCKS_READ,
+  STATS_BLOCKS_WRITTEN,
+  STATS_BLOCKS_ALLOCATED,
+  STATS_BLOCKS_FREED,
+  STATS_BITS_SCANNED,
+  STATS_NUM_COUNTERS
+} StatsCounterId;
+
+typedef struct {
+  int64_t calls;
+  int64_t bytes;                   // data read or written, for the calls moving data
+  int64_t timed;                   // calls timed, one every STATS_SAMPLE
+  int64_t total_ns;                // time taken by the calls timed
+  int64_t histogram[STATS_BUCKETS];
+} StatsOp;
+
+typedef struct {
+  StatsOp ops[STATS_NUM_OPS];
+  int64_t counters[STATS_NUM_COUNTERS];
+} Stats;
+
+// a running measure of an entry point, see STATS_TIME
+typedef struct {
+  StatsOpId op;
+  uint64_t start;                  // 0 if the call isn't timed
+} StatsTimer;
+
+// starts the measure of a call of op
+StatsTimer Stats_start(StatsOpId op);
+
+// ends the measure started by timer
+void Stats_stop(StatsTimer* timer);
+
+// adds bytes to the data moved by op
+void Stats_addBytes(StatsOpId op, int64_t bytes);
+
+// adds n to counter
+void Stats_add(StatsCounterId counter, int64_t n);
+
+// fills stats with the figures since the last Stats_reset
+void Stats_get(Stats* stats);
+
+// starts counting again from zero
+void Stats_reset(void);
+
+// name of op and of counter, for printing
+const char* Stats_opName(StatsOpId op);
+const char* Stats_counterName(StatsCounterId counter);
+
+// latency (upper bound of its bucket, in ns) under which a share
+// fraction (0 to 1) of the timed calls of op fall, 0 if none was timed
+uint64_t Stats_percentile(const StatsOp* op, double fraction);
+
+#if SFS_STATS
+// times the rest of the enclosing function, whatever return it leaves from
+#define STATS_TIME(op) \
+    StatsTimer stats_timer __attribute__((cleanup(Stats_stop))) = Stats_start(op)
+#define STATS_BYTES(op, bytes) Stats_addBytes((op), (bytes))
+#define STATS_ADD(counter, n)  Stats_add((counter), (n))
+#else
+#define STATS_TIME(op)         do { } while (0)
+#define STATS_BYTES(op, bytes) do { } while (0)
+#define STATS_ADD(counter, n)  do { } while (0)
+#endif
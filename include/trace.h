@@ -0,0 +1,83 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+   Block I/O trace of a disk. Every read, write, allocation and free done by
+   the DiskDriver is stored as a 16 byte record (time since the start of the
+   trace, block, operation) in a ring shared by all the threads: a thread
+   reserves a slot with a compare and swap and publishes it with a sequence
+   number, a background thread drains the ring to the file.
+   When the ring is full the record is dropped and counted instead of
+   stalling the I/O; TRACE_RING slots absorb the bursts between two drains.
+
+   The file is a TraceHeader followed by the records in the order the slots
+   were reserved, which is the time order up to the skew between threads.
+   tools/replay runs a trace again on a disk.
+*/
+
+#define TRACE_MAGIC    0x54534653      // "SFST"
+#define TRACE_VERSION  1
+#define TRACE_RING     (1 << 18)       // slots of the ring (6 MB), a power of 2
+#define TRACE_DRAIN_MS 10              // the drainer wakes at least this often
+
+typedef enum {
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_ALLOC,
+  TRACE_FREE,
+  TRACE_FLUSH,                         // of the whole disk, block is 0
+  TRACE_NUM_OPS
+} TraceOp;
+
+typedef struct {
+  uint64_t time_ns;                    // since the start of the trace
+  uint64_t block_op;                   // block << 8 | op
+} TraceRecord;
+
+#define TRACE_BLOCK(rec) ((int64_t) ((rec)->block_op >> 8))
+#define TRACE_OP(rec)    ((TraceOp) ((rec)->block_op & 0xff))
+
+// first bytes of a trace file, rewritten when the trace stops
+typedef struct {
+  int magic;                           // TRACE_MAGIC
+  int version;                         // TRACE_VERSION
+  int64_t num_blocks;                  // of the disk traced
+  int64_t records;                     // in the file
+  int64_t dropped;                     // lost because the ring was full
+} TraceHeader;
+
+typedef struct {
+  uint64_t seq;                        // position + 1 once the record is written
+  TraceRecord rec;
+} TraceSlot;
+
+typedef struct {
+  TraceSlot* ring;
+  uint64_t head;                       // next position to reserve
+  uint64_t tail;                       // next position to drain
+  int64_t dropped;
+  uint64_t start_ns;
+  FILE* file;
+  TraceHeader header;
+  int write_error;                     // set by the drain once a write falls short
+  pthread_t drainer;
+  pthread_mutex_t lock;                // guards stopping, for the drainer
+  pthread_cond_t wake;
+  int stopping;
+} Trace;
+
+// creates filename and starts the drainer, for a disk of num_blocks blocks
+// returns NULL if the file or the thread can't be made
+Trace* Trace_start(const char* filename, int64_t num_blocks);
+
+// appends op on block to the trace, from any thread
+void Trace_record(Trace* trace, TraceOp op, int64_t block_num);
+
+// drains what is left, completes the header and closes the file
+// returns the number of records dropped, -1 if the file couldn't be written
+int64_t Trace_stop(Trace* trace);
+
+// name of op, for printing
+const char* Trace_opName(TraceOp op);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <simplefs.h>
 
 #define MAX_COMMAND_LENGTH 256
@@ -27,9 +28,10 @@ void format(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 }
 
 /*
- * empty dir
+ * empty dir. Static, a global mkdir would take the place of the one of libc
+ * in the whole program (SimpleFS_exportFile makes host directories)
  */
-void mkdir(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+static void mkdir(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 
     if (argc != 2) {
         printf("Usage: mkdir <dirname>\n");
@@ -41,6 +43,21 @@ void mkdir(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
         fprintf(stderr, "An error occurred in creating new directory.\n");
 }
 
+/*
+ * empty dir keeping its entries in a B+tree, for large directories
+ */
+void mkbtree(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    if (argc != 2) {
+        printf("Usage: mkbtree <dirname>\n");
+        return;
+    }
+
+    int ret = SimpleFS_mkDirTree(current_dir, argv[1]);
+    if (ret == -1) 
+        fprintf(stderr, "An error occurred in creating new directory.\n");
+}
+
 // print the content of the file
 
 void cat(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
@@ -49,28 +66,97 @@ void cat(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
         printf("Usage: cat <filename>\n");
         return;
     }
-    FileHandle* fh = SimpleFS_openFile(current_dir, argv[1]);
+    FileHandle* fh = SimpleFS_openFilePath(current_dir, argv[1]);
     if (fh == NULL) {
         fprintf(stderr, "An error occurred in opening file.\n");
         return;
     }
 
-    int file_size = fh->fcb->fcb.size_in_bytes;
-    char* str = calloc(file_size + 1, sizeof(char));
-    int ret = SimpleFS_read(fh, str, file_size);
+    // files can be larger than memory, they are printed a piece at a time
+    char str[MAX_INPUT_SIZE];
+    int ret;
+    while ((ret = SimpleFS_read(fh, str, sizeof(str))) > 0)
+        fwrite(str, 1, ret, stdout);
     if (ret == -1) {
         fprintf(stderr, "An error occurred in reading from file.\n");
-        free(str);
         SimpleFS_closeFile(fh);
         return;
     }
 
-    printf("%s\n", str);
+    printf("\n");
+    SimpleFS_closeFile(fh);
+}
 
-    free(str);
+/*
+ * Appends the text after the name to the file, creating it if missing.
+ * Not called write, that name belongs to libc.
+ */
+void write_text(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    char* text = argc == 2 ? strchr(argv[1], ' ') : NULL;
+    if (text == NULL) {
+        printf("Usage: write <filename> <text>\n");
+        return;
+    }
+    *text++ = 0;
+
+    FileHandle* fh = SimpleFS_openFilePath(current_dir, argv[1]);
+    if (fh == NULL && SimpleFS_createFilePath(current_dir, argv[1]) == 0)
+        fh = SimpleFS_openFilePath(current_dir, argv[1]);
+    if (fh == NULL) {
+        fprintf(stderr, "An error occurred in opening file.\n");
+        return;
+    }
+    int len = strlen(text);
+    if (SimpleFS_seek(fh, fh->fcb->fcb.size_in_bytes) == -1 ||
+            SimpleFS_write(fh, text, len) != len)
+        fprintf(stderr, "An error occurred in writing to file.\n");
     SimpleFS_closeFile(fh);
 }
 
+// last component of path, without the trailing slashes
+static char* base_name(char* path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = 0;
+    char* slash = strrchr(path, '/');
+    return slash != NULL && slash[1] != 0 ? slash + 1 : path;
+}
+
+/*
+ * Copies a file or a directory of the host into the current directory.
+ */
+void put(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    if (argc != 2) {
+        printf("Usage: put <host path>\n");
+        return;
+    }
+
+    int64_t ret = SimpleFS_importFile(current_dir, argv[1], base_name(argv[1]));
+    if (ret == -1)
+        fprintf(stderr, "An error occurred in copying from the host.\n");
+    else
+        printf("%" PRId64 " bytes copied.\n", ret);
+}
+
+/*
+ * Copies a file or a directory into the working directory of the host.
+ */
+void get(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    if (argc != 2) {
+        printf("Usage: get <path>\n");
+        return;
+    }
+
+    int64_t ret = SimpleFS_exportFile(current_dir, argv[1], base_name(argv[1]));
+    if (ret == -1)
+        fprintf(stderr, "An error occurred in copying to the host.\n");
+    else
+        printf("%" PRId64 " bytes copied.\n", ret);
+}
+
 void touch(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 
     if (argc != 2) {
@@ -78,7 +164,7 @@ void touch(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
         return;
     }
 
-    int ret = SimpleFS_createFile(current_dir, argv[1]);
+    int ret = SimpleFS_createFilePath(current_dir, argv[1]);
     if (ret == -1) 
         fprintf(stderr, "An error occurred in creating new file.\n");
 }
@@ -96,27 +182,35 @@ void cd(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 }
 
 /*
- * List the content.
+ * List the content, or only the names starting with a prefix.
  */
 void ls(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 
-    if (argc != 1) {
-        printf("Usage: ls\n");
+    if (argc == 1) {
+        // streamed an entry at a time, whatever the size of the directory
+        SimpleFSEntry entry;
+        int ret = SimpleFS_rewindDir(current_dir);
+        while (ret != -1 && (ret = SimpleFS_nextEntry(current_dir, &entry)) == 1)
+            printf("%s%s\n", entry.is_dir ? "dir: " : "file: ", entry.name);
+        if (ret == -1)
+            fprintf(stderr, "An error occurred while listing files and dirs.\n");
         return;
     }
 
     int i;
-    char** names = calloc(current_dir->dcb->num_entries, sizeof(char*));
-    int ret = SimpleFS_readDir(names, current_dir);
+    int num = current_dir->dcb->num_entries;
+    char** names = calloc(num, sizeof(char*));
+    int ret = SimpleFS_scanDir(current_dir, argv[1], NULL, names, num);
     if (ret == -1) {
         fprintf(stderr, "An error occurred while listing files and dirs.\n");
-        for (i = 0; i < current_dir->dcb->num_entries; i++) 
+        for (i = 0; i < num; i++) 
             free(names[i]);   
         free(names);
         return;
     }
+    num = ret;
 
-    for (i = 0; i < current_dir->dcb->num_entries; i++) {
+    for (i = 0; i < num; i++) {
         
         FileHandle* something = SimpleFS_openFile(current_dir, names[i]);
         if (something == NULL) printf("dir: ");
@@ -128,7 +222,7 @@ void ls(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
         printf("%s\n", names[i]);
     }
 
-    for (i = 0; i < current_dir->dcb->num_entries; i++) 
+    for (i = 0; i < num; i++) 
         free(names[i]);   
     free(names);
 }
@@ -143,66 +237,136 @@ void rm(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
         return;
     }
 
-    int ret = SimpleFS_remove(current_dir, argv[1]);
+    int ret = SimpleFS_removePath(current_dir, argv[1]);
     if (ret == -1) 
         fprintf(stderr, "An error occurred in removing.\n");
 }
 
-/*
- * Removes a dir even if it is not empty.
- */
-void rmf_aux(DirectoryHandle* p, char* name) {
+void rmf(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    if (argc != 2) {
+        printf("Usage: rmf <dirname>\n");
+        return;
+    }
     
-    int ret = SimpleFS_remove(p, name);
-    if (ret == -1) {
-        ret = SimpleFS_changeDir(p, name);
-        if (ret == -1) {
-            fprintf(stderr, "An error occurred while changing dir.\n");
-            return; 
-        }
+    if (strcmp(argv[1], "/") == 0) {
+        printf("Maybe another day\n");
+        return;
+    }
 
-        int i;
-        char** names = calloc(p->dcb->num_entries, sizeof(char*));
-        int ret = SimpleFS_readDir(names, p);
-        if (ret == -1) {
-            fprintf(stderr, "An error occurred while listing files and dirs.\n");
-            for (i = 0; i < p->dcb->num_entries; i++) 
-                free(names[i]);   
-            free(names);
-            return;
-        }
+    int ret = SimpleFS_removeTree(current_dir, argv[1]);
+    if (ret == -1)
+        fprintf(stderr, "An error occurred in removing.\n");
+}
 
-        int entries = p->dcb->num_entries;
-        for (i = 0; i < entries; i++) { 
-            rmf_aux(p, names[i]);
-        }
+/*
+ * Moves the files below a path into contiguous blocks, printing
+ * the fragmentation before and after.
+ */
+void defrag(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 
-        SimpleFS_changeDir(p, "..");
+    if (argc != 2) {
+        printf("Usage: defrag <path>\n");
+        return;
+    }
 
-        for (i = 0; i < entries; i++) 
-            free(names[i]);   
-        free(names);
+    SimpleFSFragmentation frag;
+    if (SimpleFS_fragmentation(current_dir, argv[1], &frag) == -1) {
+        fprintf(stderr, "An error occurred in reading the files.\n");
+        return;
+    }
+    printf("before: %" PRId64 " files, %" PRId64 " blocks, %" PRId64 " extents, score %.3f\n",
+           frag.files, frag.blocks, frag.extents, frag.score);
 
-        ret = SimpleFS_remove(p, name);
-        if (ret == -1)      
-            fprintf(stderr, "An error occurred in removing.\n");
+    int ret = SimpleFS_defrag(current_dir, argv[1]);
+    if (ret == -1 || SimpleFS_fragmentation(current_dir, argv[1], &frag) == -1) {
+        fprintf(stderr, "An error occurred in moving the files.\n");
+        return;
     }
+    printf("after: %d files moved, %" PRId64 " extents, score %.3f, %" PRId64 " free extents\n",
+           ret, frag.extents, frag.score, frag.free_extents);
 }
 
-void rmf(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+/*
+ * Packs the small files below a path into shared blocks,
+ * printing the blocks used before and after.
+ */
+void pack(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
 
     if (argc != 2) {
-        printf("Usage: rmf <dirname>\n");
+        printf("Usage: pack <path>\n");
         return;
     }
-    
-    if (strcmp(argv[1], "/") == 0) {
-        printf("Maybe another day\n");
+
+    SimpleFSFragmentation frag;
+    if (SimpleFS_fragmentation(current_dir, argv[1], &frag) == -1) {
+        fprintf(stderr, "An error occurred in reading the files.\n");
+        return;
+    }
+    int64_t used = disk.header->num_blocks - disk.header->free_blocks;
+    printf("before: %" PRId64 " files, %" PRId64 " blocks used on the disk\n", frag.files, used);
+
+    int ret = SimpleFS_pack(current_dir, argv[1]);
+    if (ret == -1) {
+        fprintf(stderr, "An error occurred in packing the files.\n");
+        return;
+    }
+    used = disk.header->num_blocks - disk.header->free_blocks;
+    printf("after: %d files packed, %" PRId64 " blocks used on the disk\n", ret, used);
+}
+
+/*
+ * Prints the calls and latencies of the functions used so far,
+ * or starts counting again with "stats reset".
+ */
+void stats(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        SimpleFS_resetStats();
+        return;
+    }
+    if (argc != 1) {
+        printf("Usage: stats [reset]\n");
         return;
     }
 
-    DirectoryHandle* parent = current_dir;
-    rmf_aux(parent, argv[1]);
+    Stats st;
+    SimpleFS_getStats(&st);
+    printf("%-26s %10s %12s %10s %10s %10s\n", "function", "calls", "bytes", "avg ns", "p50 ns", "p99 ns");
+    int op;
+    for (op = 0; op < STATS_NUM_OPS; op++) {
+        StatsOp* entry = &st.ops[op];
+        if (entry->calls == 0)
+            continue;
+        printf("%-26s %10" PRId64 " %12" PRId64 " %10" PRId64 " %10" PRIu64 " %10" PRIu64 "\n",
+               Stats_opName(op), entry->calls, entry->bytes, entry->timed ? entry->total_ns / entry->timed : 0,
+               Stats_percentile(entry, 0.5), Stats_percentile(entry, 0.99));
+    }
+    int counter;
+    for (counter = 0; counter < STATS_NUM_COUNTERS; counter++)
+        printf("%s: %" PRId64 "\n", Stats_counterName(counter), st.counters[counter]);
+}
+
+/*
+ * Starts recording the block operations of the disk in a file,
+ * to run them again with tools/replay; "trace" alone stops it.
+ */
+void trace(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
+
+    if (argc == 2) {
+        if (DiskDriver_startTrace(&disk, argv[1]) == -1)
+            fprintf(stderr, "Cannot start the trace.\n");
+        return;
+    }
+    if (disk.trace == NULL) {
+        fprintf(stderr, "No trace to stop.\n");
+        return;
+    }
+    int64_t dropped = DiskDriver_stopTrace(&disk);
+    if (dropped == -1)
+        fprintf(stderr, "Cannot write the trace.\n");
+    else if (dropped > 0)
+        printf("%" PRId64 " records dropped.\n", dropped);
 }
 
 void help(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
@@ -214,12 +378,20 @@ void help(int argc, char* argv[MAX_ARGUMENTS_NUM + 1]) {
     printf("Available commands:\n");
     printf("format: formats the disk.\n");
     printf("mkdir: create a new directory in the current one.\n");
+    printf("mkbtree: create a new directory indexed by name, for many entries.\n");
+    printf("write: append some text to a file.\n");
     printf("cat: prints out the content of an existing file.\n");
+    printf("put: copy a file or a directory of the host into the current directory.\n");
+    printf("get: copy a file or a directory into the working directory of the host.\n");
     printf("touch: create a new empty file in the current directory.\n");
     printf("cd: change the current directory.\n");
-    printf("ls: list all the files in the current directory.\n");
+    printf("ls: list all the files in the current directory (starting with a prefix, if given).\n");
     printf("rm: remove a file or an empty directory.\n");
     printf("rmf: remove a file or a not empty directory.\n");
+    printf("defrag: move the files below a path into contiguous blocks.\n");
+    printf("pack: pack the small files below a path into shared blocks.\n");
+    printf("stats: print the calls and latencies of the file system functions (reset them with 'stats reset').\n");
+    printf("trace: record the block operations in a file (stop with 'trace' alone).\n");
     printf("help: command inception.\n");
     printf("exit: exit the shell.\n");
 }
@@ -245,8 +417,17 @@ void do_command_loop(void) {
         else if (strcmp(argv[0], "mkdir") == 0) {
             mkdir(argc, argv); 
         }
+        else if (strcmp(argv[0], "mkbtree") == 0) {
+            mkbtree(argc, argv); 
+        }
         else if (strcmp(argv[0], "write") == 0) {
-            write(argc, argv); 
+            write_text(argc, argv); 
+        }
+        else if (strcmp(argv[0], "put") == 0) {
+            put(argc, argv); 
+        }
+        else if (strcmp(argv[0], "get") == 0) {
+            get(argc, argv); 
         }
         else if (strcmp(argv[0], "cat") == 0) {
             cat(argc, argv); 
@@ -267,6 +448,18 @@ void do_command_loop(void) {
         else if (strcmp(argv[0], "rmf") == 0) {
             rmf(argc, argv); 
         }
+        else if (strcmp(argv[0], "defrag") == 0) {
+            defrag(argc, argv); 
+        }
+        else if (strcmp(argv[0], "pack") == 0) {
+            pack(argc, argv); 
+        }
+        else if (strcmp(argv[0], "stats") == 0) {
+            stats(argc, argv); 
+        }
+        else if (strcmp(argv[0], "trace") == 0) {
+            trace(argc, argv); 
+        }
         
         else if (strcmp(argv[0], "help") == 0) {
             help(argc, argv); 
@@ -274,6 +467,7 @@ void do_command_loop(void) {
         else if (strcmp(argv[0], "exit") == 0) {
             printf("Finished!\n");
             SimpleFS_closeDir(current_dir);
+            DiskDriver_close(&disk);
             exit(EXIT_SUCCESS);
         }
         else {
@@ -0,0 +1,190 @@
+#include <async_fs.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+static void AsyncFS_run(AsyncFSWorker* worker, AsyncFSRequest* req) {
+
+    switch (req->op) {
+    case ASYNCFS_OPEN:
+        req->file = SimpleFS_openFilePath(worker->root, req->path);
+        req->result = req->file == NULL ? -1 : 0;
+        break;
+    case ASYNCFS_CLOSE:
+        req->result = SimpleFS_closeFile(req->file);
+        break;
+    case ASYNCFS_READ:
+        req->result = SimpleFS_read(req->file, req->data, req->size);
+        break;
+    case ASYNCFS_WRITE:
+        req->result = SimpleFS_write(req->file, req->data, req->size);
+        break;
+    case ASYNCFS_PREAD:
+        req->result = SimpleFS_pread(req->file, req->data, req->size, req->offset);
+        break;
+    case ASYNCFS_PWRITE:
+        req->result = SimpleFS_pwrite(req->file, req->data, req->size, req->offset);
+        break;
+    case ASYNCFS_FLUSH:
+        req->result = SimpleFS_flush(req->file);
+        break;
+    case ASYNCFS_CREATE:
+        req->result = SimpleFS_createFilePath(worker->root, req->path);
+        break;
+    case ASYNCFS_REMOVE:
+        req->result = SimpleFS_removePath(worker->root, req->path);
+        break;
+    default:
+        if (DEBUG) printf("[AFS - run] Unknown operation.\n");
+        req->result = -1;
+    }
+}
+
+static void AsyncFS_complete(AsyncFS* afs, AsyncFSRequest* req) {
+
+    if (req->callback != NULL) {
+        req->callback(req);
+        return;
+    }
+
+    pthread_mutex_lock(&afs->lock);
+    req->next = NULL;
+    if (afs->done_tail != NULL)
+        afs->done_tail->next = req;
+    else
+        afs->done_head = req;
+    afs->done_tail = req;
+    pthread_mutex_unlock(&afs->lock);
+
+    uint64_t one = 1;
+    if (write(afs->event_fd, &one, sizeof(one)) != sizeof(one))
+        if (DEBUG) printf("[AFS - complete] Cannot signal the completion.\n");
+}
+
+static void* AsyncFS_worker(void* arg) {
+
+    AsyncFSWorker* worker = arg;
+    AsyncFS* afs = worker->afs;
+    while (1) {
+        pthread_mutex_lock(&afs->lock);
+        while (afs->head == NULL && !afs->stopping)
+            pthread_cond_wait(&afs->submitted, &afs->lock);
+        AsyncFSRequest* req = afs->head;
+        if (req == NULL) {
+            pthread_mutex_unlock(&afs->lock);
+            return NULL;
+        }
+        afs->head = req->next;
+        if (afs->head == NULL)
+            afs->tail = NULL;
+        pthread_mutex_unlock(&afs->lock);
+
+        AsyncFS_run(worker, req);
+        AsyncFS_complete(afs, req);
+    }
+}
+
+int AsyncFS_init(AsyncFS* afs, DirectoryHandle* d, int num_workers) {
+
+    if (num_workers <= 0 || num_workers > ASYNCFS_MAX_WORKERS)
+        return -1;
+
+    afs->fs = d->sfs;
+    afs->num_workers = 0;
+    afs->head = afs->tail = NULL;
+    afs->done_head = afs->done_tail = NULL;
+    afs->stopping = 0;
+    afs->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (afs->event_fd == -1) {
+        if (DEBUG) printf("[AFS - init] Cannot create the eventfd.\n");
+        return -1;
+    }
+    pthread_mutex_init(&afs->lock, NULL);
+    pthread_cond_init(&afs->submitted, NULL);
+
+    int idx;
+    for (idx = 0; idx < num_workers; idx++) {
+        AsyncFSWorker* worker = &afs->workers[idx];
+        worker->afs = afs;
+        worker->root = SimpleFS_openDir(d, "/");
+        if (worker->root == NULL ||
+                pthread_create(&worker->thread, NULL, AsyncFS_worker, worker) != 0) {
+            if (DEBUG) printf("[AFS - init] Cannot start a worker.\n");
+            if (worker->root != NULL)
+                SimpleFS_closeDir(worker->root);
+            AsyncFS_destroy(afs);
+            return -1;
+        }
+        afs->num_workers += 1;
+    }
+    return 0;
+}
+
+int AsyncFS_submit(AsyncFS* afs, AsyncFSRequest* req) {
+
+    pthread_mutex_lock(&afs->lock);
+    if (afs->stopping) {
+        pthread_mutex_unlock(&afs->lock);
+        return -1;
+    }
+    req->next = NULL;
+    if (afs->tail != NULL)
+        afs->tail->next = req;
+    else
+        afs->head = req;
+    afs->tail = req;
+    pthread_cond_signal(&afs->submitted);
+    pthread_mutex_unlock(&afs->lock);
+    return 0;
+}
+
+int AsyncFS_fd(AsyncFS* afs) {
+    return afs->event_fd;
+}
+
+int AsyncFS_reap(AsyncFS* afs, AsyncFSRequest** reqs, int max) {
+
+    // reset the counter first, a completion after it signals again
+    uint64_t count;
+    if (read(afs->event_fd, &count, sizeof(count)) == -1)
+        count = 0;
+
+    int num = 0;
+    pthread_mutex_lock(&afs->lock);
+    while (num < max && afs->done_head != NULL) {
+        reqs[num++] = afs->done_head;
+        afs->done_head = afs->done_head->next;
+    }
+    if (afs->done_head == NULL)
+        afs->done_tail = NULL;
+    int left = afs->done_head != NULL;
+    pthread_mutex_unlock(&afs->lock);
+
+    // keep the descriptor readable for what didn't fit in reqs
+    uint64_t one = 1;
+    if (left && write(afs->event_fd, &one, sizeof(one)) != sizeof(one))
+        if (DEBUG) printf("[AFS - reap] Cannot signal the completion.\n");
+    return num;
+}
+
+void AsyncFS_destroy(AsyncFS* afs) {
+
+    pthread_mutex_lock(&afs->lock);
+    afs->stopping = 1;
+    pthread_cond_broadcast(&afs->submitted);
+    pthread_mutex_unlock(&afs->lock);
+
+    int idx;
+    for (idx = 0; idx < afs->num_workers; idx++) {
+        pthread_join(afs->workers[idx].thread, NULL);
+        SimpleFS_closeDir(afs->workers[idx].root);
+    }
+    afs->num_workers = 0;
+
+    close(afs->event_fd);
+    pthread_mutex_destroy(&afs->lock);
+    pthread_cond_destroy(&afs->submitted);
+}
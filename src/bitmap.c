@@ -1,37 +1,77 @@
 #include <bitmap.h>
+#include <stats.h>
 
 
-BitMapEntryKey BitMap_blockToIndex(int num) {
+BitMapEntryKey BitMap_blockToIndex(int64_t num) {
     BitMapEntryKey entry = {
         .entry_num = num >> 3,
-        .bit_num = num % 0x7 
+        .bit_num = num & 0x7
     };
     return entry;
 }
 
-int BitMap_indexToBlock(int entry, uint8_t bit_num) {
+int64_t BitMap_indexToBlock(int64_t entry, uint8_t bit_num) {
     return (entry << 3) | (bit_num & 0x7);
 }
 
-int BitMap_get(BitMap* bmap, int start, int status) {
-    int idx = start;
+static int BitMap_bit(BitMap* bmap, int64_t idx) {
+    BitMapEntryKey entry = BitMap_blockToIndex(idx);
+    return __atomic_load_n(&bmap->entries[entry.entry_num], __ATOMIC_RELAXED) >> entry.bit_num & 0x1;
+}
+
+int64_t BitMap_get(BitMap* bmap, int64_t start, int status) {
+    int64_t idx = start;
     while (idx < bmap->num_bits) {
-        BitMapEntryKey entry = BitMap_blockToIndex(idx);
-        int current_status = bmap->entries[entry.entry_num] >> entry.bit_num & 0x1;
-        if (current_status == status)
+        if (BitMap_bit(bmap, idx) == status) {
+            STATS_ADD(STATS_BITS_SCANNED, idx - start + 1);
             return idx;
+        }
         idx ++;
     }
+    if (idx > start)
+        STATS_ADD(STATS_BITS_SCANNED, idx - start);
     return -1;
 }
 
-int BitMap_set(BitMap* bmap, int pos, int status) {
-    if (pos >= bmap->num_bits)
+int BitMap_test(BitMap* bmap, int64_t pos) {
+    if (pos >= bmap->num_bits || pos < 0)
         return -1;
+    return BitMap_bit(bmap, pos);
+}
 
-    BitMapEntryKey entry = BitMap_blockToIndex(pos);
-    bmap->entries[entry.entry_num] &= ~(1 << entry.bit_num);
-    bmap->entries[entry.entry_num] |= status << entry.bit_num;
-        
+int64_t BitMap_getRun(BitMap* bmap, int64_t start, int64_t len, int status) {
+    int64_t idx = BitMap_get(bmap, start, status);
+    while (idx != -1 && idx + len <= bmap->num_bits) {
+        int64_t run = 1;
+        while (run < len) {
+            if (BitMap_bit(bmap, idx + run) != status)
+                break;
+            run ++;
+        }
+        STATS_ADD(STATS_BITS_SCANNED, run < len ? run : run - 1);
+        if (run == len)
+            return idx;
+        idx = BitMap_get(bmap, idx + run + 1, status);
+    }
+    return -1;
+}
+
+int BitMap_set(BitMap* bmap, int64_t pos, int status) {
+    if (BitMap_testAndSet(bmap, pos, status) == -1)
+        return -1;
     return 0;
 }
+
+int BitMap_testAndSet(BitMap* bmap, int64_t pos, int status) {
+    if (pos >= bmap->num_bits || pos < 0)
+        return -1;
+
+    BitMapEntryKey entry = BitMap_blockToIndex(pos);
+    char mask = 1 << entry.bit_num;
+    char old;
+    if (status)
+        old = __atomic_fetch_or(&bmap->entries[entry.entry_num], mask, __ATOMIC_ACQ_REL);
+    else
+        old = __atomic_fetch_and(&bmap->entries[entry.entry_num], ~mask, __ATOMIC_ACQ_REL);
+    return (old & mask) != 0;
+}
@@ -0,0 +1,77 @@
+#include <dentry_cache.h>
+
+#include <string.h>
+#include <strings.h>
+
+
+static unsigned int DentryCache_hash(int64_t parent, const char* name) {
+    unsigned int hash = 2166136261u ^ (unsigned int) (parent ^ (parent >> 32));
+    int idx;
+    for (idx = 0; idx < DENTRY_NAME_LEN && name[idx]; idx++) {
+        hash ^= (unsigned char) name[idx];
+        hash *= 16777619u;
+    }
+    return hash % DENTRY_CACHE_SIZE;
+}
+
+// the slot holding name in parent, NULL if it holds something else
+static DentryCacheEntry* DentryCache_find(DentryCache* cache, int64_t parent, const char* name) {
+    DentryCacheEntry* entry = &cache->entries[DentryCache_hash(parent, name)];
+    if (!entry->valid || entry->parent != parent)
+        return NULL;
+    if (strncmp(entry->name, name, DENTRY_NAME_LEN) != 0)
+        return NULL;
+    return entry;
+}
+
+void DentryCache_init(DentryCache* cache) {
+    bzero(cache->entries, sizeof(cache->entries));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+void DentryCache_clear(DentryCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    bzero(cache->entries, sizeof(cache->entries));
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int DentryCache_lookup(DentryCache* cache, int64_t parent, const char* name, int64_t* block, int* is_dir) {
+    pthread_mutex_lock(&cache->lock);
+    DentryCacheEntry* entry = DentryCache_find(cache, parent, name);
+    if (entry) {
+        *block = entry->block;
+        *is_dir = entry->is_dir;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry != NULL;
+}
+
+void DentryCache_insert(DentryCache* cache, int64_t parent, const char* name, int64_t block, int is_dir) {
+    pthread_mutex_lock(&cache->lock);
+    DentryCacheEntry* entry = &cache->entries[DentryCache_hash(parent, name)];
+    entry->valid = 1;
+    entry->parent = parent;
+    entry->block = block;
+    entry->is_dir = is_dir;
+    strncpy(entry->name, name, DENTRY_NAME_LEN);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void DentryCache_invalidate(DentryCache* cache, int64_t parent, const char* name) {
+    pthread_mutex_lock(&cache->lock);
+    DentryCacheEntry* entry = DentryCache_find(cache, parent, name);
+    if (entry)
+        entry->valid = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void DentryCache_purgeDir(DentryCache* cache, int64_t dir) {
+    int idx;
+    pthread_mutex_lock(&cache->lock);
+    for (idx = 0; idx < DENTRY_CACHE_SIZE; idx++) {
+        DentryCacheEntry* entry = &cache->entries[idx];
+        if (entry->parent == dir || entry->block == dir)
+            entry->valid = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,542 @@
+#include <dir_tree.h>
+#include <pack.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define DIRTREE_KEYS (DIRTREE_FANOUT - 1)   // keys of a full node
+#define DIRTREE_FREE_BATCH 64               // nodes released with a single DiskDriver_freeBlocks
+
+
+// compares name with the name of the entry of key, like strncmp, storing the
+// result in cmp. The entry (packed or not) is read only when the prefix
+// doesn't hold its whole name. Returns -1 if it can't be read
+static int DirTree_compare(DiskDriver* disk, const char* name, const DirTreeKey* key, int* cmp) {
+
+    *cmp = strncmp(name, key->prefix, DIRTREE_PREFIX);
+    if (*cmp != 0 || memchr(key->prefix, 0, DIRTREE_PREFIX) != NULL)
+        return 0;
+
+    FirstFileBlock ffb;
+    if (Pack_readEntry(disk, &ffb, key->block) == -1) {
+        if (DEBUG) printf("[DT - compare] Cannot read from disk.\n");
+        return -1;
+    }
+    *cmp = strncmp(name, ffb.fcb.name, 128);
+    return 0;
+}
+
+// copies in name (128 bytes) the name of the entry of key
+static int DirTree_keyName(DiskDriver* disk, const DirTreeKey* key, char* name) {
+
+    if (memchr(key->prefix, 0, DIRTREE_PREFIX) != NULL) {
+        strcpy(name, key->prefix);
+        return 0;
+    }
+
+    FirstFileBlock ffb;
+    if (Pack_readEntry(disk, &ffb, key->block) == -1) {
+        if (DEBUG) printf("[DT - keyName] Cannot read from disk.\n");
+        return -1;
+    }
+    strncpy(name, ffb.fcb.name, 128);
+    return 0;
+}
+
+static void DirTree_makeKey(DirTreeKey* key, const char* name, int64_t block_num) {
+    strncpy(key->prefix, name, DIRTREE_PREFIX);
+    key->block = block_num;
+}
+
+// returns the first key of node that is >= name (num_keys if there is none), -1 on error
+static int DirTree_lowerBound(DiskDriver* disk, DirTreeNode* node, const char* name) {
+    int low = 0, high = node->num_keys;
+    while (low < high) {
+        int mid = (low + high) / 2, cmp;
+        if (DirTree_compare(disk, name, &node->keys[mid], &cmp) == -1)
+            return -1;
+        if (cmp > 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// returns the child of the internal node where name belongs:
+// the number of its keys that are <= name, -1 on error
+static int DirTree_childFor(DiskDriver* disk, DirTreeNode* node, const char* name) {
+    int low = 0, high = node->num_keys;
+    while (low < high) {
+        int mid = (low + high) / 2, cmp;
+        if (DirTree_compare(disk, name, &node->keys[mid], &cmp) == -1)
+            return -1;
+        if (cmp >= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// 1 if the key at pos of node is the one of name, 0 if it isn't
+// (or pos is past the last key), -1 on error
+static int DirTree_matches(DiskDriver* disk, DirTreeNode* node, int pos, const char* name) {
+    int cmp;
+    if (pos == node->num_keys)
+        return 0;
+    if (DirTree_compare(disk, name, &node->keys[pos], &cmp) == -1)
+        return -1;
+    return cmp == 0;
+}
+
+// reads in leaf the leaf where name belongs
+static int DirTree_findLeaf(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name,
+                            DirTreeNode* leaf) {
+
+    int64_t block_num = fdb->file_blocks[0];
+    int level;
+    for (level = 0; level < DIRTREE_MAX_HEIGHT; level++) {
+        if (DiskDriver_readBlock(disk, leaf, block_num) == -1) {
+            if (DEBUG) printf("[DT - findLeaf] Cannot read from disk.\n");
+            return -1;
+        }
+        if (leaf->is_leaf)
+            return 0;
+        int child = DirTree_childFor(disk, leaf, name);
+        if (child == -1)
+            return -1;
+        block_num = leaf->children[child];
+    }
+    if (DEBUG) printf("[DT - findLeaf] Tree too deep.\n");
+    return -1;
+}
+
+// reads in path the nodes from the root to the leaf where name belongs,
+// storing in slots the child followed at each level.
+// Returns the level of the leaf, -1 on error
+static int DirTree_descend(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name,
+                           DirTreeNode* path, int* slots) {
+
+    int64_t block_num = fdb->file_blocks[0];
+    int level;
+    for (level = 0; level < DIRTREE_MAX_HEIGHT; level++) {
+        if (DiskDriver_readBlock(disk, &path[level], block_num) == -1) {
+            if (DEBUG) printf("[DT - descend] Cannot read from disk.\n");
+            return -1;
+        }
+        if (path[level].is_leaf)
+            return level;
+        slots[level] = DirTree_childFor(disk, &path[level], name);
+        if (slots[level] == -1)
+            return -1;
+        block_num = path[level].children[slots[level]];
+    }
+    if (DEBUG) printf("[DT - descend] Tree too deep.\n");
+    return -1;
+}
+
+static void DirTree_initNode(DirTreeNode* node, int64_t block_num, int is_leaf) {
+    memset(node, 0, sizeof(DirTreeNode));
+    node->header.previous_block = -1;
+    node->header.next_block = -1;
+    node->header.block_in_file = -1;
+    node->header.block_in_disk = block_num;
+    node->is_leaf = is_leaf;
+}
+
+// sets the link toward the node block_num in the neighbour neighbour_block
+static int DirTree_relink(DiskDriver* disk, int64_t neighbour_block, int is_next, int64_t block_num) {
+
+    if (neighbour_block == -1)
+        return 0;
+
+    DirTreeNode neighbour;
+    if (DiskDriver_readBlock(disk, &neighbour, neighbour_block) == -1)
+        return -1;
+    if (is_next)
+        neighbour.header.previous_block = block_num;
+    else
+        neighbour.header.next_block = block_num;
+    return DiskDriver_writeBlock(disk, &neighbour, neighbour_block);
+}
+
+// puts key in position pos of node, with child on its right if node is internal
+static void DirTree_insertAt(DirTreeNode* node, int pos, DirTreeKey* key, int64_t child) {
+
+    memmove(&node->keys[pos + 1], &node->keys[pos], (node->num_keys - pos) * sizeof(DirTreeKey));
+    node->keys[pos] = *key;
+    if (!node->is_leaf) {
+        memmove(&node->children[pos + 2], &node->children[pos + 1],
+                (node->num_keys - pos) * sizeof(int64_t));
+        node->children[pos + 1] = child;
+    }
+    node->num_keys += 1;
+}
+
+// moves the upper part of the full node, with key added in position pos,
+// to the empty node right. The key separating them is stored in up
+static void DirTree_split(DirTreeNode* node, DirTreeNode* right, int pos,
+                          DirTreeKey* key, int64_t child, DirTreeKey* up) {
+
+    DirTreeKey keys[DIRTREE_KEYS + 1];
+    int64_t children[DIRTREE_FANOUT + 1];
+    memcpy(keys, node->keys, pos * sizeof(DirTreeKey));
+    keys[pos] = *key;
+    memcpy(&keys[pos + 1], &node->keys[pos], (DIRTREE_KEYS - pos) * sizeof(DirTreeKey));
+    if (!node->is_leaf) {
+        memcpy(children, node->children, (pos + 1) * sizeof(int64_t));
+        children[pos + 1] = child;
+        memcpy(&children[pos + 2], &node->children[pos + 1], (DIRTREE_KEYS - pos) * sizeof(int64_t));
+    }
+
+    // names added in increasing order (like in a spool) fill the last
+    // node of the level, instead of leaving half empty nodes behind
+    int left_keys = (DIRTREE_KEYS + 1) / 2;
+    if (pos == DIRTREE_KEYS && node->header.next_block == -1)
+        left_keys = DIRTREE_KEYS;
+
+    node->num_keys = left_keys;
+    if (node->is_leaf) {
+        right->num_keys = DIRTREE_KEYS + 1 - left_keys;
+        memcpy(right->keys, &keys[left_keys], right->num_keys * sizeof(DirTreeKey));
+        *up = right->keys[0];
+    }
+    else {
+        // the separator in the middle moves up
+        right->num_keys = DIRTREE_KEYS - left_keys;
+        memcpy(node->children, children, (left_keys + 1) * sizeof(int64_t));
+        memcpy(right->keys, &keys[left_keys + 1], right->num_keys * sizeof(DirTreeKey));
+        memcpy(right->children, &children[left_keys + 1], (right->num_keys + 1) * sizeof(int64_t));
+        *up = keys[left_keys];
+    }
+    memcpy(node->keys, keys, left_keys * sizeof(DirTreeKey));
+}
+
+// removes the key in position pos of node, and the child on its left
+// if left is set (on its right otherwise)
+static void DirTree_removeAt(DirTreeNode* node, int pos, int left) {
+
+    memmove(&node->keys[pos], &node->keys[pos + 1], (node->num_keys - pos - 1) * sizeof(DirTreeKey));
+    if (!node->is_leaf) {
+        int child = left ? pos : pos + 1;
+        memmove(&node->children[child], &node->children[child + 1],
+                (node->num_keys - child) * sizeof(int64_t));
+    }
+    node->num_keys -= 1;
+}
+
+int DirTree_init(DiskDriver* disk, FirstDirectoryBlock* fdb) {
+
+    int64_t block_num = DiskDriver_allocBlock(disk, fdb->header.block_in_disk);
+    if (block_num == -1) {
+        if (DEBUG) printf("[DT - init] No free block.\n");
+        return -1;
+    }
+
+    DirTreeNode root;
+    DirTree_initNode(&root, block_num, 1);
+    if (DiskDriver_writeBlock(disk, &root, block_num) == -1) {
+        if (DEBUG) printf("[DT - init] Cannot write on disk.\n");
+        DiskDriver_freeBlock(disk, block_num);
+        return -1;
+    }
+
+    fdb->fcb.is_dir = SFS_DIR_TREE;
+    fdb->num_entries = 0;
+    fdb->file_blocks[0] = block_num;
+    fdb->fcb.size_in_blocks = 2;
+    fdb->fcb.size_in_bytes = 2 * BLOCK_SIZE;
+    return 0;
+}
+
+int64_t DirTree_lookup(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name) {
+
+    DirTreeNode leaf;
+    if (DirTree_findLeaf(disk, fdb, name, &leaf) == -1)
+        return -1;
+
+    int pos = DirTree_lowerBound(disk, &leaf, name);
+    if (pos == -1 || DirTree_matches(disk, &leaf, pos, name) != 1)
+        return -1;
+    return leaf.keys[pos].block;
+}
+
+int DirTree_insert(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name, int64_t block_num) {
+
+    DirTreeNode path[DIRTREE_MAX_HEIGHT];
+    int slots[DIRTREE_MAX_HEIGHT];
+    int level = DirTree_descend(disk, fdb, name, path, slots);
+    if (level == -1)
+        return -1;
+
+    int pos = DirTree_lowerBound(disk, &path[level], name);
+    int found = pos == -1 ? -1 : DirTree_matches(disk, &path[level], pos, name);
+    if (found == -1)
+        return -1;
+    if (found == 1) {
+        if (DEBUG) printf("[DT - insert] Entry already exists.\n");
+        return -1;
+    }
+
+    // every full node on the path splits, and the root too if it is full:
+    // the blocks are claimed first so a full disk leaves the tree untouched
+    int splits = 0;
+    while (splits <= level && path[level - splits].num_keys == DIRTREE_KEYS)
+        splits++;
+    int64_t new_blocks[DIRTREE_MAX_HEIGHT + 1];
+    int needed = splits > level ? splits + 1 : splits;
+    if (splits > level && level + 2 > DIRTREE_MAX_HEIGHT) {
+        if (DEBUG) printf("[DT - insert] Tree too deep.\n");
+        return -1;
+    }
+    int idx;
+    for (idx = 0; idx < needed; idx++) {
+        new_blocks[idx] = DiskDriver_allocBlock(disk, path[level].header.block_in_disk);
+        if (new_blocks[idx] == -1) {
+            if (DEBUG) printf("[DT - insert] No free block.\n");
+            DiskDriver_freeBlocks(disk, new_blocks, idx);
+            return -1;
+        }
+    }
+
+    DirTreeKey key;
+    DirTree_makeKey(&key, name, block_num);
+    int64_t child = -1;
+    int ret = 0;
+    for (idx = 0; idx < splits; idx++, level--) {
+        DirTreeNode* node = &path[level];
+        DirTreeNode right;
+        DirTree_initNode(&right, new_blocks[idx], node->is_leaf);
+        DirTree_split(node, &right, pos, &key, child, &key);
+
+        right.header.previous_block = node->header.block_in_disk;
+        right.header.next_block = node->header.next_block;
+        node->header.next_block = right.header.block_in_disk;
+        ret |= DirTree_relink(disk, right.header.next_block, 1, right.header.block_in_disk);
+        ret |= DiskDriver_writeBlock(disk, &right, right.header.block_in_disk);
+        ret |= DiskDriver_writeBlock(disk, node, node->header.block_in_disk);
+        child = right.header.block_in_disk;
+        if (level > 0)
+            pos = slots[level - 1];
+    }
+
+    if (level >= 0) {
+        DirTree_insertAt(&path[level], pos, &key, child);
+        ret |= DiskDriver_writeBlock(disk, &path[level], path[level].header.block_in_disk);
+    }
+    else {
+        // the root was split, the tree grows by a level
+        DirTreeNode root;
+        DirTree_initNode(&root, new_blocks[splits], 0);
+        root.num_keys = 1;
+        root.keys[0] = key;
+        root.children[0] = fdb->file_blocks[0];
+        root.children[1] = child;
+        ret |= DiskDriver_writeBlock(disk, &root, root.header.block_in_disk);
+        fdb->file_blocks[0] = root.header.block_in_disk;
+    }
+    if (ret != 0) {
+        if (DEBUG) printf("[DT - insert] Cannot write on disk.\n");
+        return -1;
+    }
+
+    fdb->num_entries += 1;
+    fdb->fcb.size_in_blocks += needed;
+    fdb->fcb.size_in_bytes = fdb->fcb.size_in_blocks * BLOCK_SIZE;
+    return 0;
+}
+
+int64_t DirTree_remove(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name) {
+
+    DirTreeNode path[DIRTREE_MAX_HEIGHT];
+    int slots[DIRTREE_MAX_HEIGHT];
+    int dirty[DIRTREE_MAX_HEIGHT] = {0};
+    int level = DirTree_descend(disk, fdb, name, path, slots);
+    if (level == -1)
+        return -1;
+
+    DirTreeNode* leaf = &path[level];
+    int pos = DirTree_lowerBound(disk, leaf, name);
+    if (pos == -1 || DirTree_matches(disk, leaf, pos, name) != 1)
+        return -1;
+
+    int64_t removed = leaf->keys[pos].block;
+    DirTree_removeAt(leaf, pos, 0);
+    dirty[level] = 1;
+
+    // the entry after the removed one takes its place as a separator
+    DirTreeKey next = {{0}, -1};
+    if (pos < leaf->num_keys) {
+        next = leaf->keys[pos];
+    }
+    else if (leaf->header.next_block != -1) {
+        DirTreeNode next_leaf;
+        if (DiskDriver_readBlock(disk, &next_leaf, leaf->header.next_block) == -1)
+            return -1;
+        next = next_leaf.keys[0];
+    }
+
+    // releases the nodes left without entries, bottom up
+    int64_t freed[2 * DIRTREE_MAX_HEIGHT];
+    int num_freed = 0;
+    int ret = 0;
+    int empty = leaf->num_keys == 0 && level > 0;
+    while (empty) {
+        DirTreeNode* node = &path[level];
+        ret |= DirTree_relink(disk, node->header.previous_block, 0, node->header.next_block);
+        ret |= DirTree_relink(disk, node->header.next_block, 1, node->header.previous_block);
+        freed[num_freed++] = node->header.block_in_disk;
+        dirty[level] = 0;
+
+        level--;
+        DirTreeNode* parent = &path[level];
+        dirty[level] = 1;
+        if (parent->num_keys > 0) {
+            int child = slots[level];
+            DirTree_removeAt(parent, child > 0 ? child - 1 : 0, child == 0);
+            empty = 0;
+        }
+        else if (level == 0) {
+            // the last child of the root is gone, the tree is empty again
+            parent->is_leaf = 1;
+            empty = 0;
+        }
+    }
+
+    for (; level >= 0; level--) {
+        int idx;
+        for (idx = 0; !path[level].is_leaf && idx < path[level].num_keys; idx++) {
+            if (path[level].keys[idx].block == removed) {
+                path[level].keys[idx] = next;
+                dirty[level] = 1;
+            }
+        }
+    }
+    for (level = 0; level < DIRTREE_MAX_HEIGHT; level++) {
+        if (dirty[level])
+            ret |= DiskDriver_writeBlock(disk, &path[level], path[level].header.block_in_disk);
+    }
+
+    // a root with a single child is replaced by the child
+    DirTreeNode root = path[0];
+    while (ret == 0 && !root.is_leaf && root.num_keys == 0) {
+        freed[num_freed++] = root.header.block_in_disk;
+        fdb->file_blocks[0] = root.children[0];
+        ret = DiskDriver_readBlock(disk, &root, root.children[0]);
+    }
+    ret |= DiskDriver_freeBlocks(disk, freed, num_freed);
+    if (ret != 0) {
+        if (DEBUG) printf("[DT - remove] Cannot access the disk.\n");
+        return -1;
+    }
+
+    fdb->num_entries -= 1;
+    fdb->fcb.size_in_blocks -= num_freed;
+    fdb->fcb.size_in_bytes = fdb->fcb.size_in_blocks * BLOCK_SIZE;
+    return removed;
+}
+
+int DirTree_relocate(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* name, int64_t block_num) {
+
+    DirTreeNode path[DIRTREE_MAX_HEIGHT];
+    int slots[DIRTREE_MAX_HEIGHT];
+    int level = DirTree_descend(disk, fdb, name, path, slots);
+    if (level == -1)
+        return -1;
+
+    DirTreeNode* leaf = &path[level];
+    int pos = DirTree_lowerBound(disk, leaf, name);
+    if (pos == -1 || DirTree_matches(disk, leaf, pos, name) != 1)
+        return -1;
+
+    // separators naming the entry are on the path to its leaf
+    int64_t moved = leaf->keys[pos].block;
+    int ret = 0;
+    for (; level >= 0; level--) {
+        int idx, dirty = 0;
+        for (idx = 0; idx < path[level].num_keys; idx++) {
+            if (path[level].keys[idx].block == moved) {
+                path[level].keys[idx].block = block_num;
+                dirty = 1;
+            }
+        }
+        if (dirty)
+            ret |= DiskDriver_writeBlock(disk, &path[level], path[level].header.block_in_disk);
+    }
+    if (ret != 0) {
+        if (DEBUG) printf("[DT - relocate] Cannot write on disk.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int DirTree_seek(DiskDriver* disk, FirstDirectoryBlock* fdb, const char* from, DirTreeCursor* cursor) {
+
+    DirTreeNode leaf;
+    if (DirTree_findLeaf(disk, fdb, from, &leaf) == -1)
+        return -1;
+
+    int pos = DirTree_lowerBound(disk, &leaf, from);
+    if (pos == -1)
+        return -1;
+    cursor->leaf = leaf.header.block_in_disk;
+    cursor->pos = pos;
+    return 0;
+}
+
+int64_t DirTree_next(DiskDriver* disk, DirTreeCursor* cursor, char* name) {
+
+    DirTreeNode leaf;
+    while (cursor->leaf != -1) {
+        if (DiskDriver_readBlock(disk, &leaf, cursor->leaf) == -1) {
+            if (DEBUG) printf("[DT - next] Cannot read from disk.\n");
+            return -1;
+        }
+        if (cursor->pos < leaf.num_keys)
+            break;
+        cursor->leaf = leaf.header.next_block;
+        cursor->pos = 0;
+    }
+    if (cursor->leaf == -1)
+        return -1;
+
+    DirTreeKey* key = &leaf.keys[cursor->pos++];
+    if (name != NULL && DirTree_keyName(disk, key, name) == -1)
+        return -1;
+    return key->block;
+}
+
+int DirTree_destroy(DiskDriver* disk, FirstDirectoryBlock* fdb) {
+
+    int64_t blocks[DIRTREE_FREE_BATCH];
+    int num = 0;
+    int ret = 0;
+
+    // walks every level from its first node, the leftmost child
+    // of the first node of the level above
+    int64_t first = fdb->file_blocks[0];
+    while (first != -1 && ret == 0) {
+        int64_t block_num = first;
+        first = -1;
+        while (block_num != -1) {
+            DirTreeNode node;
+            if (DiskDriver_readBlock(disk, &node, block_num) == -1) {
+                if (DEBUG) printf("[DT - destroy] Cannot read from disk.\n");
+                ret = -1;
+                break;
+            }
+            if (first == -1 && !node.is_leaf)
+                first = node.children[0];
+
+            blocks[num++] = block_num;
+            if (num == DIRTREE_FREE_BATCH) {
+                ret |= DiskDriver_freeBlocks(disk, blocks, num);
+                num = 0;
+            }
+            block_num = node.header.next_block;
+        }
+    }
+    ret |= DiskDriver_freeBlocks(disk, blocks, num);
+    return ret == 0 ? 0 : -1;
+}
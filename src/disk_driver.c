@@ -1,5 +1,9 @@
+#define _GNU_SOURCE    // SEEK_DATA and SEEK_HOLE
+
 #include <disk_driver.h>
 #include <common.h>
+#include <stats.h>
+#include <trace.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -10,66 +14,358 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>    
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
 
+#if SFS_TRACE
+#define DiskDriver_trace(disk, op, block_num)   do {                                    \
+                                                    if ((disk)->trace != NULL)          \
+                                                        Trace_record((disk)->trace,     \
+                                                                     (op), (block_num));\
+                                                } while(0)
+#else
+#define DiskDriver_trace(disk, op, block_num)   do { } while(0)
+#endif
 
-static void DiskDriver_initDiskHeader(DiskHeader* dh, int num_blocks, int bitmap_size, 
-                                        int free_blocks, int first_free_block, 
-                                        char* bitmap_data) {
+// the bitmap and the summary of a new file are already zeroed,
+// that is all the blocks free
+static void DiskDriver_initDiskHeader(DiskHeader* dh, int64_t num_blocks, int64_t bitmap_size, 
+                                        int64_t num_regions, int64_t free_blocks,
+                                        int64_t first_free_block) {
     if (!dh)
         return;
 
+    dh->magic = DISK_MAGIC;
+    dh->version = DISK_VERSION;
     dh->num_blocks = num_blocks;
     dh->bitmap_blocks = num_blocks;
     dh->bitmap_entries = bitmap_size;
     dh->free_blocks = free_blocks;
     dh->first_free_block = first_free_block;
+    dh->num_regions = num_regions;
+    dh->clean = 0;
+}
+
+#define DISK_SAVE_CHUNK 65536     // bytes DiskDriver_save checks for zeros at a time
 
-    bzero(bitmap_data, bitmap_size);
+static int64_t DiskDriver_numRegions(int64_t num_blocks) {
+    return (num_blocks + DISK_REGION_BLOCKS - 1) / DISK_REGION_BLOCKS;
 }
 
+// position in the file of the summary, after the header and the bitmap
+static int64_t DiskDriver_summaryOffset(int64_t num_blocks) {
+    int64_t end = (int64_t) sizeof(DiskHeader) + ((num_blocks + 7) >> 3);
+    return (end + 7) & ~INT64_C(7);
+}
 
-void DiskDriver_init(DiskDriver* disk, const char* filename, int num_blocks) {
-    int ret;
-    int exists = access(filename, F_OK) != -1;
-    int fd = open(filename, O_CREAT | O_RDWR, 0600);
-    CHECK_ERROR(fd == -1, "[DD - init] open failed.\n");
+// position in the file of the first block
+static int64_t DiskDriver_dataOffset(int64_t num_blocks) {
+    int64_t end = DiskDriver_summaryOffset(num_blocks) +
+                  DiskDriver_numRegions(num_blocks) * (int64_t) sizeof(int32_t);
+    return (end + DISK_DATA_ALIGN - 1) & ~((int64_t) DISK_DATA_ALIGN - 1);
+}
+
+// bytes taken on the file by a disk of num_blocks blocks
+static int64_t DiskDriver_zoneSize(int64_t num_blocks) {
+    return DiskDriver_dataOffset(num_blocks) + (int64_t) BLOCK_SIZE * num_blocks;
+}
 
+// start of the block block_num in the mmapped zone
+static char* DiskDriver_blockData(DiskDriver* disk, int64_t block_num) {
+    return disk->block_data + block_num * BLOCK_SIZE;
+}
 
-    int bitmap_size = num_blocks >> 3;
-    if (num_blocks & 0x7) bitmap_size ++;
+// blocks in region, the last one can be shorter
+static int64_t DiskDriver_regionBlocks(DiskDriver* disk, int64_t region) {
+    int64_t left = disk->header->num_blocks - region * DISK_REGION_BLOCKS;
+    return left < DISK_REGION_BLOCKS ? left : DISK_REGION_BLOCKS;
+}
 
-    int zone_size = sizeof(DiskHeader) + bitmap_size + BLOCK_SIZE * num_blocks;
-    
-    if (!exists) {
-        ret = posix_fallocate(fd, 0, zone_size);
-        CHECK_ERROR(ret != 0, "[DD - init] fallocate failed.\n"); 
+// used blocks of region according to the bitmap
+static int32_t DiskDriver_countRegion(DiskDriver* disk, int64_t region) {
+    unsigned char* bits = (unsigned char*) disk->bitmap_data + region * (DISK_REGION_BLOCKS / 8);
+    int64_t idx, num_bytes = (DiskDriver_regionBlocks(disk, region) + 7) / 8;
+    int32_t used = 0;
+    for (idx = 0; idx < num_bytes; idx++)
+        used += __builtin_popcount(__atomic_load_n(&bits[idx], __ATOMIC_RELAXED));
+    return used;
+}
+
+// makes the summary of region match the bitmap before it is used or changed:
+// after an unclean mount a region is recounted the first time it is touched
+static void DiskDriver_checkRegion(DiskDriver* disk, int64_t region) {
+    if (disk->region_valid == NULL ||
+            __atomic_load_n(&disk->region_valid[region], __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&disk->region_lock);
+    if (!disk->region_valid[region]) {
+        __atomic_store_n(&disk->summary[region], DiskDriver_countRegion(disk, region), __ATOMIC_RELAXED);
+        __atomic_store_n(&disk->region_valid[region], 1, __ATOMIC_RELEASE);
     }
-    
-    void * zone = mmap(0, zone_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    CHECK_ERROR(!zone, "[DD - init] mmap failed.\n");
+    pthread_mutex_unlock(&disk->region_lock);
+}
+
+// lowers the first_free_block hint to block_num
+static void DiskDriver_lowerFirstFree(DiskDriver* disk, int64_t block_num) {
+    int64_t first = __atomic_load_n(&disk->header->first_free_block, __ATOMIC_RELAXED);
+    while ((first == -1 || block_num < first) &&
+           !__atomic_compare_exchange_n(&disk->header->first_free_block, &first, block_num,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// sets the bit of block_num, keeping the summary of its region in step
+// returns 1 if the bit changed, 0 if it already had that status
+static int DiskDriver_setBit(DiskDriver* disk, int64_t block_num, int status) {
+    BitMap bmap = {
+        .num_bits = disk->header->bitmap_blocks,
+        .entries = disk->bitmap_data
+    };
+    int64_t region = block_num / DISK_REGION_BLOCKS;
+    DiskDriver_checkRegion(disk, region);
+    if (BitMap_testAndSet(&bmap, block_num, status) != !status)
+        return 0;
+    __atomic_add_fetch(&disk->summary[region], status ? 1 : -1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+// first free block from position start, -1 if there is none
+// the regions that the summary says full are skipped without reading their bitmap
+static int64_t DiskDriver_findFree(DiskDriver* disk, int64_t start) {
+    if (start >= disk->header->num_blocks)
+        return -1;
+    if (start < 0)
+        start = 0;
+
+    int64_t region;
+    for (region = start / DISK_REGION_BLOCKS; region < disk->header->num_regions; region++) {
+        DiskDriver_checkRegion(disk, region);
+        int64_t blocks = DiskDriver_regionBlocks(disk, region);
+        if (__atomic_load_n(&disk->summary[region], __ATOMIC_RELAXED) >= blocks)
+            continue;
+
+        int64_t first = region * DISK_REGION_BLOCKS;
+        BitMap bmap = {
+            .num_bits = first + blocks,
+            .entries = disk->bitmap_data
+        };
+        int64_t block_num = BitMap_get(&bmap, start > first ? start : first, 0);
+        if (block_num != -1)
+            return block_num;
+    }
+    return -1;
+}
+
+// marks block_num as used if it is free, -1 if it was taken
+static int DiskDriver_claim(DiskDriver* disk, int64_t block_num) {
+    if (block_num >= disk->header->num_blocks || block_num < 0)
+        return -1;
+    if (!DiskDriver_setBit(disk, block_num, 1))
+        return -1;
+
+    __atomic_sub_fetch(&disk->header->free_blocks, 1, __ATOMIC_RELAXED);
+    STATS_ADD(STATS_BLOCKS_ALLOCATED, 1);
+    DiskDriver_trace(disk, TRACE_ALLOC, block_num);
+    // the hint only moves forward from the block just taken, a block freed
+    // meanwhile is caught by DiskDriver_lowerFirstFree
+    int64_t first = __atomic_load_n(&disk->header->first_free_block, __ATOMIC_RELAXED);
+    if (first == block_num)
+        __atomic_compare_exchange_n(&disk->header->first_free_block, &first,
+                                    DiskDriver_findFree(disk, block_num + 1),
+                                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void DiskDriver_init(DiskDriver* disk, const char* filename, int64_t num_blocks) {
+    DiskDriver_open(disk, filename, num_blocks, 0);
+}
+
+// checks the header of an existing image of size bytes open on fd,
+// returns the number of blocks of the disk; exits if it can't be used
+static int64_t DiskDriver_checkImage(int fd, off_t size) {
+    DiskHeader header;
+    int ret = pread(fd, &header, sizeof(DiskHeader), 0) == sizeof(DiskHeader) ? 0 : -1;
+    CHECK_ERROR(ret == -1, "[DD - init] cannot read the disk header.\n");
+    CHECK_ERROR(header.magic != DISK_MAGIC || header.version < DISK_OLDEST_VERSION ||
+                header.version > DISK_VERSION, "[DD - init] unknown disk format.\n");
+    int64_t num_blocks = header.num_blocks;
+    CHECK_ERROR(num_blocks <= 0 || num_blocks > DISK_MAX_BLOCKS ||
+                header.bitmap_entries != (num_blocks + 7) >> 3 ||
+                header.num_regions != DiskDriver_numRegions(num_blocks),
+                "[DD - init] corrupted disk header.\n");
+    CHECK_ERROR(size < DiskDriver_zoneSize(num_blocks), "[DD - init] disk shorter than its header.\n");
+    return num_blocks;
+}
+
+// bytes of a disk of num_blocks blocks, exits if it can't be made on this host
+static int64_t DiskDriver_checkSize(int64_t num_blocks) {
+    CHECK_ERROR(num_blocks <= 0 || num_blocks > DISK_MAX_BLOCKS, "[DD - init] bad number of blocks.\n");
+    int64_t zone_size = DiskDriver_zoneSize(num_blocks);
+    CHECK_ERROR((uint64_t) zone_size > SIZE_MAX || zone_size != (off_t) zone_size,
+                "[DD - init] disk too large for this host.\n");
+    return zone_size;
+}
+
+// maps the zone of a disk of num_blocks blocks, shared on fd
+// or in anonymous memory if fd is -1, and points the fields inside it
+static void DiskDriver_map(DiskDriver* disk, int fd, int64_t num_blocks, int flags) {
+    int64_t zone_size = DiskDriver_checkSize(num_blocks);
+
+    int map_flags = fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE : MAP_SHARED;
+    if (flags & DISK_POPULATE)
+        map_flags |= MAP_POPULATE;
+    void * zone = mmap(0, (size_t) zone_size, PROT_READ | PROT_WRITE, map_flags, fd, 0);
+    CHECK_ERROR(zone == MAP_FAILED, "[DD - init] mmap failed.\n");
+    // both are hints, a kernel without them mounts the disk all the same
+    if ((flags & DISK_HUGEPAGES) && madvise(zone, (size_t) zone_size, MADV_HUGEPAGE) == -1)
+        if (DEBUG) printf("[DD - init] No huge pages for the disk.\n");
+    if ((flags & DISK_PRELOAD_META) && madvise(zone, (size_t) DiskDriver_dataOffset(num_blocks), MADV_WILLNEED) == -1)
+        if (DEBUG) printf("[DD - init] Cannot preload the bitmap.\n");
 
     disk->header = (DiskHeader*)zone;
     disk->bitmap_data = (char*)zone + sizeof(DiskHeader);
+    disk->summary = (int32_t*) ((char*)zone + DiskDriver_summaryOffset(num_blocks));
+    disk->block_data = (char*)zone + DiskDriver_dataOffset(num_blocks);
+    disk->region_valid = NULL;
+    pthread_mutex_init(&disk->region_lock, NULL);
     disk->fd = fd;
+    disk->trace = NULL;
+}
 
-    if (exists) {
-        int difference = num_blocks - disk->header->num_blocks;
-        if (difference > 0) { 
-            ret = posix_fallocate(disk->fd, zone_size - difference * BLOCK_SIZE, zone_size);
-            CHECK_ERROR(ret != 0, "[DD - init] fallocate failed.\n"); 
-            DiskDriver_initDiskHeader(disk->header, num_blocks, bitmap_size, 
-                                        disk->header->free_blocks + difference, 
-                                        disk->header->first_free_block,
-                                        disk->bitmap_data + disk->header->bitmap_entries);
-        }
-    } 
-    else {
-        DiskDriver_initDiskHeader(disk->header, num_blocks, bitmap_size, 
-                                    num_blocks, 0, disk->bitmap_data); 
+// marks mounted a disk whose header came from an image:
+// the summary of a disk not closed may be off, the regions are recounted
+// when touched; the flag goes on disk now, so a crash leaves it unclean.
+// A version 3 disk has no pack blocks and is a valid version 4 one: the
+// upgrade only keeps older programs, which can't read packs, off it
+static void DiskDriver_mount(DiskDriver* disk) {
+    if (!disk->header->clean)
+        disk->region_valid = calloc(disk->header->num_regions, 1);
+    disk->header->clean = 0;
+    disk->header->version = DISK_VERSION;
+    if (disk->fd == -1)
+        return;
+    int ret = msync(disk->header, sizeof(DiskHeader), MS_SYNC);
+    CHECK_ERROR(ret == -1, "[DD - init] cannot write the disk header.\n");
+}
+
+// moves size bytes between buf and offset of fd, in as many calls as it takes
+// returns 0 on success, -1 on error or end of file
+static int DiskDriver_transfer(int fd, char* buf, int64_t size, int64_t offset, int writing) {
+    while (size > 0) {
+        size_t chunk = size > (1 << 30) ? (size_t) 1 << 30 : (size_t) size;
+        ssize_t done = writing ? pwrite(fd, buf, chunk, (off_t) offset)
+                               : pread(fd, buf, chunk, (off_t) offset);
+        if (done <= 0)
+            return -1;
+        buf += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+void DiskDriver_open(DiskDriver* disk, const char* filename, int64_t num_blocks, int flags) {
+    STATS_TIME(STATS_DD_OPEN);
+    int ret;
+    int fd = open(filename, O_CREAT | O_RDWR, 0600);
+    CHECK_ERROR(fd == -1, "[DD - init] open failed.\n");
+
+    struct stat st;
+    ret = fstat(fd, &st);
+    CHECK_ERROR(ret == -1, "[DD - init] stat failed.\n");
+
+    if (st.st_size > 0) {
+        DiskDriver_map(disk, fd, DiskDriver_checkImage(fd, st.st_size), flags);
+        DiskDriver_mount(disk);
+        return;
+    }
+
+    ret = posix_fallocate(fd, 0, DiskDriver_checkSize(num_blocks));
+    CHECK_ERROR(ret != 0, "[DD - init] fallocate failed.\n"); 
+    DiskDriver_map(disk, fd, num_blocks, flags);
+    DiskDriver_initDiskHeader(disk->header, num_blocks, (num_blocks + 7) >> 3,
+                                DiskDriver_numRegions(num_blocks), num_blocks, 0);
+}
+
+void DiskDriver_initMemory(DiskDriver* disk, int64_t num_blocks, int flags) {
+    STATS_TIME(STATS_DD_OPEN);
+    // anonymous memory comes zeroed like a new file
+    DiskDriver_map(disk, -1, num_blocks, flags);
+    DiskDriver_initDiskHeader(disk->header, num_blocks, (num_blocks + 7) >> 3,
+                                DiskDriver_numRegions(num_blocks), num_blocks, 0);
+}
+
+void DiskDriver_load(DiskDriver* disk, const char* filename, int flags) {
+    STATS_TIME(STATS_DD_OPEN);
+    int fd = open(filename, O_RDONLY);
+    CHECK_ERROR(fd == -1, "[DD - load] open failed.\n");
+    struct stat st;
+    int ret = fstat(fd, &st);
+    CHECK_ERROR(ret == -1, "[DD - load] stat failed.\n");
+
+    int64_t num_blocks = DiskDriver_checkImage(fd, st.st_size);
+    DiskDriver_map(disk, -1, num_blocks, flags);
+    // only the data of the file is read, the holes stay untouched zero pages;
+    // a file system without SEEK_DATA has the whole image read
+    int64_t zone_size = DiskDriver_zoneSize(num_blocks);
+    int64_t offset = 0;
+    while (ret == 0 && offset < zone_size) {
+        off_t data = lseek(fd, (off_t) offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break;
+        off_t hole = data == -1 ? (off_t) zone_size : lseek(fd, data, SEEK_HOLE);
+        if (data == -1)
+            data = (off_t) offset;
+        if (hole == -1 || hole > (off_t) zone_size)
+            hole = (off_t) zone_size;
+        ret = DiskDriver_transfer(fd, (char*) disk->header + data, hole - data, data, 0);
+        offset = hole;
     }
+    CHECK_ERROR(ret == -1, "[DD - load] cannot read the image.\n");
+    close(fd);
+    DiskDriver_mount(disk);
 }
 
-int DiskDriver_readBlock(DiskDriver* disk, void* dest, int block_num) {
+int DiskDriver_save(DiskDriver* disk, const char* filename) {
+    STATS_TIME(STATS_DD_SAVE);
+    int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    if (fd == -1)
+        return -1;
+
+    // the copy is clean unless the summary is still being recounted
+    DiskHeader header = *disk->header;
+    header.clean = disk->region_valid == NULL;
+    int64_t zone_size = DiskDriver_zoneSize(disk->header->num_blocks);
+    int ret = ftruncate(fd, (off_t) zone_size);
+    if (ret == 0)
+        ret = DiskDriver_transfer(fd, (char*) &header, sizeof(DiskHeader), 0, 1);
+
+    // the chunks never written are left as holes, a mostly empty disk makes a small file
+    static const char zeros[DISK_SAVE_CHUNK];
+    int64_t offset;
+    for (offset = sizeof(DiskHeader); ret == 0 && offset < zone_size; ) {
+        int64_t end = (offset / DISK_SAVE_CHUNK + 1) * DISK_SAVE_CHUNK;
+        if (end > zone_size)
+            end = zone_size;
+        char* chunk = (char*) disk->header + offset;
+        if (memcmp(chunk, zeros, (size_t) (end - offset)) != 0)
+            ret = DiskDriver_transfer(fd, chunk, end - offset, offset, 1);
+        offset = end;
+    }
+    if (ret == 0)
+        ret = fsync(fd);
+    if (close(fd) == -1)
+        ret = -1;
+    if (ret == -1)
+        if (DEBUG) printf("[DD - save] Cannot write %s.\n", filename);
+    return ret;
+}
+
+int DiskDriver_readBlock(DiskDriver* disk, void* dest, int64_t block_num) {
+    STATS_TIME(STATS_DD_READ_BLOCK);
     if (block_num >= disk->header->num_blocks || block_num < 0)
         return -1;
 
@@ -77,85 +373,277 @@ int DiskDriver_readBlock(DiskDriver* disk, void* dest, int block_num) {
         .num_bits = disk->header->bitmap_blocks,
         .entries = disk->bitmap_data
     };
-    if (BitMap_get(&bmap, block_num, 0) == block_num)
+    if (BitMap_test(&bmap, block_num) == 0)
         return -1;
     
-    void * blocks_start = disk->bitmap_data + disk->header->bitmap_entries;
-    memcpy(dest, blocks_start + block_num * BLOCK_SIZE, BLOCK_SIZE);
+    memcpy(dest, DiskDriver_blockData(disk, block_num), BLOCK_SIZE);
+    STATS_ADD(STATS_BLOCKS_READ, 1);
+    DiskDriver_trace(disk, TRACE_READ, block_num);
     return 0;
 }
 
-int DiskDriver_writeBlock(DiskDriver* disk, void* src, int block_num) {
+int DiskDriver_peekBlock(DiskDriver* disk, void* dest, int64_t block_num) {
+    STATS_TIME(STATS_DD_PEEK_BLOCK);
     if (block_num >= disk->header->num_blocks || block_num < 0)
         return -1;
-    
-    if (block_num == disk->header->first_free_block) 
-        disk->header->first_free_block = DiskDriver_getFreeBlock(disk, block_num + 1);
+
+    memcpy(dest, DiskDriver_blockData(disk, block_num), BLOCK_SIZE);
+    STATS_ADD(STATS_BLOCKS_READ, 1);
+    DiskDriver_trace(disk, TRACE_READ, block_num);
+    return 0;
+}
+
+void* DiskDriver_mapBlock(DiskDriver* disk, int64_t block_num) {
+    STATS_TIME(STATS_DD_MAP_BLOCK);
+    if (block_num >= disk->header->num_blocks || block_num < 0)
+        return NULL;
 
     BitMap bmap = {
         .num_bits = disk->header->bitmap_blocks,
         .entries = disk->bitmap_data
     };
-    if (BitMap_get(&bmap, block_num, 0) == block_num)
-        disk->header->free_blocks --;
+    if (BitMap_test(&bmap, block_num) == 0)
+        return NULL;
 
-    if (BitMap_set(&bmap, block_num, 1) == -1)
-        return -1;
+    STATS_ADD(STATS_BLOCKS_READ, 1);
+    DiskDriver_trace(disk, TRACE_READ, block_num);
+    return DiskDriver_blockData(disk, block_num);
+}
 
-    void * blocks_start = disk->bitmap_data + disk->header->bitmap_entries;
-    memcpy(blocks_start + block_num * BLOCK_SIZE, src, BLOCK_SIZE);
-    return 0;
+void DiskDriver_prefetchBlock(DiskDriver* disk, int64_t block_num) {
+    STATS_TIME(STATS_DD_PREFETCH_BLOCK);
+    if (block_num >= disk->header->num_blocks || block_num < 0)
+        return;
+    // the header and the control block take the first 256 bytes
+    const char* data = DiskDriver_blockData(disk, block_num);
+    int offset;
+    for (offset = 0; offset < 256; offset += 64)
+        __builtin_prefetch(data + offset);
 }
 
-int DiskDriver_freeBlock(DiskDriver* disk, int block_num) {
+int DiskDriver_contains(DiskDriver* disk, const void* ptr) {
+    STATS_TIME(STATS_DD_CONTAINS);
+    const char* zone = (const char*) disk->header;
+    int64_t zone_size = DiskDriver_zoneSize(disk->header->num_blocks);
+    return (const char*) ptr >= zone && (const char*) ptr < zone + zone_size;
+}
+
+int DiskDriver_writeBlock(DiskDriver* disk, void* src, int64_t block_num) {
+    STATS_TIME(STATS_DD_WRITE_BLOCK);
     if (block_num >= disk->header->num_blocks || block_num < 0)
         return -1;
+    
+    DiskDriver_claim(disk, block_num);
+    STATS_ADD(STATS_BLOCKS_WRITTEN, 1);
+    DiskDriver_trace(disk, TRACE_WRITE, block_num);
 
-    BitMap bmap = {
-        .num_bits = disk->header->bitmap_blocks,
-        .entries = disk->bitmap_data
-    };
-    if (BitMap_set(&bmap, block_num, 0) == -1)
+    memcpy(DiskDriver_blockData(disk, block_num), src, BLOCK_SIZE);
+    return 0;
+}
+
+int DiskDriver_freeBlock(DiskDriver* disk, int64_t block_num) {
+    STATS_TIME(STATS_DD_FREE_BLOCK);
+    if (block_num >= disk->header->num_blocks || block_num < 0)
         return -1;
 
-    disk->header->free_blocks ++;
-    disk->header->first_free_block = block_num < disk->header->first_free_block ? 
-                                        block_num : disk->header->first_free_block;
+    if (DiskDriver_setBit(disk, block_num, 0)) {
+        __atomic_add_fetch(&disk->header->free_blocks, 1, __ATOMIC_RELAXED);
+        STATS_ADD(STATS_BLOCKS_FREED, 1);
+        DiskDriver_trace(disk, TRACE_FREE, block_num);
+        DiskDriver_lowerFirstFree(disk, block_num);
+    }
     return 0;
 }
 
-int DiskDriver_getFreeBlock(DiskDriver* disk, int start) {
-    if (start >= disk->header->num_blocks)
+int DiskDriver_freeBlocks(DiskDriver* disk, int64_t* blocks, int num) {
+    STATS_TIME(STATS_DD_FREE_BLOCKS);
+    int idx, ret = 0;
+    int freed = 0;
+    int64_t first_free = -1;
+    for (idx = 0; idx < num; idx++) {
+        int64_t block_num = blocks[idx];
+        if (block_num >= disk->header->num_blocks || block_num < 0) {
+            ret = -1;
+            continue;
+        }
+        if (!DiskDriver_setBit(disk, block_num, 0))
+            continue;
+        freed ++;
+        DiskDriver_trace(disk, TRACE_FREE, block_num);
+        if (first_free == -1 || block_num < first_free)
+            first_free = block_num;
+    }
+
+    __atomic_add_fetch(&disk->header->free_blocks, freed, __ATOMIC_RELAXED);
+    STATS_ADD(STATS_BLOCKS_FREED, freed);
+    if (first_free != -1)
+        DiskDriver_lowerFirstFree(disk, first_free);
+    return ret;
+}
+
+int64_t DiskDriver_getFreeRun(DiskDriver* disk, int64_t start, int64_t len) {
+    STATS_TIME(STATS_DD_GET_FREE_RUN);
+    if (start >= disk->header->num_blocks || len <= 0)
         return -1;
-    
-    BitMap bmap = {
-        .num_bits = disk->header->bitmap_blocks,
-        .entries = disk->bitmap_data
-    };
-    return BitMap_get(&bmap, start, 0);
+
+    int64_t first = DiskDriver_findFree(disk, start);
+    while (first != -1 && first + len <= disk->header->num_blocks) {
+        // first used block of the candidate run, the search goes on after it
+        BitMap bmap = {
+            .num_bits = first + len,
+            .entries = disk->bitmap_data
+        };
+        int64_t used = BitMap_get(&bmap, first, 1);
+        if (used == -1)
+            return first;
+        first = DiskDriver_findFree(disk, used + 1);
+    }
+    return -1;
+}
+
+
+int64_t DiskDriver_getFreeBlock(DiskDriver* disk, int64_t start) {
+    STATS_TIME(STATS_DD_GET_FREE_BLOCK);
+    return DiskDriver_findFree(disk, start);
+}
+
+int DiskDriver_claimBlock(DiskDriver* disk, int64_t block_num) {
+    STATS_TIME(STATS_DD_CLAIM_BLOCK);
+    return DiskDriver_claim(disk, block_num);
+}
+
+int64_t DiskDriver_allocBlock(DiskDriver* disk, int64_t start) {
+    STATS_TIME(STATS_DD_ALLOC_BLOCK);
+    if (start < 0 || start >= disk->header->num_blocks)
+        start = 0;
+
+    int64_t block_num = start;
+    int wrapped = 0;
+    while (1) {
+        block_num = DiskDriver_findFree(disk, block_num);
+        if (block_num == -1) {
+            if (wrapped || start == 0)
+                return -1;
+            wrapped = 1;
+            block_num = 0;
+            continue;
+        }
+        if (wrapped && block_num >= start)
+            return -1;
+        if (DiskDriver_claim(disk, block_num) == 0)
+            return block_num;
+        block_num ++;
+    }
 }
 
 int DiskDriver_flush(DiskDriver* disk) {
+    STATS_TIME(STATS_DD_FLUSH);
     int ret;
-    int zone_size = sizeof(DiskHeader) + disk->header->bitmap_entries +  
-                        disk->header->num_blocks * BLOCK_SIZE;
-    ret = msync(disk->header, zone_size, MS_ASYNC);
+    int64_t zone_size = DiskDriver_zoneSize(disk->header->num_blocks);
+    // a RAM disk has nowhere to write to, see DiskDriver_save
+    ret = disk->fd == -1 ? 0 : msync(disk->header, (size_t) zone_size, MS_ASYNC);
     if (ret == -1)
         return -1;
+    DiskDriver_trace(disk, TRACE_FLUSH, 0);
     return 0;
 }
 
+int DiskDriver_close(DiskDriver* disk) {
+    STATS_TIME(STATS_DD_CLOSE);
+    if (disk->trace != NULL)
+        DiskDriver_stopTrace(disk);
+
+    // after an unclean mount the regions never touched are recounted,
+    // and the totals of the header follow the summary
+    if (disk->region_valid != NULL) {
+        int64_t region, used = 0;
+        for (region = 0; region < disk->header->num_regions; region++) {
+            DiskDriver_checkRegion(disk, region);
+            used += disk->summary[region];
+        }
+        free(disk->region_valid);
+        disk->region_valid = NULL;
+        disk->header->free_blocks = disk->header->num_blocks - used;
+        disk->header->first_free_block = DiskDriver_findFree(disk, 0);
+    }
+
+    size_t zone_size = (size_t) DiskDriver_zoneSize(disk->header->num_blocks);
+    int ret = 0;
+    if (disk->fd != -1) {
+        ret = msync(disk->header, zone_size, MS_SYNC);
+        if (ret == 0) {
+            disk->header->clean = 1;
+            ret = msync(disk->header, sizeof(DiskHeader), MS_SYNC);
+        }
+        close(disk->fd);
+    }
+    munmap(disk->header, zone_size);
+    pthread_mutex_destroy(&disk->region_lock);
+    disk->header = NULL;
+    disk->bitmap_data = disk->block_data = NULL;
+    disk->summary = NULL;
+    disk->fd = -1;
+    return ret;
+}
+
+void DiskDriver_clear(DiskDriver* disk) {
+    STATS_TIME(STATS_DD_CLEAR);
+    bzero(disk->bitmap_data, disk->header->bitmap_entries);
+    bzero(disk->summary, disk->header->num_regions * sizeof(int32_t));
+    free(disk->region_valid);
+    disk->region_valid = NULL;
+    disk->header->free_blocks = disk->header->num_blocks;
+    disk->header->first_free_block = 0;
+}
+
+void DiskDriver_rebuild(DiskDriver* disk) {
+    STATS_TIME(STATS_DD_REBUILD);
+    int64_t region, used = 0;
+    for (region = 0; region < disk->header->num_regions; region++) {
+        disk->summary[region] = DiskDriver_countRegion(disk, region);
+        used += disk->summary[region];
+    }
+    free(disk->region_valid);
+    disk->region_valid = NULL;
+    disk->header->free_blocks = disk->header->num_blocks - used;
+    disk->header->first_free_block = DiskDriver_findFree(disk, 0);
+}
+
+int DiskDriver_startTrace(DiskDriver* disk, const char* filename) {
+    STATS_TIME(STATS_DD_START_TRACE);
+    if (disk->trace != NULL)
+        return -1;
+    disk->trace = Trace_start(filename, disk->header->num_blocks);
+    return disk->trace == NULL ? -1 : 0;
+}
+
+int64_t DiskDriver_stopTrace(DiskDriver* disk) {
+    STATS_TIME(STATS_DD_STOP_TRACE);
+    if (disk->trace == NULL)
+        return -1;
+    int64_t dropped = Trace_stop(disk->trace);
+    disk->trace = NULL;
+    return dropped;
+}
+
 void DiskDriver_print(DiskDriver* disk) {
+    STATS_TIME(STATS_DD_PRINT);
     if (!disk)
         return;
     
     printf("***** DISK INFO *****\n");
-    printf("Disk file descriptor: %d\n", disk->fd);
-    printf("Num blocks: %d\n", disk->header->num_blocks);
-    printf("Bitmap blocks: %d\n", disk->header->bitmap_blocks);
-    printf("Bitmap entries: %d\n", disk->header->bitmap_entries);
-    printf("Free blocks: %d\n", disk->header->free_blocks);
-    printf("First free block: %d\n", disk->header->first_free_block);
+    if (disk->fd == -1)
+        printf("Disk in memory\n");
+    else
+        printf("Disk file descriptor: %d\n", disk->fd);
+    printf("Format version: %d\n", disk->header->version);
+    printf("Num blocks: %" PRId64 "\n", disk->header->num_blocks);
+    printf("Bitmap blocks: %" PRId64 "\n", disk->header->bitmap_blocks);
+    printf("Bitmap entries: %" PRId64 "\n", disk->header->bitmap_entries);
+    printf("Free blocks: %" PRId64 "\n", disk->header->free_blocks);
+    printf("First free block: %" PRId64 "\n", disk->header->first_free_block);
+    printf("Summary regions: %" PRId64 "%s\n", disk->header->num_regions,
+           disk->region_valid != NULL ? " (recounting, mounted unclean)" : "");
     printf("*********************\n");
 }
 
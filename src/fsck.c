@@ -0,0 +1,575 @@
+#include <fsck.h>
+#include <dir_tree.h>
+#include <pack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define FSCK_DATA_FFB ((int64_t) sizeof(((FirstFileBlock*) 0)->data))
+#define FSCK_DATA_FB  ((int64_t) sizeof(((FileBlock*) 0)->data))
+#define FSCK_ENTRIES_FDB ((int64_t) (sizeof(((FirstDirectoryBlock*) 0)->file_blocks) / sizeof(int64_t)))
+#define FSCK_ENTRIES_DB  ((int64_t) (sizeof(((DirectoryBlock*) 0)->file_blocks) / sizeof(int64_t)))
+
+// directories a thread still has to visit: the owner works at the tail,
+// the other threads steal from the head
+typedef struct {
+    int64_t* blocks;
+    int64_t head;
+    int64_t tail;
+    int64_t capacity;
+    pthread_mutex_t lock;
+} FsckDeque;
+
+typedef struct {
+    DiskDriver* disk;
+    BitMap seen;                     // blocks reached so far
+    FILE* out;
+    pthread_mutex_t out_lock;
+    FsckDeque deques[FSCK_MAX_THREADS];
+    int num_threads;
+    int64_t pending;                 // directories pushed and not visited yet
+    int64_t dirs;
+    int64_t files;
+    int64_t errors;
+} Fsck;
+
+typedef struct {
+    Fsck* fsck;
+    int id;
+    pthread_t thread;
+} FsckWorker;
+
+// the packed files met in a directory, whose pack blocks are checked at the end
+typedef struct {
+    int64_t* refs;
+    int64_t num;
+    int64_t capacity;
+} FsckPacked;
+
+// a name in a directory, to find the duplicates
+typedef struct {
+    char name[128];
+    int64_t block;
+} FsckName;
+
+static void Fsck_error(Fsck* fsck, const char* fmt, ...) {
+
+    __atomic_add_fetch(&fsck->errors, 1, __ATOMIC_RELAXED);
+    if (fsck->out == NULL)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&fsck->out_lock);
+    vfprintf(fsck->out, fmt, args);
+    fputc('\n', fsck->out);
+    pthread_mutex_unlock(&fsck->out_lock);
+    va_end(args);
+}
+
+// marks block_num as reached, 0 the first time, -1 if it was already
+// reached or is out of the disk. what names the block in the messages
+static int Fsck_claim(Fsck* fsck, int64_t block_num, int64_t owner, const char* what) {
+
+    int ret = BitMap_testAndSet(&fsck->seen, block_num, 1);
+    if (ret == -1) {
+        Fsck_error(fsck, "%" PRId64 ": %s %" PRId64 " is out of the disk", owner, what, block_num);
+        return -1;
+    }
+    if (ret == 1) {
+        Fsck_error(fsck, "%" PRId64 ": %s %" PRId64 " is used twice", owner, what, block_num);
+        return -1;
+    }
+    return 0;
+}
+
+static void Fsck_push(Fsck* fsck, int id, int64_t block_num) {
+
+    FsckDeque* dq = &fsck->deques[id];
+    __atomic_add_fetch(&fsck->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->capacity) {
+        dq->capacity = dq->capacity ? 2 * dq->capacity : 64;
+        dq->blocks = realloc(dq->blocks, dq->capacity * sizeof(int64_t));
+    }
+    dq->blocks[dq->tail++] = block_num;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+// takes a directory from the tail (own deque) or the head (stealing)
+static int Fsck_take(FsckDeque* dq, int steal, int64_t* block_num) {
+
+    int ret = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *block_num = steal ? dq->blocks[dq->head++] : dq->blocks[--dq->tail];
+        if (dq->head == dq->tail)
+            dq->head = dq->tail = 0;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+// checks the first block of an entry. Only a broken header or is_dir make
+// it -1: an entry with a wrong parent, position or name is still followed,
+// so its blocks count as reached
+static int Fsck_checkFirst(Fsck* fsck, FirstFileBlock* ffb, int64_t block_num,
+                           int64_t dir_block, int idx) {
+
+    BlockHeader* h = &ffb->header;
+    if (h->block_in_disk != block_num || h->block_in_file != 0 || h->previous_block != -1) {
+        Fsck_error(fsck, "%" PRId64 ": bad header of the first block", block_num);
+        return -1;
+    }
+    if (ffb->fcb.is_dir < 0 || ffb->fcb.is_dir > SFS_DIR_TREE) {
+        Fsck_error(fsck, "%" PRId64 ": bad is_dir %d", block_num, ffb->fcb.is_dir);
+        return -1;
+    }
+    if (ffb->fcb.directory_block != dir_block)
+        Fsck_error(fsck, "%" PRId64 ": parent is %" PRId64 ", should be %" PRId64,
+                   block_num, ffb->fcb.directory_block, dir_block);
+    if (dir_block != -1 && ffb->fcb.idx_in_directory != idx)
+        Fsck_error(fsck, "%" PRId64 ": idx_in_directory is %d, should be %d",
+                   block_num, ffb->fcb.idx_in_directory, idx);
+    if (memchr(ffb->fcb.name, 0, sizeof(ffb->fcb.name)) == NULL || ffb->fcb.name[0] == 0) {
+        Fsck_error(fsck, "%" PRId64 ": bad name", block_num);
+        ffb->fcb.name[sizeof(ffb->fcb.name) - 1] = 0;
+    }
+    return 0;
+}
+
+// follows the chain after the first block of a file
+static void Fsck_checkFile(Fsck* fsck, FirstFileBlock* ffb) {
+
+    int64_t first = ffb->header.block_in_disk;
+    int64_t previous = first;
+    int64_t next = ffb->header.next_block;
+    int64_t count = 1;
+    FileBlock fb;
+    while (next != -1) {
+        if (Fsck_claim(fsck, next, first, "data block") == -1)
+            break;
+        DiskDriver_peekBlock(fsck->disk, &fb, next);
+        if (fb.header.previous_block != previous || fb.header.block_in_file != count ||
+            fb.header.block_in_disk != next) {
+            Fsck_error(fsck, "%" PRId64 ": bad header in block %" PRId64 " of the chain", first, next);
+            break;
+        }
+        count++;
+        previous = next;
+        next = fb.header.next_block;
+    }
+
+    if (count != ffb->fcb.size_in_blocks)
+        Fsck_error(fsck, "%" PRId64 ": %" PRId64 " blocks in the chain, size_in_blocks is %" PRId64,
+                   first, count, ffb->fcb.size_in_blocks);
+    int64_t capacity = FSCK_DATA_FFB + (count - 1) * FSCK_DATA_FB;
+    if (ffb->fcb.size_in_bytes < 0 || ffb->fcb.size_in_bytes > capacity)
+        Fsck_error(fsck, "%" PRId64 ": size_in_bytes %" PRId64 " doesn't fit in %" PRId64 " blocks",
+                   first, ffb->fcb.size_in_bytes, count);
+    __atomic_add_fetch(&fsck->files, 1, __ATOMIC_RELAXED);
+}
+
+// checks the packed file ref of the directory dir_block, rebuilding its
+// first block from the slot; the pack block is claimed by Fsck_checkPacks
+static void Fsck_checkPacked(Fsck* fsck, int64_t dir_block, int64_t ref, int idx,
+                             char* name, FsckPacked* packed) {
+
+    PackBlock pack;
+    FirstFileBlock ffb;
+    if (DiskDriver_peekBlock(fsck->disk, &pack, PACK_BLOCK(ref)) == -1 ||
+            pack.header.block_in_file != PACK_MARK || Pack_get(&pack, ref, &ffb) == -1) {
+        Fsck_error(fsck, "%" PRId64 ": slot %d of pack block %" PRId64 " holds no file",
+                   dir_block, PACK_SLOT(ref), PACK_BLOCK(ref));
+        return;
+    }
+    if (packed->num == packed->capacity) {
+        packed->capacity = packed->capacity ? 2 * packed->capacity : 64;
+        packed->refs = realloc(packed->refs, packed->capacity * sizeof(int64_t));
+    }
+    packed->refs[packed->num++] = ref;
+
+    if (Fsck_checkFirst(fsck, &ffb, ref, dir_block, idx) == -1)
+        return;
+    strcpy(name, ffb.fcb.name);
+    Fsck_checkFile(fsck, &ffb);
+}
+
+// checks the entry block_num of the directory dir_block, in position idx.
+// Files are checked at once, directories are pushed on the deque of id.
+// The name of the entry is copied in name, "" if it can't be read
+static void Fsck_checkEntry(Fsck* fsck, int id, int64_t dir_block, int64_t block_num,
+                            int idx, char* name, FsckPacked* packed) {
+
+    name[0] = 0;
+    if (PACK_IS_REF(block_num)) {
+        Fsck_checkPacked(fsck, dir_block, block_num, idx, name, packed);
+        return;
+    }
+    if (Fsck_claim(fsck, block_num, dir_block, "entry") == -1)
+        return;
+
+    FirstFileBlock ffb;
+    DiskDriver_peekBlock(fsck->disk, &ffb, block_num);
+    if (Fsck_checkFirst(fsck, &ffb, block_num, dir_block, idx) == -1)
+        return;
+    strcpy(name, ffb.fcb.name);
+
+    if (ffb.fcb.is_dir)
+        Fsck_push(fsck, id, block_num);
+    else
+        Fsck_checkFile(fsck, &ffb);
+}
+
+static int Fsck_compareNames(const void* a, const void* b) {
+    return strncmp(((const FsckName*) a)->name, ((const FsckName*) b)->name, 128);
+}
+
+// orders the packed files by pack block, then by slot
+static int Fsck_compareRefs(const void* a, const void* b) {
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    if (PACK_BLOCK(x) != PACK_BLOCK(y))
+        return PACK_BLOCK(x) < PACK_BLOCK(y) ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// claims the pack blocks of the packed files of dir_block: each must belong
+// to the directory and count the files found in it, every slot used once
+static void Fsck_checkPacks(Fsck* fsck, int64_t dir_block, FsckPacked* packed) {
+
+    if (packed->num == 0)
+        return;
+    qsort(packed->refs, packed->num, sizeof(int64_t), Fsck_compareRefs);
+    int64_t idx = 0;
+    while (idx < packed->num) {
+        int64_t block_num = PACK_BLOCK(packed->refs[idx]);
+        int64_t end;
+        for (end = idx + 1; end < packed->num && PACK_BLOCK(packed->refs[end]) == block_num; end++) {
+            if (packed->refs[end] == packed->refs[end - 1])
+                Fsck_error(fsck, "%" PRId64 ": slot %d of pack block %" PRId64 " is used twice",
+                           dir_block, PACK_SLOT(packed->refs[end]), block_num);
+        }
+
+        PackBlock pack;
+        if (Fsck_claim(fsck, block_num, dir_block, "pack block") == 0) {
+            DiskDriver_peekBlock(fsck->disk, &pack, block_num);
+            if (pack.header.block_in_disk != block_num || pack.header.previous_block != -1 ||
+                    pack.header.next_block != -1 || pack.directory_block != dir_block)
+                Fsck_error(fsck, "%" PRId64 ": bad header of pack block %" PRId64, dir_block, block_num);
+            else if (pack.num_files != end - idx)
+                Fsck_error(fsck, "%" PRId64 ": pack block %" PRId64 " holds %d files, %" PRId64 " found",
+                           dir_block, block_num, pack.num_files, end - idx);
+        }
+        idx = end;
+    }
+}
+
+// checks the list of entries of a directory stored as DirectoryBlocks
+static void Fsck_visitList(Fsck* fsck, int id, FirstDirectoryBlock* fdb, FsckPacked* packed) {
+
+    int64_t dir_block = fdb->header.block_in_disk;
+    int64_t num_entries = fdb->num_entries;
+    int64_t spare = num_entries > FSCK_ENTRIES_FDB ? num_entries - FSCK_ENTRIES_FDB : 0;
+    if (fdb->fcb.size_in_blocks != 1 + spare || fdb->fcb.size_in_bytes != (1 + spare) * BLOCK_SIZE)
+        Fsck_error(fsck, "%" PRId64 ": size is %" PRId64 " blocks, %" PRId64 " bytes for %" PRId64 " entries",
+                   dir_block, fdb->fcb.size_in_blocks, fdb->fcb.size_in_bytes, num_entries);
+
+    FsckName* names = malloc((num_entries ? num_entries : 1) * sizeof(FsckName));
+    int64_t in_block = num_entries < FSCK_ENTRIES_FDB ? num_entries : FSCK_ENTRIES_FDB;
+    int64_t* file_blocks = fdb->file_blocks;
+    int64_t previous = dir_block;
+    int64_t next = fdb->header.next_block;
+    int64_t block_in_file = 0;
+    int64_t idx = 0;
+    DirectoryBlock db;
+    while (1) {
+        int64_t pos;
+        for (pos = 0; pos < in_block; pos++, idx++) {
+            names[idx].block = file_blocks[pos];
+            Fsck_checkEntry(fsck, id, dir_block, file_blocks[pos], (int) idx, names[idx].name, packed);
+        }
+        if (idx == num_entries || next == -1)
+            break;
+
+        if (Fsck_claim(fsck, next, dir_block, "directory block") == -1)
+            break;
+        DiskDriver_peekBlock(fsck->disk, &db, next);
+        if (db.header.previous_block != previous || db.header.block_in_file != ++block_in_file ||
+            db.header.block_in_disk != next) {
+            Fsck_error(fsck, "%" PRId64 ": bad header in directory block %" PRId64, dir_block, next);
+            break;
+        }
+        file_blocks = db.file_blocks;
+        previous = next;
+        next = db.header.next_block;
+        in_block = num_entries - idx < FSCK_ENTRIES_DB ? num_entries - idx : FSCK_ENTRIES_DB;
+    }
+    if (idx < num_entries)
+        Fsck_error(fsck, "%" PRId64 ": %" PRId64 " entries found, num_entries is %" PRId64,
+                   dir_block, idx, num_entries);
+    else if (next != -1)
+        Fsck_error(fsck, "%" PRId64 ": directory blocks after the last entry", dir_block);
+
+    qsort(names, idx, sizeof(FsckName), Fsck_compareNames);
+    int64_t i;
+    for (i = 1; i < idx; i++) {
+        if (names[i].name[0] != 0 && strncmp(names[i - 1].name, names[i].name, 128) == 0)
+            Fsck_error(fsck, "%" PRId64 ": name %s used by %" PRId64 " and %" PRId64,
+                       dir_block, names[i].name, names[i - 1].block, names[i].block);
+    }
+    free(names);
+}
+
+// state of the visit of a B+tree directory
+typedef struct {
+    int64_t dir_block;
+    int64_t nodes;
+    int64_t entries;
+    int leaf_depth;                  // depth of the leaves, -1 before the first one
+    int64_t last_leaf;               // block of the last leaf seen
+    int64_t last_leaf_next;          // its next_block
+    char last_name[128];             // name of the last entry seen
+    FsckPacked* packed;
+} FsckTree;
+
+// visits the subtree of block_num, in name order.
+// Returns the first entry of the subtree, -1 if it has none or is broken
+static int64_t Fsck_visitNode(Fsck* fsck, int id, FsckTree* tree, int64_t block_num, int depth) {
+
+    if (depth >= DIRTREE_MAX_HEIGHT) {
+        Fsck_error(fsck, "%" PRId64 ": tree deeper than %d levels", tree->dir_block, DIRTREE_MAX_HEIGHT);
+        return -1;
+    }
+    if (Fsck_claim(fsck, block_num, tree->dir_block, "tree node") == -1)
+        return -1;
+    tree->nodes++;
+
+    DirTreeNode node;
+    DiskDriver_peekBlock(fsck->disk, &node, block_num);
+    if (node.header.block_in_disk != block_num || node.num_keys < 0 ||
+        node.num_keys > DIRTREE_FANOUT - 1) {
+        Fsck_error(fsck, "%" PRId64 ": bad tree node %" PRId64, tree->dir_block, block_num);
+        return -1;
+    }
+
+    int idx;
+    if (!node.is_leaf) {
+        int64_t first = -1;
+        for (idx = 0; idx <= node.num_keys; idx++) {
+            int64_t sub = Fsck_visitNode(fsck, id, tree, node.children[idx], depth + 1);
+            if (idx == 0)
+                first = sub;
+            else if (sub != node.keys[idx - 1].block)
+                Fsck_error(fsck, "%" PRId64 ": separator %d of node %" PRId64 " isn't the first entry on its right",
+                           tree->dir_block, idx - 1, block_num);
+        }
+        return first;
+    }
+
+    if (tree->leaf_depth == -1)
+        tree->leaf_depth = depth;
+    else if (tree->leaf_depth != depth)
+        Fsck_error(fsck, "%" PRId64 ": leaf %" PRId64 " at depth %d, the others at %d",
+                   tree->dir_block, block_num, depth, tree->leaf_depth);
+    if (node.header.previous_block != tree->last_leaf ||
+        (tree->last_leaf != -1 && tree->last_leaf_next != block_num))
+        Fsck_error(fsck, "%" PRId64 ": leaf %" PRId64 " badly linked", tree->dir_block, block_num);
+    tree->last_leaf = block_num;
+    tree->last_leaf_next = node.header.next_block;
+
+    for (idx = 0; idx < node.num_keys; idx++) {
+        char name[128];
+        DirTreeKey* key = &node.keys[idx];
+        Fsck_checkEntry(fsck, id, tree->dir_block, key->block, -1, name, tree->packed);
+        tree->entries++;
+        if (name[0] == 0)
+            continue;
+        if (strncmp(key->prefix, name, DIRTREE_PREFIX) != 0)
+            Fsck_error(fsck, "%" PRId64 ": key of %s doesn't match its name", tree->dir_block, name);
+        if (tree->last_name[0] != 0 && strncmp(tree->last_name, name, 128) >= 0)
+            Fsck_error(fsck, "%" PRId64 ": %s is after %s", tree->dir_block, name, tree->last_name);
+        strcpy(tree->last_name, name);
+    }
+    return node.num_keys > 0 ? node.keys[0].block : -1;
+}
+
+// checks the entries of a directory stored as a B+tree
+static void Fsck_visitTree(Fsck* fsck, int id, FirstDirectoryBlock* fdb, FsckPacked* packed) {
+
+    FsckTree tree = {
+        .dir_block = fdb->header.block_in_disk,
+        .leaf_depth = -1,
+        .last_leaf = -1,
+        .last_leaf_next = -1,
+        .packed = packed
+    };
+    if (fdb->header.next_block != -1)
+        Fsck_error(fsck, "%" PRId64 ": tree directory with a chain", tree.dir_block);
+
+    Fsck_visitNode(fsck, id, &tree, fdb->file_blocks[0], 0);
+    if (tree.last_leaf_next != -1)
+        Fsck_error(fsck, "%" PRId64 ": last leaf badly linked", tree.dir_block);
+    if (tree.entries != fdb->num_entries)
+        Fsck_error(fsck, "%" PRId64 ": %" PRId64 " entries found, num_entries is %d",
+                   tree.dir_block, tree.entries, fdb->num_entries);
+    if (fdb->fcb.size_in_blocks != 1 + tree.nodes ||
+        fdb->fcb.size_in_bytes != (1 + tree.nodes) * BLOCK_SIZE)
+        Fsck_error(fsck, "%" PRId64 ": size is %" PRId64 " blocks, %" PRId64 " bytes for %" PRId64 " nodes",
+                   tree.dir_block, fdb->fcb.size_in_blocks, fdb->fcb.size_in_bytes, tree.nodes);
+}
+
+// visits the directory dir_block, whose first block was already checked
+static void Fsck_visitDir(Fsck* fsck, int id, int64_t dir_block) {
+
+    FirstDirectoryBlock fdb;
+    DiskDriver_peekBlock(fsck->disk, &fdb, dir_block);
+    __atomic_add_fetch(&fsck->dirs, 1, __ATOMIC_RELAXED);
+
+    if (fdb.num_entries < 0) {
+        Fsck_error(fsck, "%" PRId64 ": num_entries is %d", dir_block, fdb.num_entries);
+        return;
+    }
+    FsckPacked packed = {0};
+    if (fdb.fcb.is_dir == SFS_DIR_TREE)
+        Fsck_visitTree(fsck, id, &fdb, &packed);
+    else
+        Fsck_visitList(fsck, id, &fdb, &packed);
+    Fsck_checkPacks(fsck, dir_block, &packed);
+    free(packed.refs);
+}
+
+static void* Fsck_work(void* arg) {
+
+    FsckWorker* worker = (FsckWorker*) arg;
+    Fsck* fsck = worker->fsck;
+    int id = worker->id;
+    while (1) {
+        int64_t dir_block;
+        int found = Fsck_take(&fsck->deques[id], 0, &dir_block);
+        int victim;
+        for (victim = 1; !found && victim < fsck->num_threads; victim++)
+            found = Fsck_take(&fsck->deques[(id + victim) % fsck->num_threads], 1, &dir_block);
+
+        if (found) {
+            Fsck_visitDir(fsck, id, dir_block);
+            __atomic_sub_fetch(&fsck->pending, 1, __ATOMIC_SEQ_CST);
+        }
+        else if (__atomic_load_n(&fsck->pending, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// compares the bitmap of the blocks reached with the one on disk
+static void Fsck_compareBitmaps(Fsck* fsck, FsckReport* report) {
+
+    DiskDriver* disk = fsck->disk;
+    int64_t num_bytes = (disk->header->num_blocks + 7) / 8;
+    int64_t idx;
+    int32_t region_used = 0;
+    for (idx = 0; idx < num_bytes; idx++) {
+        unsigned char on_disk = disk->bitmap_data[idx];
+        unsigned char reached = fsck->seen.entries[idx];
+        report->used_blocks += __builtin_popcount(reached);
+        report->leaked_blocks += __builtin_popcount(on_disk & ~reached & 0xff);
+        report->lost_blocks += __builtin_popcount(reached & ~on_disk & 0xff);
+
+        // the summary is only trusted by the driver if the disk was closed clean
+        region_used += __builtin_popcount(on_disk);
+        if ((idx + 1) % (DISK_REGION_BLOCKS / 8) == 0 || idx + 1 == num_bytes) {
+            if (disk->region_valid == NULL && disk->summary[idx / (DISK_REGION_BLOCKS / 8)] != region_used)
+                report->bad_regions ++;
+            region_used = 0;
+        }
+    }
+    if (report->leaked_blocks && fsck->out)
+        fprintf(fsck->out, "%" PRId64 " blocks used in the bitmap are not reached\n", report->leaked_blocks);
+    if (report->lost_blocks && fsck->out)
+        fprintf(fsck->out, "%" PRId64 " blocks reached are free in the bitmap\n", report->lost_blocks);
+    if (report->bad_regions && fsck->out)
+        fprintf(fsck->out, "%" PRId64 " regions of the summary don't match the bitmap\n", report->bad_regions);
+}
+
+int Fsck_check(DiskDriver* disk, int num_threads, int repair, FILE* out, FsckReport* report) {
+
+    memset(report, 0, sizeof(FsckReport));
+
+    FirstDirectoryBlock top;
+    if (DiskDriver_peekBlock(disk, &top, 0) == -1 ||
+        top.header.block_in_disk != 0 || top.fcb.directory_block != -1 || !top.fcb.is_dir) {
+        if (DEBUG) printf("[FSCK - check] No file system on the disk.\n");
+        return -1;
+    }
+
+    if (num_threads <= 0)
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0)
+        num_threads = 1;
+    if (num_threads > FSCK_MAX_THREADS)
+        num_threads = FSCK_MAX_THREADS;
+
+    Fsck* fsck = calloc(1, sizeof(Fsck));
+    fsck->disk = disk;
+    fsck->out = out;
+    fsck->num_threads = num_threads;
+    fsck->seen.num_bits = disk->header->num_blocks;
+    fsck->seen.entries = calloc((disk->header->num_blocks + 7) / 8, 1);
+    pthread_mutex_init(&fsck->out_lock, NULL);
+    int idx;
+    for (idx = 0; idx < num_threads; idx++)
+        pthread_mutex_init(&fsck->deques[idx].lock, NULL);
+
+    Fsck_claim(fsck, 0, -1, "top level directory");
+    Fsck_checkFirst(fsck, (FirstFileBlock*) &top, 0, -1, 0);
+    Fsck_push(fsck, 0, 0);
+
+    FsckWorker* workers = calloc(num_threads, sizeof(FsckWorker));
+    for (idx = 0; idx < num_threads; idx++) {
+        workers[idx].fsck = fsck;
+        workers[idx].id = idx;
+        if (idx > 0)
+            pthread_create(&workers[idx].thread, NULL, Fsck_work, &workers[idx]);
+    }
+    Fsck_work(&workers[0]);
+    for (idx = 1; idx < num_threads; idx++)
+        pthread_join(workers[idx].thread, NULL);
+
+    report->dirs = fsck->dirs;
+    report->files = fsck->files;
+    report->errors = fsck->errors;
+    Fsck_compareBitmaps(fsck, report);
+
+    int64_t free_blocks = disk->header->num_blocks - report->used_blocks;
+    if (disk->header->free_blocks != free_blocks && out)
+        fprintf(out, "free_blocks is %" PRId64 ", should be %" PRId64 "\n",
+                disk->header->free_blocks, free_blocks);
+
+    if (repair && (report->leaked_blocks || report->lost_blocks || report->bad_regions ||
+                   disk->header->free_blocks != free_blocks)) {
+        memcpy(disk->bitmap_data, fsck->seen.entries, (disk->header->num_blocks + 7) / 8);
+        DiskDriver_rebuild(disk);
+        DiskDriver_flush(disk);
+        report->repaired = 1;
+    }
+
+    for (idx = 0; idx < num_threads; idx++) {
+        free(fsck->deques[idx].blocks);
+        pthread_mutex_destroy(&fsck->deques[idx].lock);
+    }
+    pthread_mutex_destroy(&fsck->out_lock);
+    free(fsck->seen.entries);
+    free(workers);
+    free(fsck);
+    return 0;
+}
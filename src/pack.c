@@ -0,0 +1,176 @@
+#include <pack.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define PACK_SLOTS(pack) ((PackSlot*) (pack)->bytes)
+
+// start of the names and data in bytes, the end of the free space
+static int Pack_dataStart(const PackBlock* pack) {
+    const PackSlot* slots = PACK_SLOTS(pack);
+    int start = PACK_BYTES;
+    int idx;
+    for (idx = 0; idx < pack->num_slots; idx++) {
+        if (slots[idx].name_len != 0 && slots[idx].offset < start)
+            start = slots[idx].offset;
+    }
+    return start;
+}
+
+// reads the pack block block_num in pack, checking its header
+static int Pack_readBlock(DiskDriver* disk, PackBlock* pack, int64_t block_num) {
+    if (DiskDriver_readBlock(disk, pack, block_num) == -1) {
+        if (DEBUG) printf("[PK - readBlock] Cannot read from disk.\n");
+        return -1;
+    }
+    if (pack->header.block_in_file != PACK_MARK || pack->header.block_in_disk != block_num ||
+            pack->num_slots < 0 || pack->num_slots * (int) sizeof(PackSlot) > PACK_BYTES ||
+            pack->num_files < 0 || pack->num_files > pack->num_slots) {
+        if (DEBUG) printf("[PK - readBlock] Not a pack block.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// the slot of ref in pack, NULL unless it holds a file
+static PackSlot* Pack_slot(const PackBlock* pack, int64_t ref) {
+    int slot = PACK_SLOT(ref);
+    if (slot < 0 || slot >= pack->num_slots || pack->num_slots * (int) sizeof(PackSlot) > PACK_BYTES)
+        return NULL;
+    PackSlot* s = &PACK_SLOTS(pack)[slot];
+    if (s->name_len == 0 || s->offset < pack->num_slots * (int) sizeof(PackSlot) ||
+            s->offset + s->name_len + s->size > PACK_BYTES)
+        return NULL;
+    return s;
+}
+
+int Pack_fits(const FirstFileBlock* ffb) {
+    size_t name_len = strnlen(ffb->fcb.name, sizeof(ffb->fcb.name));
+    return ffb->fcb.is_dir == 0 && ffb->fcb.size_in_blocks == 1 && ffb->header.next_block == -1 &&
+           name_len > 0 && name_len < sizeof(ffb->fcb.name) && ffb->fcb.size_in_bytes >= 0 &&
+           sizeof(PackSlot) + name_len + ffb->fcb.size_in_bytes <= PACK_MAX_RECORD;
+}
+
+void Pack_init(PackBlock* pack, int64_t block_num, int64_t dir_block) {
+    memset(pack, 0, sizeof(PackBlock));
+    pack->header.previous_block = -1;
+    pack->header.next_block = -1;
+    pack->header.block_in_file = PACK_MARK;
+    pack->header.block_in_disk = block_num;
+    pack->directory_block = dir_block;
+}
+
+int Pack_load(DiskDriver* disk, PackBlock* pack, int64_t block_num, int64_t dir_block) {
+    if (Pack_readBlock(disk, pack, block_num) == -1 || pack->directory_block != dir_block)
+        return -1;
+    return 0;
+}
+
+int Pack_add(PackBlock* pack, const FirstFileBlock* ffb) {
+
+    PackSlot* slots = PACK_SLOTS(pack);
+    int slot;
+    for (slot = 0; slot < pack->num_slots; slot++) {
+        if (slots[slot].name_len == 0)
+            break;
+    }
+
+    int name_len = (int) strnlen(ffb->fcb.name, sizeof(ffb->fcb.name));
+    int size = (int) ffb->fcb.size_in_bytes;
+    int slots_end = (slot == pack->num_slots ? slot + 1 : pack->num_slots) * (int) sizeof(PackSlot);
+    int offset = Pack_dataStart(pack) - name_len - size;
+    if (offset < slots_end)
+        return -1;
+
+    memcpy(pack->bytes + offset, ffb->fcb.name, name_len);
+    memcpy(pack->bytes + offset + name_len, ffb->data, size);
+    slots[slot].idx_in_directory = ffb->fcb.idx_in_directory;
+    slots[slot].offset = (uint16_t) offset;
+    slots[slot].size = (uint16_t) size;
+    slots[slot].name_len = (uint8_t) name_len;
+    if (slot == pack->num_slots)
+        pack->num_slots += 1;
+    pack->num_files += 1;
+    return slot;
+}
+
+int Pack_get(const PackBlock* pack, int64_t ref, FirstFileBlock* ffb) {
+
+    const PackSlot* s = Pack_slot(pack, ref);
+    if (s == NULL || s->name_len >= sizeof(ffb->fcb.name) || s->size > sizeof(ffb->data))
+        return -1;
+
+    memset(ffb, 0, sizeof(FirstFileBlock));
+    ffb->header.previous_block = -1;
+    ffb->header.next_block = -1;
+    ffb->header.block_in_file = 0;
+    ffb->header.block_in_disk = ref;
+    ffb->fcb.directory_block = pack->directory_block;
+    ffb->fcb.block_in_disk = ref;
+    ffb->fcb.idx_in_directory = s->idx_in_directory;
+    memcpy(ffb->fcb.name, pack->bytes + s->offset, s->name_len);
+    ffb->fcb.size_in_bytes = s->size;
+    ffb->fcb.size_in_blocks = 1;
+    ffb->fcb.is_dir = 0;
+    memcpy(ffb->data, pack->bytes + s->offset + s->name_len, s->size);
+    return 0;
+}
+
+int Pack_read(DiskDriver* disk, int64_t ref, FirstFileBlock* ffb) {
+    PackBlock pack;
+    if (Pack_readBlock(disk, &pack, PACK_BLOCK(ref)) == -1 || Pack_get(&pack, ref, ffb) == -1) {
+        if (DEBUG) printf("[PK - read] No such packed file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int Pack_readEntry(DiskDriver* disk, void* dest, int64_t block_num) {
+    if (PACK_IS_REF(block_num))
+        return Pack_read(disk, block_num, dest);
+    return DiskDriver_readBlock(disk, dest, block_num);
+}
+
+int Pack_setIndex(DiskDriver* disk, int64_t ref, int idx) {
+    PackBlock pack;
+    if (Pack_readBlock(disk, &pack, PACK_BLOCK(ref)) == -1)
+        return -1;
+    PackSlot* s = Pack_slot(&pack, ref);
+    if (s == NULL)
+        return -1;
+    s->idx_in_directory = idx;
+    return DiskDriver_writeBlock(disk, &pack, PACK_BLOCK(ref));
+}
+
+int Pack_remove(DiskDriver* disk, int64_t ref) {
+
+    PackBlock pack;
+    int64_t block_num = PACK_BLOCK(ref);
+    if (Pack_readBlock(disk, &pack, block_num) == -1)
+        return -1;
+    PackSlot* s = Pack_slot(&pack, ref);
+    if (s == NULL) {
+        if (DEBUG) printf("[PK - remove] No such packed file.\n");
+        return -1;
+    }
+
+    pack.num_files -= 1;
+    if (pack.num_files == 0)
+        return DiskDriver_freeBlock(disk, block_num);
+
+    // the records before the removed one move up over it
+    int start = Pack_dataStart(&pack);
+    int len = s->name_len + s->size;
+    int end = s->offset;
+    memmove(pack.bytes + start + len, pack.bytes + start, end - start);
+    s->name_len = 0;
+    PackSlot* slots = PACK_SLOTS(&pack);
+    int idx;
+    for (idx = 0; idx < pack.num_slots; idx++) {
+        if (slots[idx].name_len != 0 && slots[idx].offset < end)
+            slots[idx].offset += len;
+    }
+    while (pack.num_slots > 0 && slots[pack.num_slots - 1].name_len == 0)
+        pack.num_slots -= 1;
+    return DiskDriver_writeBlock(disk, &pack, block_num);
+}
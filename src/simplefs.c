@@ -1,966 +1,3636 @@
 #include <simplefs.h>
+#include <dir_tree.h>
+#include <pack.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-const int max_entries_db = (BLOCK_SIZE - sizeof(BlockHeader)) / sizeof(int);
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+const int max_entries_db = (BLOCK_SIZE - sizeof(BlockHeader)) / sizeof(int64_t);
 const int max_entries_fdb = (BLOCK_SIZE - sizeof(BlockHeader) -
-                             sizeof(FileControlBlock) - sizeof(int)) / sizeof(int);
+                             sizeof(FileControlBlock) - sizeof(int)) / sizeof(int64_t);
 const int max_data_ffb = BLOCK_SIZE - sizeof(BlockHeader) -
                            sizeof(FileControlBlock);
 const int max_data_fb = BLOCK_SIZE - sizeof(BlockHeader);
 
-static int SimpleFS_exists(DirectoryHandle* d, const char* filename) {
-    
-    FirstDirectoryBlock* fdb = d->dcb;
-    int entries = fdb->num_entries;
-    int idx, ret;
-
-    for (idx = 0; idx < max_entries_fdb; idx++) {
-        if (idx >= entries)
-            return 0;
-        
-        FirstFileBlock ffb;
-        int block_num = fdb->file_blocks[idx];
-        ret = DiskDriver_readBlock(d->sfs->disk, &ffb, block_num);
-        if (ret == -1)
-            return 0;
-        
-        if (strncmp(ffb.fcb.name, filename, 128) == 0)
-            return ffb.header.block_in_disk;
-    }
-
-    entries -= idx;
+static int SimpleFS_reserveLocked(FileHandle* f, int64_t size);
+static int SimpleFS_unpack(FileHandle* f);
 
-    if (entries == 0)
-        return 0;
+// the lock guarding the entries of the directory starting at dir_block
+static pthread_rwlock_t* SimpleFS_dirLock(SimpleFS* fs, int64_t dir_block) {
+    return &fs->dir_locks[dir_block % SFS_DIR_LOCKS];
+}
 
-    DirectoryBlock db;
-    ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
+// reloads the private copy of the first directory block of d,
+// other handles may have changed the directory. The caller holds its lock.
+// The directory may have been removed since the copy was taken, and its
+// block given to something else: returns -1 unless the block is still the
+// first block of a directory with the same parent and name. Removal holds
+// the lock of the directory, so the check holds as long as the caller's lock
+static int SimpleFS_reloadDir(DirectoryHandle* d) {
+    FirstDirectoryBlock fdb;
+    int64_t dir_block = d->dcb->header.block_in_disk;
+    int ret = DiskDriver_readBlock(d->sfs->disk, &fdb, dir_block);
     if (ret == -1) {
-        if (DEBUG) printf("[SFS - exists] Cannot read from disk.\n");
-        return 0;
+        if (DEBUG) printf("[SFS - reloadDir] Cannot read from disk.\n");
+        return -1;
     }
-    for (idx = 0; idx < max_entries_db; idx++) {
-        if (idx >= entries)
-            return 0;
+    if (fdb.fcb.is_dir == 0 || fdb.header.block_in_file != 0 ||
+            fdb.header.block_in_disk != dir_block ||
+            fdb.fcb.directory_block != d->dcb->fcb.directory_block ||
+            strncmp(fdb.fcb.name, d->dcb->fcb.name, 128) != 0) {
+        if (DEBUG) printf("[SFS - reloadDir] Directory was removed.\n");
+        return -1;
+    }
+    memcpy(d->dcb, &fdb, sizeof(FirstDirectoryBlock));
+    return 0;
+}
 
+static int64_t SimpleFS_findEntry(SimpleFS* fs, FirstDirectoryBlock* fdb, 
+                                  const char* filename, int* is_dir) {
+
+    if (fdb->fcb.is_dir == SFS_DIR_TREE) {
         FirstFileBlock ffb;
-        int block_num = db.file_blocks[idx];
-        ret = DiskDriver_readBlock(d->sfs->disk, &ffb, block_num);
-        if (ret == -1)
+        int64_t block_num = DirTree_lookup(fs->disk, fdb, filename);
+        if (block_num == -1 || Pack_readEntry(fs->disk, &ffb, block_num) == -1)
             return 0;
-        
-        if (strncmp(ffb.fcb.name, filename, 128) == 0)
-            return ffb.header.block_in_disk;
+        if (is_dir)
+            *is_dir = ffb.fcb.is_dir;
+        return block_num;
     }
-    entries -= idx;
-    while (db.header.next_block != -1) {
-        ret = DiskDriver_readBlock(d->sfs->disk, &db, db.header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - exists] Cannot read from disk.\n");
-            return 0;
-        }
-        for (idx = 0; idx < max_entries_db; idx++) {
-            if (idx >= entries)
-                return 0;
 
+    int remaining = fdb->num_entries;
+    int in_block = remaining < max_entries_fdb ? remaining : max_entries_fdb;
+    int64_t* file_blocks = fdb->file_blocks;
+    int64_t next_block = fdb->header.next_block;
+    int idx, ret;
+
+    DirectoryBlock db;
+    while (1) {
+        for (idx = 0; idx < in_block; idx++) {
             FirstFileBlock ffb;
-            int block_num = db.file_blocks[idx];
-            ret = DiskDriver_readBlock(d->sfs->disk, &ffb, block_num);
+            ret = Pack_readEntry(fs->disk, &ffb, file_blocks[idx]);
             if (ret == -1)
                 return 0;
 
-            if (strncmp(ffb.fcb.name, filename, 128) == 0)
+            if (strncmp(ffb.fcb.name, filename, 128) == 0) {
+                if (is_dir)
+                    *is_dir = ffb.fcb.is_dir;
                 return ffb.header.block_in_disk;
+            }
         }
-        entries -= idx;
+
+        remaining -= in_block;
+        if (remaining <= 0 || next_block == -1)
+            return 0;
+
+        ret = DiskDriver_readBlock(fs->disk, &db, next_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - findEntry] Cannot read from disk.\n");
+            return 0;
+        }
+        file_blocks = db.file_blocks;
+        next_block = db.header.next_block;
+        in_block = remaining < max_entries_db ? remaining : max_entries_db;
     }
-    return 0;
 }
 
-static int SimpleFS_removeDirBlock(DirectoryHandle* d, DirectoryBlock* b) {
-    if (b->header.next_block == -1) {
-        return DiskDriver_freeBlock(d->sfs->disk, b->header.block_in_disk);
+// looks filename up in the directory whose first block is dir_block,
+// going through the dentry cache. Returns the first block of the entry
+// -1 if it doesn't exist
+static int64_t SimpleFS_lookupEntry(SimpleFS* fs, int64_t dir_block, const char* filename, int* is_dir) {
+
+    int64_t block_num;
+    int entry_is_dir = 0;
+    if (DentryCache_lookup(&fs->dcache, dir_block, filename, &block_num, &entry_is_dir)) {
+        if (is_dir)
+            *is_dir = entry_is_dir;
+        return block_num;
     }
-    else {
-        DirectoryBlock db = {0};
-        int ret = DiskDriver_readBlock(d->sfs->disk, &db, b->header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeDirBlock] Cannot read from disk.\n");
-            return -1;
-        }
 
-        SimpleFS_removeDirBlock(d, &db);
-        return DiskDriver_freeBlock(d->sfs->disk, b->header.block_in_disk);
+    // the scan and the insertion are done under the directory lock,
+    // so a concurrent create or remove can't be cached the wrong way
+    pthread_rwlock_t* lock = SimpleFS_dirLock(fs, dir_block);
+    pthread_rwlock_rdlock(lock);
+    FirstDirectoryBlock fdb;
+    int ret = DiskDriver_readBlock(fs->disk, &fdb, dir_block);
+    if (ret == -1) {
+        pthread_rwlock_unlock(lock);
+        if (DEBUG) printf("[SFS - lookupEntry] Cannot read from disk.\n");
+        return -1;
     }
-}
 
-static int SimpleFS_removeFileBlock(DirectoryHandle* d, FileBlock* b) {
-    if (b->header.next_block == -1) {
-        return DiskDriver_freeBlock(d->sfs->disk, b->header.block_in_disk);
+    if (strcmp(filename, "..") == 0) {
+        block_num = fdb.fcb.directory_block == -1 ? dir_block : fdb.fcb.directory_block;
+        entry_is_dir = 1;
     }
     else {
-        FileBlock fb = {0};
-        int ret = DiskDriver_readBlock(d->sfs->disk, &fb, b->header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFileBlock] Cannot read from disk.\n");
-            return -1;
-        }
-
-        SimpleFS_removeFileBlock(d, &fb);
-        return DiskDriver_freeBlock(d->sfs->disk, b->header.block_in_disk);
+        block_num = SimpleFS_findEntry(fs, &fdb, filename, &entry_is_dir);
+        if (block_num == 0)
+            block_num = -1;
     }
+
+    DentryCache_insert(&fs->dcache, dir_block, filename, block_num, entry_is_dir);
+    pthread_rwlock_unlock(lock);
+    if (is_dir)
+        *is_dir = entry_is_dir;
+    return block_num;
 }
 
-static int SimpleFS_removeFile(DirectoryHandle* d, FirstFileBlock* ffb) {
+// the caller holds the lock of the directory of d
+static int64_t SimpleFS_exists(DirectoryHandle* d, const char* filename) {
 
-    int ret;
+    int is_dir = 0;
+    int64_t block_num;
+    if (DentryCache_lookup(&d->sfs->dcache, d->dcb->header.block_in_disk, filename, &block_num, &is_dir))
+        return block_num == -1 ? 0 : block_num;
+
+    block_num = SimpleFS_findEntry(d->sfs, d->dcb, filename, &is_dir);
+    DentryCache_insert(&d->sfs->dcache, d->dcb->header.block_in_disk, filename, 
+                        block_num ? block_num : -1, is_dir);
+    return block_num;
+}
+
+// copies into name the component of path starting at *path (skipping slashes)
+// and advances *path past it. Returns 0 if there are no more components,
+// -1 if the component is too long
+static int SimpleFS_nextComponent(const char** path, char* name) {
+
+    const char* p = *path;
+    while (*p == '/')
+        p++;
+    if (*p == 0)
+        return 0;
 
-    FirstDirectoryBlock* fdb_parent = d->dcb;
+    int len = 0;
+    while (p[len] != '/' && p[len] != 0)
+        len++;
+    if (len >= 128)
+        return -1;
 
-    int current_block_idx;
-    if (ffb->fcb.idx_in_directory <= max_entries_fdb)
-        current_block_idx = 0;
-    else 
-        current_block_idx = (ffb->fcb.idx_in_directory - max_entries_fdb) / max_entries_db;
+    memcpy(name, p, len);
+    name[len] = 0;
+    *path = p + len;
+    return 1;
+}
 
-    if (current_block_idx == 0) {
-        fdb_parent->num_entries -= 1;
-        fdb_parent->file_blocks[ffb->fcb.idx_in_directory] = fdb_parent->file_blocks[fdb_parent->num_entries];
+// fills parent with a handle to the directory containing the last component
+// of path, and copies that component in name. If the directory is the one
+// of d the handle shares its blocks, otherwise parent->dcb is allocated
+// and must be released with SimpleFS_releaseParent
+static int SimpleFS_openParent(DirectoryHandle* d, const char* path, 
+                               DirectoryHandle* parent, char* name) {
+
+    const char* last = strrchr(path, '/');
+    int64_t dir_block;
+    if (last == NULL) {
+        dir_block = d->dcb->header.block_in_disk;
+        last = path;
     }
-    else { 
-        DirectoryBlock last_block, current_block;
-        ret = DiskDriver_readBlock(d->sfs->disk, &last_block, fdb_parent->header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot read from disk.\n");
+    else {
+        int len = last - path;
+        char* dir_path = strndup(path, len);
+        dir_block = len == 0 ? 0 : SimpleFS_lookupPath(d, dir_path);
+        free(dir_path);
+        if (dir_block == -1)
             return -1;
-        }
-        if (last_block.header.block_in_file == current_block_idx) 
-            current_block = last_block;
-        while (last_block.header.next_block != -1) {
-            ret = DiskDriver_readBlock(d->sfs->disk, &last_block, last_block.header.next_block);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - removeFile] Cannot read from disk.\n");
-                return -1;
-            }
-            if (last_block.header.block_in_file == current_block_idx) 
-                current_block = last_block;
-        }
+        last++;
+    }
 
-        fdb_parent->num_entries -= 1;
-        int idx_inside_last_block = (fdb_parent->num_entries - max_entries_fdb) % max_entries_db;
-        int idx_inside_current_block = (ffb->fcb.idx_in_directory - max_entries_fdb) % max_entries_db;
+    if (*last == 0 || strlen(last) >= 128)
+        return -1;
+    strcpy(name, last);
 
-        current_block.file_blocks[idx_inside_current_block] = last_block.file_blocks[idx_inside_last_block];
-        
-        ret = DiskDriver_writeBlock(d->sfs->disk, &last_block, last_block.header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot write on disk.\n");
-            return -1; 
-        }
-        ret = DiskDriver_writeBlock(d->sfs->disk, &current_block, current_block.header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot write on disk.\n");
-            return -1; 
+    *parent = *d;
+    if (dir_block == d->dcb->header.block_in_disk)
+        return 0;
+
+    FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, dir_block);
+    pthread_rwlock_rdlock(lock);
+    int ret = DiskDriver_readBlock(d->sfs->disk, fdb, dir_block);
+    pthread_rwlock_unlock(lock);
+    if (ret == -1 || fdb->fcb.is_dir == 0) {
+        if (DEBUG) printf("[SFS - openParent] Cannot open parent directory.\n");
+        free(fdb);
+        return -1;
+    }
+
+    parent->dcb = fdb;
+    parent->directory = NULL;
+    parent->current_block = &fdb->header;
+    parent->pos_in_dir = 0;
+    parent->pos_in_block = 0;
+    return 0;
+}
+
+static void SimpleFS_releaseParent(DirectoryHandle* d, DirectoryHandle* parent) {
+    if (parent->dcb != d->dcb)
+        free(parent->dcb);
+}
+
+// bucket of the open file table for block_num; packed files share the
+// block, the slot in the high bits is folded in by the multiplication
+static int SimpleFS_openBucket(int64_t block_num, int buckets) {
+    return (int) (((uint64_t) block_num * 0x9e3779b97f4a7c15ull) >> 32) & (buckets - 1);
+}
+
+static OpenFileEntry* SimpleFS_findOpenFile(SimpleFS* fs, int64_t block_num) {
+    if (fs->open_files == NULL)
+        return NULL;
+    OpenFileEntry* entry = fs->open_files[SimpleFS_openBucket(block_num, fs->open_buckets)];
+    while (entry != NULL && entry->fcb->header.block_in_disk != block_num)
+        entry = entry->next;
+    return entry;
+}
+
+static void SimpleFS_linkOpenFile(SimpleFS* fs, OpenFileEntry* entry) {
+    OpenFileEntry** bucket =
+        &fs->open_files[SimpleFS_openBucket(entry->fcb->header.block_in_disk, fs->open_buckets)];
+    entry->next = *bucket;
+    *bucket = entry;
+}
+
+static void SimpleFS_unlinkOpenFile(SimpleFS* fs, OpenFileEntry* entry) {
+    OpenFileEntry** link =
+        &fs->open_files[SimpleFS_openBucket(entry->fcb->header.block_in_disk, fs->open_buckets)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+}
+
+// doubles the buckets of the open file table, making the first ones if
+// there are none. Entries don't move, handles keep pointing to them
+static void SimpleFS_growOpenFiles(SimpleFS* fs) {
+
+    OpenFileEntry** old = fs->open_files;
+    int old_buckets = fs->open_buckets;
+    fs->open_buckets = old_buckets ? old_buckets * 2 : SFS_OPEN_BUCKETS;
+    fs->open_files = calloc(fs->open_buckets, sizeof(OpenFileEntry*));
+
+    int idx;
+    for (idx = 0; idx < old_buckets; idx++) {
+        OpenFileEntry* entry = old[idx];
+        while (entry != NULL) {
+            OpenFileEntry* next = entry->next;
+            SimpleFS_linkOpenFile(fs, entry);
+            entry = next;
         }
+    }
+    free(old);
+}
 
+// returns the open file table entry of the file starting at block_num,
+// reading its first block if it isn't open yet. NULL on error
+// the caller holds table_lock, as for the other open file table helpers
+static OpenFileEntry* SimpleFS_getOpenFile(SimpleFS* fs, int64_t block_num) {
+
+    OpenFileEntry* entry = SimpleFS_findOpenFile(fs, block_num);
+    if (entry != NULL) {
+        entry->refcount += 1;
+        return entry;
     }
-    ret = DiskDriver_writeBlock(d->sfs->disk, fdb_parent, fdb_parent->header.block_in_disk);
+
+    FirstFileBlock* ffb = calloc(1, sizeof(FirstFileBlock));
+    int ret = Pack_readEntry(fs->disk, ffb, block_num);
     if (ret == -1) {
-        if (DEBUG) printf("[SFS - removeFile] Cannot write on disk.\n");
-        return -1; 
+        if (DEBUG) printf("[SFS - getOpenFile] Cannot read from disk.\n");
+        free(ffb);
+        return NULL;
+    }
+
+    if (ffb->fcb.is_dir) {
+        if (DEBUG) printf("[SFS - getOpenFile] Cannot open a directory.\n");
+        free(ffb);
+        return NULL;
     }
 
-    ret = DiskDriver_freeBlock(d->sfs->disk, ffb->header.block_in_disk);
+    entry = calloc(1, sizeof(OpenFileEntry));
+    entry->fcb = ffb;
+    entry->refcount = 1;
+    pthread_rwlock_init(&entry->lock, NULL);
+    if (fs->num_open == fs->open_buckets)
+        SimpleFS_growOpenFiles(fs);
+    SimpleFS_linkOpenFile(fs, entry);
+    fs->num_open += 1;
+    return entry;
+}
+
+// writes the shared first block on disk if it changed
+static int SimpleFS_writeBackFcb(SimpleFS* fs, OpenFileEntry* entry) {
+
+    if (!entry->dirty)
+        return 0;
+
+    int ret = DiskDriver_writeBlock(fs->disk, entry->fcb, entry->fcb->header.block_in_disk);
     if (ret == -1) {
-        if (DEBUG) printf("[SFS - removeFile] Cannot free block on disk.\n");
+        if (DEBUG) printf("[SFS - writeBackFcb] Cannot write on disk.\n");
         return -1;
     }
-    if (ffb->header.next_block != -1) {
-        FileBlock fb = {0};
-        ret = DiskDriver_readBlock(d->sfs->disk, &fb, ffb->header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot read from disk.\n");
-            return -1;
-        }
+    entry->dirty = 0;
+    return 0;
+}
+
+// writes the block under the cursor on disk if the handle changed it
+// the first block is shared and is written through SimpleFS_writeBackFcb
+static int SimpleFS_flushBlock(FileHandle* f) {
+
+    if (!f->block_dirty)
+        return 0;
 
-        return SimpleFS_removeFileBlock(d, &fb); 
+    int ret = DiskDriver_writeBlock(f->sfs->disk, f->current_block, f->current_block->block_in_disk);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - flushBlock] Cannot write on disk.\n");
+        return -1;
     }
+    f->block_dirty = 0;
+    f->entry->data_version += 1;
+    f->block_version = f->entry->data_version;
     return 0;
 }
 
-static int SimpleFS_removeDir(DirectoryHandle* d, FirstDirectoryBlock* fdb) {
-    
-    int ret;
-
-    FirstDirectoryBlock* fdb_parent = d->dcb;
+// reloads the block under the cursor if another handle wrote
+// some data block of the file after it was read
+static int SimpleFS_refreshBlock(FileHandle* f) {
 
-    int current_block_idx;
-    if (fdb->fcb.idx_in_directory <= max_entries_fdb)
-        current_block_idx = 0;
-    else 
-        current_block_idx = (fdb->fcb.idx_in_directory - max_entries_fdb) / max_entries_db;
+    if (f->current_block == &f->fcb->header || f->block_dirty ||
+            f->block_version == f->entry->data_version)
+        return 0;
 
-    if (current_block_idx == 0) {
-        fdb_parent->num_entries -= 1;
-        fdb_parent->file_blocks[fdb->fcb.idx_in_directory] = fdb_parent->file_blocks[fdb_parent->num_entries];
+    int ret = DiskDriver_readBlock(f->sfs->disk, &f->block_buf, f->current_block->block_in_disk);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - refreshBlock] Cannot read from disk.\n");
+        return -1;
     }
-    else { 
-        DirectoryBlock last_block, current_block;
-        ret = DiskDriver_readBlock(d->sfs->disk, &last_block, fdb_parent->header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot read from disk.\n");
+    f->block_version = f->entry->data_version;
+    return 0;
+}
+
+// position in the file of the first byte stored in the block block_in_file
+static int64_t SimpleFS_blockStart(int64_t block_in_file) {
+    if (block_in_file == 0)
+        return 0;
+    return max_data_ffb + (block_in_file - 1) * max_data_fb;
+}
+
+// number of blocks needed to store size bytes (at least the first one)
+static int64_t SimpleFS_blocksFor(int64_t size) {
+    if (size <= max_data_ffb)
+        return 1;
+    return 1 + (size - max_data_ffb + max_data_fb - 1) / max_data_fb;
+}
+
+// claims count contiguous blocks starting at first
+// on failure the ones already claimed are given back
+static int SimpleFS_claimRun(DiskDriver* disk, int64_t first, int count) {
+    int idx;
+    for (idx = 0; idx < count; idx++) {
+        if (DiskDriver_claimBlock(disk, first + idx) == -1) {
+            while (idx-- > 0)
+                DiskDriver_freeBlock(disk, first + idx);
             return -1;
         }
-        if (last_block.header.block_in_file == current_block_idx) 
-            current_block = last_block;
-        while (last_block.header.next_block != -1) {
-            ret = DiskDriver_readBlock(d->sfs->disk, &last_block, last_block.header.next_block);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - removeFile] Cannot read from disk.\n");
-                return -1;
-            }
-            if (last_block.header.block_in_file == current_block_idx) 
-                current_block = last_block;
-        }
-
-        fdb_parent->num_entries -= 1;
-        int idx_inside_last_block = (fdb_parent->num_entries - max_entries_fdb) % max_entries_db;
-        int idx_inside_current_block = (fdb->fcb.idx_in_directory - max_entries_fdb) % max_entries_db;
+    }
+    return 0;
+}
 
-        current_block.file_blocks[idx_inside_current_block] = last_block.file_blocks[idx_inside_last_block];
-        
-        ret = DiskDriver_writeBlock(d->sfs->disk, &last_block, last_block.header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot write on disk.\n");
-            return -1; 
+// fills blocks with count free blocks, preferring a contiguous run
+// starting after hint. The blocks are claimed for the caller, who must
+// free them if it doesn't use them. Returns -1 if there aren't enough free blocks
+static int SimpleFS_pickBlocks(DiskDriver* disk, int64_t hint, int count, int64_t* blocks) {
+
+    int idx;
+    int64_t start = hint;
+    int64_t first;
+    // a run found in the bitmap can be taken by another thread before it's claimed
+    while ((first = DiskDriver_getFreeRun(disk, start, count)) != -1 || start != 0) {
+        if (first == -1) {
+            start = 0;
+            continue;
         }
-        ret = DiskDriver_writeBlock(d->sfs->disk, &current_block, current_block.header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot write on disk.\n");
-            return -1; 
+        if (SimpleFS_claimRun(disk, first, count) == 0) {
+            for (idx = 0; idx < count; idx++)
+                blocks[idx] = first + idx;
+            return 0;
         }
-
+        start = first + 1;
     }
-    ret = DiskDriver_writeBlock(d->sfs->disk, fdb_parent, fdb_parent->header.block_in_disk);
-    if (ret == -1) {
-        if (DEBUG) printf("[SFS - removeFile] Cannot write on disk.\n");
-        return -1; 
+
+    int64_t block_num = hint;
+    for (idx = 0; idx < count; idx++) {
+        block_num = DiskDriver_allocBlock(disk, block_num);
+        if (block_num == -1) {
+            DiskDriver_freeBlocks(disk, blocks, idx);
+            return -1;
+        }
+        blocks[idx] = block_num;
+        block_num ++;
     }
+    return 0;
+}
+
+// adds count blocks at the end of the chain of the file, filled with
+// size bytes taken from data (NULL for zeroed blocks)
+// the cursor block of the handle must be the last one of the file
+static int SimpleFS_appendBlocks(FileHandle* f, int count, const char* data, int size) {
+
+    int ret, idx;
+    BlockHeader* last = f->current_block;
 
-    ret = DiskDriver_freeBlock(d->sfs->disk, fdb->header.block_in_disk);
+    int64_t* blocks = malloc(count * sizeof(int64_t));
+    ret = SimpleFS_pickBlocks(f->sfs->disk, last->block_in_disk + 1, count, blocks);
     if (ret == -1) {
-        if (DEBUG) printf("[SFS - removeFile] Cannot free block on disk.\n");
+        if (DEBUG) printf("[SFS - appendBlocks] No free block.\n");
+        free(blocks);
         return -1;
     }
-    if (fdb->header.next_block != -1) {
-        DirectoryBlock db = {0};
-        ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
+
+    for (idx = 0; idx < count; idx++) {
+        FileBlock new_block = {0};
+        new_block.header.previous_block = idx == 0 ? last->block_in_disk : blocks[idx - 1];
+        new_block.header.next_block = idx == count - 1 ? -1 : blocks[idx + 1];
+        new_block.header.block_in_file = last->block_in_file + 1 + idx;
+        new_block.header.block_in_disk = blocks[idx];
+
+        int data_offset = idx * max_data_fb;
+        if (data != NULL && data_offset < size) {
+            int chunk = size - data_offset < max_data_fb ? size - data_offset : max_data_fb;
+            memcpy(new_block.data, data + data_offset, chunk);
+        }
+
+        ret = DiskDriver_writeBlock(f->sfs->disk, &new_block, blocks[idx]);
         if (ret == -1) {
-            if (DEBUG) printf("[SFS - removeFile] Cannot read from disk.\n");
+            if (DEBUG) printf("[SFS - appendBlocks] Cannot write on disk.\n");
+            DiskDriver_freeBlocks(f->sfs->disk, blocks, count);
+            free(blocks);
             return -1;
         }
+    }
+    int64_t new_first = blocks[0];
 
-        return SimpleFS_removeDirBlock(d, &db); 
+    free(blocks);
+    f->fcb->fcb.size_in_blocks += count;
+    f->entry->dirty = 1;
+    if (last == &f->fcb->header) {
+        last->next_block = new_first;
+        return 0;
     }
-    return 0;
+
+    // links are written through, other handles follow them from disk
+    ret = SimpleFS_refreshBlock(f);
+    if (ret == -1)
+        return -1;
+    last->next_block = new_first;
+    f->block_dirty = 1;
+    return SimpleFS_flushBlock(f);
 }
 
+// moves the cursor block of the handle to the following block of the file
+// if there is none and append is set, a new block is added to the chain
+// the buffered block is flushed before being replaced
+static int SimpleFS_nextBlock(FileHandle* f, int append) {
 
+    int ret;
+    BlockHeader* current = f->current_block;
 
-DirectoryHandle* SimpleFS_init(SimpleFS* fs, DiskDriver* disk) {
+    // another handle may have grown the file after this block was read
+    if (current->next_block == -1 && current != &f->fcb->header &&
+            current->block_in_file + 1 < f->fcb->fcb.size_in_blocks) {
+        FileBlock fb;
+        ret = DiskDriver_readBlock(f->sfs->disk, &fb, current->block_in_disk);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - nextBlock] Cannot read from disk.\n");
+            return -1;
+        }
+        current->next_block = fb.header.next_block;
+    }
 
-    fs->disk = disk;
+    if (current->next_block == -1) {
+        if (!append)
+            return -1;
 
-    FirstDirectoryBlock* first_directory_block = calloc(1, sizeof(FirstDirectoryBlock));
-    int ret = DiskDriver_readBlock(disk, first_directory_block, 0);
-    if (ret == -1) {
-        if (DEBUG) printf("[SFS - init] Formatting disk.\n");
-        SimpleFS_format(fs);
-        int ret = DiskDriver_readBlock(disk, first_directory_block, 0);
+        ret = SimpleFS_appendBlocks(f, 1, NULL, 0);
         if (ret == -1)
-            return NULL;
+            return -1;
     }
 
-    DirectoryHandle* dh = malloc(sizeof(DirectoryHandle));
-    dh->sfs = fs;
-    dh->dcb = first_directory_block;
-    dh->directory = NULL;
-    dh->current_block = &first_directory_block->header;
-    dh->pos_in_dir = 0;
-    dh->pos_in_block = 0;
-
-    return dh;
-}
-
-void SimpleFS_format(SimpleFS* fs) {
-    
-    fs->disk->header->free_blocks = fs->disk->header->num_blocks;
-    fs->disk->header->first_free_block = 0;
-    bzero(fs->disk->bitmap_data, fs->disk->header->bitmap_entries);
-    
-    FirstDirectoryBlock first_directory_block = {0};
-
-    first_directory_block.header.previous_block = -1;
-    first_directory_block.header.next_block = -1;
-    first_directory_block.header.block_in_file = 0;
-    first_directory_block.header.block_in_disk = 0;
-
-    first_directory_block.fcb.directory_block = -1;
-    first_directory_block.fcb.size_in_bytes = BLOCK_SIZE; 
-    first_directory_block.fcb.size_in_blocks = 1;
-    first_directory_block.fcb.is_dir = 1;
-    strncpy(first_directory_block.fcb.name, "/", 128);
+    int64_t next_block = current->next_block;
+    ret = SimpleFS_flushBlock(f);
+    if (ret == -1)
+        return -1;
 
-    first_directory_block.num_entries = 0;
-    
-    int ret = DiskDriver_writeBlock(fs->disk, &first_directory_block, 0);
+    ret = DiskDriver_readBlock(f->sfs->disk, &f->block_buf, next_block);
     if (ret == -1) {
-        if (DEBUG) printf("[SFS - init] Unable to format disk.\n");
-        return;
+        if (DEBUG) printf("[SFS - nextBlock] Cannot read from disk.\n");
+        f->current_block = &f->fcb->header;
+        return -1;
     }
+    f->current_block = &f->block_buf.header;
+    f->block_version = f->entry->data_version;
+    return 0;
 }
 
-int SimpleFS_createFile(DirectoryHandle* d, const char* filename) {
+// moves the cursor block of the handle to the block block_in_file,
+// walking the chain from the closest of the first and the current block
+static int SimpleFS_gotoBlock(FileHandle* f, int64_t block_in_file) {
 
-    if (SimpleFS_exists(d, filename)) {
-        if (DEBUG) printf("[SFS - createFile] File already exists.\n");
+    int ret = SimpleFS_flushBlock(f);
+    if (ret == -1)
         return -1;
+
+    if (block_in_file == 0) {
+        f->current_block = &f->fcb->header;
+        return 0;
     }
 
-    FirstDirectoryBlock* fdb = d->dcb;
+    int64_t current = f->current_block->block_in_file;
+    if (current == block_in_file)
+        return 0;
 
-    int ret;
-    int free_block = DiskDriver_getFreeBlock(d->sfs->disk, 0);
-    if (free_block == -1) {
-        if (DEBUG) printf("[SFS - createFile] No free block.\n");
+    int64_t next_block;
+    if (current > block_in_file && current - block_in_file < block_in_file) {
+        while (f->current_block->block_in_file != block_in_file) {
+            next_block = f->current_block->previous_block;
+            ret = DiskDriver_readBlock(f->sfs->disk, &f->block_buf, next_block);
+            if (ret == -1)
+                break;
+        }
+        f->block_version = f->entry->data_version;
+    }
+    else {
+        if (current > block_in_file)
+            f->current_block = &f->fcb->header;
+        while (f->current_block->block_in_file != block_in_file) {
+            ret = SimpleFS_nextBlock(f, 0);
+            if (ret == -1)
+                break;
+        }
+    }
+
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - gotoBlock] Cannot walk the chain.\n");
+        f->current_block = &f->fcb->header;
         return -1;
     }
+    return 0;
+}
 
-    FirstFileBlock ffb = {0};
-    ffb.header.previous_block = -1;
-    ffb.header.next_block = -1;
-    ffb.header.block_in_file = 0;
-    ffb.header.block_in_disk = free_block;
+// copies size bytes of data in the blocks already in the chain,
+// starting from the cursor
+static int SimpleFS_writeChain(FileHandle* f, const char* data, int size) {
 
-    ffb.fcb.directory_block = fdb->header.block_in_disk;
-    ffb.fcb.size_in_bytes = 0;
-    ffb.fcb.size_in_blocks = 1;
-    ffb.fcb.is_dir = 0;
-    ffb.fcb.idx_in_directory = fdb->num_entries;
-    strncpy(ffb.fcb.name, filename, 128);
+    int ret;
+    int written = 0;
+    while (written < size) {
+        int64_t block_in_file = f->current_block->block_in_file;
+        int offset = (int) (f->pos_in_file - SimpleFS_blockStart(block_in_file));
+        int capacity = block_in_file == 0 ? max_data_ffb : max_data_fb;
+
+        if (offset == capacity) {
+            ret = SimpleFS_nextBlock(f, 1);
+            if (ret == -1)
+                return -1;
+            continue;
+        }
 
-    ret = DiskDriver_writeBlock(d->sfs->disk, &ffb, free_block);
-    if (ret == -1) {            
-        if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
-        return -1;
+        int chunk = capacity - offset;
+        if (chunk > size - written)
+            chunk = size - written;
+
+        if (block_in_file == 0) {
+            memcpy(f->fcb->data + offset, data + written, chunk);
+            f->entry->dirty = 1;
+        }
+        else {
+            ret = SimpleFS_refreshBlock(f);
+            if (ret == -1)
+                return -1;
+            memcpy(f->block_buf.data + offset, data + written, chunk);
+            f->block_dirty = 1;
+        }
+        written += chunk;
+        f->pos_in_file += chunk;
     }
 
-    if (fdb->num_entries < max_entries_fdb) {
-        fdb->file_blocks[fdb->num_entries] = free_block;
-        fdb->num_entries += 1;
-        
-        ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
-            return -1; 
+    if (f->pos_in_file > f->fcb->fcb.size_in_bytes) {
+        f->fcb->fcb.size_in_bytes = f->pos_in_file;
+        f->entry->dirty = 1;
+    }
+    return written;
+}
+
+// gives blocks to the data appended in write back mode and not yet
+// allocated. All the blocks are picked with a single search and each
+// one is written once, already filled
+static int SimpleFS_flushPending(FileHandle* f) {
+
+    if (f->pending_size == 0)
+        return 0;
+
+    int ret;
+    int64_t start = f->pending_start;
+    int size = f->pending_size;
+    f->pending_size = 0;
+
+    FirstFileBlock* ffb = f->fcb;
+    if (start == SimpleFS_blockStart(ffb->fcb.size_in_blocks)) {
+        ret = SimpleFS_gotoBlock(f, ffb->fcb.size_in_blocks - 1);
+        if (ret == -1)
+            return -1;
+        int count = (int) (SimpleFS_blocksFor(start + size) - ffb->fcb.size_in_blocks);
+        ret = SimpleFS_appendBlocks(f, count, f->pending, size);
+        if (ret == -1)
+            return -1;
+        f->pos_in_file = start + size;
+        if (f->pos_in_file > ffb->fcb.size_in_bytes)
+            ffb->fcb.size_in_bytes = f->pos_in_file;
+        f->entry->dirty = 1;
+        return SimpleFS_gotoBlock(f, SimpleFS_blocksFor(f->pos_in_file) - 1);
+    }
+
+    // the chain was changed by another handle, write the data in place
+    f->pos_in_file = start;
+    ret = SimpleFS_reserveLocked(f, start + size);
+    if (ret == -1)
+        return -1;
+    ret = SimpleFS_writeChain(f, f->pending, size);
+    return ret == -1 ? -1 : 0;
+}
+
+// keeps size bytes of data appended after the last block of the file
+// in the handle, flushing them when too many are pending
+static int SimpleFS_pendData(FileHandle* f, const char* data, int size) {
+
+    int needed = f->pending_size + size;
+    if (needed > f->pending_capacity) {
+        int capacity = f->pending_capacity ? f->pending_capacity : max_data_fb;
+        while (capacity < needed)
+            capacity *= 2;
+        char* pending = realloc(f->pending, capacity);
+        if (pending == NULL) {
+            if (DEBUG) printf("[SFS - pendData] Out of memory.\n");
+            return -1;
         }
+        f->pending = pending;
+        f->pending_capacity = capacity;
     }
-    else {
-        int entries = fdb->num_entries - max_entries_fdb;
-        if (entries == 0 || entries % max_entries_db == 0) {
-            int block_free_block = DiskDriver_getFreeBlock(d->sfs->disk, 0);
-            if (block_free_block == -1) {
-                if (DEBUG) printf("[SFS - createFile] No free block.\n");
-                return -1;
-            }
 
-            DirectoryBlock new_block = {0};
-            new_block.header.next_block = -1;
-            new_block.header.block_in_disk = block_free_block;
+    memcpy(f->pending + f->pending_size, data, size);
+    f->pending_size += size;
+    f->pos_in_file += size;
 
-            if (entries == 0) {
-                new_block.header.block_in_file = fdb->header.block_in_file + 1;
-                new_block.header.previous_block = fdb->header.block_in_disk;
-                new_block.file_blocks[0] = free_block;
-                fdb->header.next_block = block_free_block;
-            }
-            else {
-                DirectoryBlock last_block;
-                ret = DiskDriver_readBlock(d->sfs->disk, &last_block, fdb->header.next_block);
-                if (ret == -1) {
-                    if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
-                    return -1;
-                }
-                while (last_block.header.next_block != -1) {
-                    ret = DiskDriver_readBlock(d->sfs->disk, &last_block, last_block.header.next_block);
-                    if (ret == -1) {
-                        if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
-                        return -1;
-                    }
-                }
+    if (f->pending_size >= SFS_MAX_PENDING_BLOCKS * max_data_fb)
+        return SimpleFS_flushPending(f);
+    return 0;
+}
 
-                new_block.header.block_in_file = last_block.header.block_in_file + 1;
-                new_block.header.previous_block = last_block.header.block_in_disk;
-                new_block.file_blocks[0] = free_block;
-                last_block.header.next_block = block_free_block;
+// brings the handle back into the file after another handle
+// truncated it. Buffered data of released blocks is dropped
+static int SimpleFS_syncHandle(FileHandle* f) {
 
-                ret = DiskDriver_writeBlock(d->sfs->disk, &last_block, last_block.header.block_in_disk);
-                if (ret == -1) {
-                    if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
-                    return -1; 
-                }
-            }
-            ret = DiskDriver_writeBlock(d->sfs->disk, &new_block, new_block.header.block_in_disk);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
-                return -1; 
-            }
+    if (f->generation == f->entry->generation)
+        return 0;
+    f->generation = f->entry->generation;
+
+    int ret;
+    FirstFileBlock* ffb = f->fcb;
+    BlockHeader* current = f->current_block;
+    if (current != &ffb->header && f->block_dirty) {
+        if (current->block_in_file >= ffb->fcb.size_in_blocks) {
+            f->block_dirty = 0;
         }
         else {
-            DirectoryBlock db;
-            ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
+            FileBlock fb;
+            ret = DiskDriver_readBlock(f->sfs->disk, &fb, current->block_in_disk);
             if (ret == -1) {
-                if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
+                if (DEBUG) printf("[SFS - syncHandle] Cannot read from disk.\n");
                 return -1;
             }
-            while (db.header.next_block != -1) {
-                ret = DiskDriver_readBlock(d->sfs->disk, &db, db.header.next_block);
-                if (ret == -1) {
-                    if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
-                    return -1;
-                }
-            }
+            f->block_buf.header = fb.header;
 
-            db.file_blocks[entries % max_entries_db] = free_block;
-            ret = DiskDriver_writeBlock(d->sfs->disk, &db, db.header.block_in_disk);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
-                return -1; 
-            }
-        }
-        fdb->num_entries += 1;
-        fdb->fcb.size_in_bytes += BLOCK_SIZE;
-        fdb->fcb.size_in_blocks += 1;
+            int64_t end = ffb->fcb.size_in_bytes - SimpleFS_blockStart(current->block_in_file);
+            if (end < 0)
+                end = 0;
+            if (end < max_data_fb)
+                bzero(f->block_buf.data + end, max_data_fb - end);
 
-        ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
-            return -1; 
+            ret = SimpleFS_flushBlock(f);
+            if (ret == -1)
+                return -1;
         }
     }
-    return 0;
-}
-int SimpleFS_readDir(char** names, DirectoryHandle* d) {
- 
-    FirstDirectoryBlock* fdb = d->dcb;
-    int entries = fdb->num_entries;
-    int idx, ret;
 
-    for (idx = 0; idx < max_entries_fdb; idx++) {
-        if (idx >= entries)
-            return 0;
-        
-        FirstFileBlock ffb;
-        int block_num = fdb->file_blocks[idx];
-        ret = DiskDriver_readBlock(d->sfs->disk, &ffb, block_num);
-        if (ret == -1)
-            return -1;
+    f->block_dirty = 0;
+    f->current_block = &ffb->header;
+    if (f->pending_size > 0)
+        return SimpleFS_flushPending(f);
+    if (f->pos_in_file > ffb->fcb.size_in_bytes)
+        f->pos_in_file = ffb->fcb.size_in_bytes;
+    return SimpleFS_gotoBlock(f, SimpleFS_blocksFor(f->pos_in_file) - 1);
+}
 
-        names[idx] = strndup(ffb.fcb.name, 128);
-    }
+// drops a reference to the entry, writing it back and
+// releasing it when the last handle goes away
+static int SimpleFS_putOpenFile(SimpleFS* fs, OpenFileEntry* entry) {
 
-    entries -= idx;
-    DirectoryBlock db;
-    ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
-    if (ret == -1) {
-        if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
+    entry->refcount -= 1;
+    if (entry->refcount > 0)
         return 0;
+
+    int ret = SimpleFS_writeBackFcb(fs, entry);
+    SimpleFS_unlinkOpenFile(fs, entry);
+    pthread_rwlock_destroy(&entry->lock);
+    free(entry->fcb);
+    free(entry);
+
+    // the buckets go with the last file, SimpleFS_init can run again
+    fs->num_open -= 1;
+    if (fs->num_open == 0) {
+        free(fs->open_files);
+        fs->open_files = NULL;
+        fs->open_buckets = 0;
     }
-    for (idx = 0; idx < max_entries_db; idx++) {
-        if (idx >= entries)
-            return 0;
+    return ret;
+}
 
-        FirstFileBlock ffb;
-        int block_num = db.file_blocks[idx];
-        ret = DiskDriver_readBlock(d->sfs->disk, &ffb, block_num);
-        if (ret == -1)
-            return -1;
-        
-        int names_idx = max_entries_fdb + idx + max_entries_db * (db.header.block_in_file - 1); 
-        names[names_idx] = strndup(ffb.fcb.name, 128); 
+#define SFS_FREE_BATCH 1024  // blocks released with a single DiskDriver_freeBlocks
+#define SFS_ALLOC_BATCH 65536  // most blocks appended at once by SimpleFS_reserve
+
+// a growable list of block numbers
+typedef struct {
+    int64_t* blocks;
+    int num;
+    int capacity;
+} BlockList;
+
+static void BlockList_push(BlockList* list, int64_t block_num) {
+    if (list->num == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->blocks = realloc(list->blocks, list->capacity * sizeof(int64_t));
     }
-    entries -= idx;
-    while (db.header.next_block != -1) {
-        ret = DiskDriver_readBlock(d->sfs->disk, &db, db.header.next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
-            return 0;
-        }
-        for (idx = 0; idx < max_entries_db; idx++) {
-            if (idx >= entries)
-                return 0;
+    list->blocks[list->num++] = block_num;
+}
 
-            FirstFileBlock ffb;
-            int block_num = db.file_blocks[idx];
-            ret = DiskDriver_readBlock(d->sfs->disk, &ffb, block_num);
-            if (ret == -1)
-                return -1;
+// releases the blocks of list once it holds a batch, or always if force
+static int BlockList_release(DiskDriver* disk, BlockList* list, int force) {
+    if (list->num == 0 || (!force && list->num < SFS_FREE_BATCH))
+        return 0;
+    int ret = DiskDriver_freeBlocks(disk, list->blocks, list->num);
+    list->num = 0;
+    return ret;
+}
 
-            int names_idx = max_entries_fdb + idx + max_entries_db * (db.header.block_in_file - 1); 
-            names[names_idx] = strndup(ffb.fcb.name, 128); 
+// adds to freed every block of the chain starting at first_block,
+// releasing them in batches
+static int SimpleFS_freeChain(SimpleFS* fs, int64_t first_block, BlockList* freed) {
+
+    FileBlock fb;
+    int64_t block_num = first_block;
+    while (block_num != -1) {
+        int ret = DiskDriver_readBlock(fs->disk, &fb, block_num);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - freeChain] Cannot read from disk.\n");
+            return -1;
         }
-        entries -= idx;
+        BlockList_push(freed, block_num);
+        if (BlockList_release(fs->disk, freed, 0) == -1)
+            return -1;
+        block_num = fb.header.next_block;
     }
     return 0;
 }
 
-int SimpleFS_closeDir(DirectoryHandle* d) {
-    if (d->directory != NULL)
-        free(d->directory);
-    free(d->dcb);
-    free(d);
-    return 0;
-}
+// returns the slot holding the entry idx of the directory fdb, reading
+// in db the directory block containing it if it isn't fdb. NULL on error
+static int64_t* SimpleFS_entrySlot(SimpleFS* fs, FirstDirectoryBlock* fdb, int idx, DirectoryBlock* db) {
 
-FileHandle* SimpleFS_openFile(DirectoryHandle* d, const char* filename) {
+    if (idx < max_entries_fdb)
+        return &fdb->file_blocks[idx];
 
-    int block_num = SimpleFS_exists(d, filename);
-    if (block_num == 0) {
-        if (DEBUG) printf("[SFS - openFile] File doesn't exists.\n");
-        return NULL;
+    int block_in_file = 1 + (idx - max_entries_fdb) / max_entries_db;
+    int64_t block_num = fdb->header.next_block;
+    while (block_num != -1) {
+        int ret = DiskDriver_readBlock(fs->disk, db, block_num);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - entrySlot] Cannot read from disk.\n");
+            return NULL;
+        }
+        if (db->header.block_in_file == block_in_file)
+            return &db->file_blocks[(idx - max_entries_fdb) % max_entries_db];
+        block_num = db->header.next_block;
     }
+    return NULL;
+}
 
-    FirstFileBlock* ffb = calloc(1, sizeof(FirstFileBlock));
-    int ret = DiskDriver_readBlock(d->sfs->disk, ffb, block_num);
-    if (ret == -1) {
-        if (DEBUG) printf("[SFS - openFile] Cannot read from disk.\n");
-        free(ffb);
-        return NULL;
-    }
+// returns the index of the entry block_num in the directory fdb, trying
+// hint first (the idx_in_directory of the entry), -1 if it isn't there
+static int SimpleFS_entryIndex(SimpleFS* fs, FirstDirectoryBlock* fdb, int64_t block_num, int hint) {
 
-    if (ffb->fcb.is_dir == 1) {
-        if (DEBUG) printf("[SFS - openFile] Cannot open a directory.\n");
-        free(ffb);
-        return NULL;
+    DirectoryBlock db;
+    if (hint >= 0 && hint < fdb->num_entries) {
+        int64_t* slot = SimpleFS_entrySlot(fs, fdb, hint, &db);
+        if (slot != NULL && *slot == block_num)
+            return hint;
     }
 
-    FileHandle* new_fh = calloc(1, sizeof(FileHandle));
-    new_fh->sfs = d->sfs;
-    new_fh->fcb = ffb;
-    new_fh->directory = d->dcb;
-    new_fh->current_block = &ffb->header;
-    new_fh->pos_in_file = 0;
+    int idx = 0;
+    int in_block = fdb->num_entries < max_entries_fdb ? fdb->num_entries : max_entries_fdb;
+    int64_t* file_blocks = fdb->file_blocks;
+    int64_t next_block = fdb->header.next_block;
+    while (1) {
+        int pos;
+        for (pos = 0; pos < in_block; pos++) {
+            if (file_blocks[pos] == block_num)
+                return idx + pos;
+        }
+        idx += in_block;
+        if (idx >= fdb->num_entries || next_block == -1)
+            return -1;
 
-    return new_fh;
+        int ret = DiskDriver_readBlock(fs->disk, &db, next_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - entryIndex] Cannot read from disk.\n");
+            return -1;
+        }
+        file_blocks = db.file_blocks;
+        next_block = db.header.next_block;
+        in_block = fdb->num_entries - idx < max_entries_db ? fdb->num_entries - idx : max_entries_db;
+    }
 }
 
-int SimpleFS_closeFile(FileHandle* f) {
+// stores idx as the position in its directory of the entry block_num.
+// If the file is open its handles own the first block: the shared copy is
+// changed under the lock of the file and written back from there, a copy
+// read from disk could be overwritten by theirs or overwrite their data.
+// The copy of a packed file is never written back, its slot is changed.
+// table_lock is held throughout, so the file can't be opened meanwhile
+static int SimpleFS_setEntryIndex(SimpleFS* fs, int64_t block_num, int idx) {
 
-    if (f->current_block != (BlockHeader*) f->fcb) 
-        free(f->current_block);
-    free(f->fcb);
-    free(f);
-    return 0;
+    int ret;
+    pthread_mutex_lock(&fs->table_lock);
+    OpenFileEntry* entry = SimpleFS_findOpenFile(fs, block_num);
+    if (PACK_IS_REF(block_num)) {
+        if (entry != NULL) {
+            pthread_rwlock_wrlock(&entry->lock);
+            entry->fcb->fcb.idx_in_directory = idx;
+            pthread_rwlock_unlock(&entry->lock);
+        }
+        ret = Pack_setIndex(fs->disk, block_num, idx);
+        pthread_mutex_unlock(&fs->table_lock);
+        if (ret == -1)
+            if (DEBUG) printf("[SFS - setEntryIndex] Cannot access the disk.\n");
+        return ret;
+    }
+    if (entry != NULL) {
+        pthread_rwlock_wrlock(&entry->lock);
+        entry->fcb->fcb.idx_in_directory = idx;
+        entry->dirty = 1;
+        ret = SimpleFS_writeBackFcb(fs, entry);
+        pthread_rwlock_unlock(&entry->lock);
+        pthread_mutex_unlock(&fs->table_lock);
+        return ret;
+    }
+
+    FirstFileBlock ffb;
+    ret = DiskDriver_readBlock(fs->disk, &ffb, block_num);
+    if (ret == 0) {
+        ffb.fcb.idx_in_directory = idx;
+        ret = DiskDriver_writeBlock(fs->disk, &ffb, block_num);
+    }
+    pthread_mutex_unlock(&fs->table_lock);
+    if (ret == -1)
+        if (DEBUG) printf("[SFS - setEntryIndex] Cannot access the disk.\n");
+    return ret;
 }
 
-int SimpleFS_write(FileHandle* f, void* data, int size) {
+// removes the entry idx from the directory of d, moving the last entry
+// in its place, and releases the last directory block if it becomes empty.
+// The caller holds the write lock of the directory
+static int SimpleFS_removeEntry(DirectoryHandle* d, int idx) {
 
-    int free_space, ret;
+    SimpleFS* fs = d->sfs;
+    FirstDirectoryBlock* fdb = d->dcb;
+    int last = fdb->num_entries - 1;
+    int ret;
 
-    if (f->current_block->block_in_file == 0)
-        free_space = max_data_ffb - f->pos_in_file;
-    else 
-        free_space = max_data_fb - ((f->pos_in_file - max_data_ffb) % max_data_fb);
+    DirectoryBlock slot_db, last_db;
+    int64_t* slot = SimpleFS_entrySlot(fs, fdb, idx, &slot_db);
+    int64_t* last_slot = SimpleFS_entrySlot(fs, fdb, last, &last_db);
+    if (slot == NULL || last_slot == NULL)
+        return -1;
 
-    if (size <= free_space) {
-        if (f->current_block->block_in_file == 0) {
-            memcpy(f->fcb->data + f->pos_in_file, data, size);
-        } 
-        else {
-            memcpy(((FileBlock*) f->current_block)->data + (max_data_fb - free_space), data, size);
-            ret = DiskDriver_writeBlock(f->sfs->disk, f->current_block, f->current_block->block_in_disk);
+    if (idx != last) {
+        int64_t moved = *last_slot;
+        *slot = moved;
+        if (idx >= max_entries_fdb) {
+            ret = DiskDriver_writeBlock(fs->disk, &slot_db, slot_db.header.block_in_disk);
             if (ret == -1) {
-                if (DEBUG) printf("[SFS - write] Cannot write on disk.\n");
-                return -1; 
+                if (DEBUG) printf("[SFS - removeEntry] Cannot write on disk.\n");
+                return -1;
             }
         }
-        f->pos_in_file += size;
-        f->fcb->fcb.size_in_bytes += size;
-
-        ret = DiskDriver_writeBlock(f->sfs->disk, f->fcb, f->fcb->header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - write] Cannot write on disk.\n");
-            return -1; 
-        }
+        if (SimpleFS_setEntryIndex(fs, moved, idx) == -1)
+            return -1;
+    }
 
-        return size;
+    fdb->num_entries -= 1;
+    if (last >= max_entries_fdb) {
+        fdb->fcb.size_in_bytes -= BLOCK_SIZE;
+        fdb->fcb.size_in_blocks -= 1;
     }
-    else if (f->current_block->next_block != -1) {
-        if (f->current_block->block_in_file == 0) {
-            memcpy(f->fcb->data + f->pos_in_file, data, free_space);
-        } 
+
+    // the entry was the only one in the last directory block
+    if (last >= max_entries_fdb && (last - max_entries_fdb) % max_entries_db == 0) {
+        int64_t previous = last_db.header.previous_block;
+        if (previous == fdb->header.block_in_disk) {
+            fdb->header.next_block = -1;
+        }
         else {
-            memcpy(((FileBlock*) f->current_block)->data + (max_data_fb - free_space), data, free_space);
-            ret = DiskDriver_writeBlock(f->sfs->disk, (FileBlock*) f->current_block, f->current_block->block_in_disk);
+            DirectoryBlock db;
+            ret = DiskDriver_readBlock(fs->disk, &db, previous);
+            if (ret == 0) {
+                db.header.next_block = -1;
+                ret = DiskDriver_writeBlock(fs->disk, &db, previous);
+            }
             if (ret == -1) {
-                if (DEBUG) printf("[SFS - write] Cannot write on disk.\n");
-                return -1; 
+                if (DEBUG) printf("[SFS - removeEntry] Cannot access the disk.\n");
+                return -1;
             }
         }
+        DiskDriver_freeBlock(fs->disk, last_db.header.block_in_disk);
+    }
 
-        f->pos_in_file += free_space;
-        f->fcb->fcb.size_in_bytes += free_space;
-        f->fcb->fcb.size_in_blocks += 1;
+    ret = DiskDriver_writeBlock(fs->disk, fdb, fdb->header.block_in_disk);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - removeEntry] Cannot write on disk.\n");
+        return -1;
+    }
+    return 0;
+}
 
-        FileBlock* next = calloc(1, sizeof(FileBlock));
-        ret = DiskDriver_readBlock(f->sfs->disk, next, f->current_block->next_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - write] Cannot read from disk.\n");
-            return -1; 
-        }
+// lists the entries of the directory dir_block in entries
+static int SimpleFS_listEntries(SimpleFS* fs, int64_t dir_block, BlockList* entries) {
 
-        if (f->current_block != (BlockHeader*) f->fcb)
-            free(f->current_block);
+    FirstDirectoryBlock fdb;
+    int ret = DiskDriver_readBlock(fs->disk, &fdb, dir_block);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - listEntries] Cannot read from disk.\n");
+        return -1;
+    }
 
-        f->current_block = &next->header;
-        int written = SimpleFS_write(f, data + free_space, size - free_space);
-        if (written == -1) 
+    if (fdb.fcb.is_dir == SFS_DIR_TREE) {
+        DirTreeCursor cursor;
+        int64_t block_num;
+        if (DirTree_seek(fs->disk, &fdb, "", &cursor) == -1)
             return -1;
-        return free_space + written;
+        while ((block_num = DirTree_next(fs->disk, &cursor, NULL)) != -1)
+            BlockList_push(entries, block_num);
+        return 0;
     }
-    else {
-        int free_block = DiskDriver_getFreeBlock(f->sfs->disk, 0);
-        if (free_block == -1) {
-            if (DEBUG) printf("[SFS - write] No free block.\n");
+
+    int idx;
+    int remaining = fdb.num_entries;
+    int in_block = remaining < max_entries_fdb ? remaining : max_entries_fdb;
+    for (idx = 0; idx < in_block; idx++)
+        BlockList_push(entries, fdb.file_blocks[idx]);
+    remaining -= in_block;
+
+    DirectoryBlock db;
+    int64_t next_block = fdb.header.next_block;
+    while (remaining > 0 && next_block != -1) {
+        ret = DiskDriver_readBlock(fs->disk, &db, next_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - listEntries] Cannot read from disk.\n");
             return -1;
         }
+        in_block = remaining < max_entries_db ? remaining : max_entries_db;
+        for (idx = 0; idx < in_block; idx++)
+            BlockList_push(entries, db.file_blocks[idx]);
+        remaining -= in_block;
+        next_block = db.header.next_block;
+    }
+    return 0;
+}
+
+// sorts the subtree starting at first_block in dirs and files, breadth first
+// without recursion. Only first_block is visited if recursive isn't set
+static int SimpleFS_collectTree(SimpleFS* fs, int64_t first_block, int recursive,
+                                BlockList* dirs, BlockList* files) {
+
+    FirstFileBlock ffb;
+    int ret = Pack_readEntry(fs->disk, &ffb, first_block);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - collectTree] Cannot read from disk.\n");
+        return -1;
+    }
+    if (ffb.fcb.is_dir == 0) {
+        BlockList_push(files, first_block);
+        return 0;
+    }
+    BlockList_push(dirs, first_block);
+    if (!recursive)
+        return 0;
+
+    BlockList entries = {0};
+    int next_dir, idx;
+    for (next_dir = 0; next_dir < dirs->num; next_dir++) {
+        entries.num = 0;
+        ret = SimpleFS_listEntries(fs, dirs->blocks[next_dir], &entries);
+        for (idx = 0; ret == 0 && idx < entries.num; idx++) {
+            ret = Pack_readEntry(fs->disk, &ffb, entries.blocks[idx]);
+            if (ret == 0)
+                BlockList_push(ffb.fcb.is_dir ? dirs : files, entries.blocks[idx]);
+        }
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - collectTree] Cannot read the tree.\n");
+            break;
+        }
+    }
+    free(entries.blocks);
+    return ret;
+}
+
+// returns the last entry of the directory fdb if it is a directory, -1 otherwise
+// (or if entries of fdb don't move, in a tree directory)
+static int64_t SimpleFS_lastEntry(SimpleFS* fs, FirstDirectoryBlock* fdb) {
+
+    if (fdb->num_entries == 0 || fdb->fcb.is_dir == SFS_DIR_TREE)
+        return -1;
+
+    DirectoryBlock db;
+    FirstFileBlock ffb;
+    int64_t* slot = SimpleFS_entrySlot(fs, fdb, fdb->num_entries - 1, &db);
+    if (slot == NULL || Pack_readEntry(fs->disk, &ffb, *slot) == -1)
+        return -1;
+    return ffb.fcb.is_dir ? *slot : -1;
+}
+
+// write locks the directory slots flagged in slots, by increasing index:
+// every operation holding more than one directory lock takes them this way
+static void SimpleFS_lockDirs(SimpleFS* fs, const char* slots) {
+    int idx;
+    for (idx = 0; idx < SFS_DIR_LOCKS; idx++) {
+        if (slots[idx])
+            pthread_rwlock_wrlock(&fs->dir_locks[idx]);
+    }
+}
+
+static void SimpleFS_unlockDirs(SimpleFS* fs, const char* slots) {
+    int idx;
+    for (idx = 0; idx < SFS_DIR_LOCKS; idx++) {
+        if (slots[idx])
+            pthread_rwlock_unlock(&fs->dir_locks[idx]);
+    }
+}
+
+// removes filename, starting at first_block, from the directory of d and
+// frees the files and directories listed in files and dirs. The caller
+// holds the write locks of d and of all the directories listed
+static int SimpleFS_destroyTree(DirectoryHandle* d, const char* filename, int64_t first_block,
+                                int recursive, BlockList* dirs, BlockList* files) {
+
+    SimpleFS* fs = d->sfs;
+    int ret = 0;
+    int idx;
+
+    FirstDirectoryBlock fdb;
+    if (!recursive && dirs->num == 1 &&
+            (DiskDriver_readBlock(fs->disk, &fdb, first_block) == -1 || fdb.num_entries > 0)) {
+        if (DEBUG) printf("[SFS - remove] Directory is not empty.\n");
+        return -1;
+    }
+
+    // files below locked directories can't be opened meanwhile
+    pthread_mutex_lock(&fs->table_lock);
+    for (idx = 0; idx < files->num && ret == 0; idx++) {
+        if (SimpleFS_findOpenFile(fs, files->blocks[idx]) != NULL)
+            ret = -1;
+    }
+    pthread_mutex_unlock(&fs->table_lock);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - remove] File is open.\n");
+        return -1;
+    }
+
+    FirstFileBlock ffb;
+    ret = Pack_readEntry(fs->disk, &ffb, first_block);
+    if (ret == 0 && d->dcb->fcb.is_dir == SFS_DIR_TREE) {
+        ret = DirTree_remove(fs->disk, d->dcb, filename) == first_block ? 0 : -1;
+        if (ret == 0)
+            ret = DiskDriver_writeBlock(fs->disk, d->dcb, d->dcb->header.block_in_disk);
+    }
+    else if (ret == 0) {
+        idx = SimpleFS_entryIndex(fs, d->dcb, first_block, ffb.fcb.idx_in_directory);
+        ret = idx == -1 ? -1 : SimpleFS_removeEntry(d, idx);
+    }
+    if (ret == -1)
+        return -1;
+    DentryCache_invalidate(&fs->dcache, d->dcb->header.block_in_disk, filename);
+
+    BlockList freed = {0};
+    for (idx = 0; idx < files->num && ret == 0; idx++) {
+        if (PACK_IS_REF(files->blocks[idx]))
+            ret = Pack_remove(fs->disk, files->blocks[idx]);
+        else
+            ret = SimpleFS_freeChain(fs, files->blocks[idx], &freed);
+    }
+    for (idx = 0; idx < dirs->num && ret == 0; idx++) {
+        ret = DiskDriver_readBlock(fs->disk, &fdb, dirs->blocks[idx]);
+        if (ret == 0 && fdb.fcb.is_dir == SFS_DIR_TREE)
+            ret = DirTree_destroy(fs->disk, &fdb);
+        if (ret == 0)
+            ret = SimpleFS_freeChain(fs, dirs->blocks[idx], &freed);
+        DentryCache_purgeDir(&fs->dcache, dirs->blocks[idx]);
+    }
+    if (BlockList_release(fs->disk, &freed, 1) == -1)
+        ret = -1;
+    free(freed.blocks);
+    if (ret == -1)
+        if (DEBUG) printf("[SFS - remove] Cannot free blocks on disk.\n");
+    return ret;
+}
+
+// removes filename from the directory of d together with everything below
+// it; a directory must be empty unless recursive is set. All the directories
+// involved are locked for the whole removal, the parent is written once and
+// the blocks are released in batches
+static int SimpleFS_removeEntries(DirectoryHandle* d, const char* filename, int recursive) {
+
+    SimpleFS* fs = d->sfs;
+    char slots[SFS_DIR_LOCKS] = {0};
+    char locked[SFS_DIR_LOCKS];
+    BlockList dirs = {0}, files = {0};
+    int ret, idx;
+    slots[d->dcb->header.block_in_disk % SFS_DIR_LOCKS] = 1;
+
+    // the directories below filename are only known once it is read,
+    // retry until the locks taken cover all of them
+    while (1) {
+        memcpy(locked, slots, sizeof(slots));
+        SimpleFS_lockDirs(fs, locked);
+
+        ret = SimpleFS_reloadDir(d);
+        int64_t first_block = ret == 0 ? SimpleFS_exists(d, filename) : 0;
+        if (first_block == 0) {
+            if (DEBUG) printf("[SFS - remove] File/Dir doesn't exists.\n");
+            ret = -1;
+            break;
+        }
+
+        dirs.num = files.num = 0;
+        ret = SimpleFS_collectTree(fs, first_block, recursive, &dirs, &files);
+        if (ret == -1)
+            break;
+
+        // the last entry takes the place of the removed one, a directory
+        // rewrites its first block under its own lock
+        int64_t moved = SimpleFS_lastEntry(fs, d->dcb);
+        if (moved != -1)
+            BlockList_push(&dirs, moved);
+
+        int missing = 0;
+        for (idx = 0; idx < dirs.num; idx++) {
+            if (!slots[dirs.blocks[idx] % SFS_DIR_LOCKS]) {
+                slots[dirs.blocks[idx] % SFS_DIR_LOCKS] = 1;
+                missing = 1;
+            }
+        }
+        if (moved != -1)
+            dirs.num -= 1;
+        if (!missing) {
+            ret = SimpleFS_destroyTree(d, filename, first_block, recursive, &dirs, &files);
+            break;
+        }
+        SimpleFS_unlockDirs(fs, locked);
+    }
+
+    SimpleFS_unlockDirs(fs, locked);
+    free(dirs.blocks);
+    free(files.blocks);
+    return ret;
+}
+
+
+
+DirectoryHandle* SimpleFS_init(SimpleFS* fs, DiskDriver* disk) {
+    STATS_TIME(STATS_SFS_INIT);
+
+    fs->disk = disk;
+    DentryCache_init(&fs->dcache);
+    fs->open_files = NULL;
+    fs->open_buckets = 0;
+    fs->num_open = 0;
+
+    int idx;
+    pthread_mutex_init(&fs->table_lock, NULL);
+    for (idx = 0; idx < SFS_DIR_LOCKS; idx++)
+        pthread_rwlock_init(&fs->dir_locks[idx], NULL);
+
+    FirstDirectoryBlock* first_directory_block = calloc(1, sizeof(FirstDirectoryBlock));
+    int ret = DiskDriver_readBlock(disk, first_directory_block, 0);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - init] Formatting disk.\n");
+        SimpleFS_format(fs);
+        int ret = DiskDriver_readBlock(disk, first_directory_block, 0);
+        if (ret == -1)
+            return NULL;
+    }
+
+    DirectoryHandle* dh = calloc(1, sizeof(DirectoryHandle));
+    dh->sfs = fs;
+    dh->dcb = first_directory_block;
+    dh->directory = NULL;
+    dh->current_block = &first_directory_block->header;
+    dh->pos_in_dir = 0;
+    dh->pos_in_block = 0;
+
+    return dh;
+}
+
+void SimpleFS_format(SimpleFS* fs) {
+    STATS_TIME(STATS_SFS_FORMAT);
+    
+    DiskDriver_clear(fs->disk);
+    DentryCache_clear(&fs->dcache);
+    
+    FirstDirectoryBlock first_directory_block = {0};
+
+    first_directory_block.header.previous_block = -1;
+    first_directory_block.header.next_block = -1;
+    first_directory_block.header.block_in_file = 0;
+    first_directory_block.header.block_in_disk = 0;
+
+    first_directory_block.fcb.directory_block = -1;
+    first_directory_block.fcb.size_in_bytes = BLOCK_SIZE; 
+    first_directory_block.fcb.size_in_blocks = 1;
+    first_directory_block.fcb.is_dir = 1;
+    strncpy(first_directory_block.fcb.name, "/", 128);
+
+    first_directory_block.num_entries = 0;
+    
+    int ret = DiskDriver_writeBlock(fs->disk, &first_directory_block, 0);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - init] Unable to format disk.\n");
+        return;
+    }
+}
+
+// adds the entry name, whose first block block_num is already on disk,
+// to the directory of d and writes its first block. The caller holds its lock
+static int SimpleFS_addEntry(DirectoryHandle* d, const char* name, int64_t block_num) {
+
+    FirstDirectoryBlock* fdb = d->dcb;
+    int ret;
+
+    if (fdb->fcb.is_dir == SFS_DIR_TREE) {
+        ret = DirTree_insert(d->sfs->disk, fdb, name, block_num);
+        if (ret == 0)
+            ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
+        if (ret == -1)
+            if (DEBUG) printf("[SFS - addEntry] Cannot add the entry.\n");
+        return ret;
+    }
+
+    if (fdb->num_entries < max_entries_fdb) {
+        fdb->file_blocks[fdb->num_entries] = block_num;
+        fdb->num_entries += 1;
+        
+        ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - addEntry] Cannot write on disk.\n");
+            return -1; 
+        }
+    }
+    else {
+        int entries = fdb->num_entries - max_entries_fdb;
+        if (entries == 0 || entries % max_entries_db == 0) {
+            int64_t block_free_block = DiskDriver_allocBlock(d->sfs->disk, 0);
+            if (block_free_block == -1) {
+                if (DEBUG) printf("[SFS - addEntry] No free block.\n");
+                return -1;
+            }
+
+            DirectoryBlock new_block = {0};
+            new_block.header.next_block = -1;
+            new_block.header.block_in_disk = block_free_block;
+
+            if (entries == 0) {
+                new_block.header.block_in_file = fdb->header.block_in_file + 1;
+                new_block.header.previous_block = fdb->header.block_in_disk;
+                new_block.file_blocks[0] = block_num;
+                fdb->header.next_block = block_free_block;
+            }
+            else {
+                DirectoryBlock last_block;
+                ret = DiskDriver_readBlock(d->sfs->disk, &last_block, fdb->header.next_block);
+                if (ret == -1) {
+                    if (DEBUG) printf("[SFS - addEntry] Cannot read from disk.\n");
+                    return -1;
+                }
+                while (last_block.header.next_block != -1) {
+                    ret = DiskDriver_readBlock(d->sfs->disk, &last_block, last_block.header.next_block);
+                    if (ret == -1) {
+                        if (DEBUG) printf("[SFS - addEntry] Cannot read from disk.\n");
+                        return -1;
+                    }
+                }
+
+                new_block.header.block_in_file = last_block.header.block_in_file + 1;
+                new_block.header.previous_block = last_block.header.block_in_disk;
+                new_block.file_blocks[0] = block_num;
+                last_block.header.next_block = block_free_block;
+
+                ret = DiskDriver_writeBlock(d->sfs->disk, &last_block, last_block.header.block_in_disk);
+                if (ret == -1) {
+                    if (DEBUG) printf("[SFS - addEntry] Cannot write on disk.\n");
+                    return -1; 
+                }
+            }
+            ret = DiskDriver_writeBlock(d->sfs->disk, &new_block, new_block.header.block_in_disk);
+            if (ret == -1) {
+                if (DEBUG) printf("[SFS - addEntry] Cannot write on disk.\n");
+                return -1; 
+            }
+        }
+        else {
+            DirectoryBlock db;
+            ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
+            if (ret == -1) {
+                if (DEBUG) printf("[SFS - addEntry] Cannot read from disk.\n");
+                return -1;
+            }
+            while (db.header.next_block != -1) {
+                ret = DiskDriver_readBlock(d->sfs->disk, &db, db.header.next_block);
+                if (ret == -1) {
+                    if (DEBUG) printf("[SFS - addEntry] Cannot read from disk.\n");
+                    return -1;
+                }
+            }
+
+            db.file_blocks[entries % max_entries_db] = block_num;
+            ret = DiskDriver_writeBlock(d->sfs->disk, &db, db.header.block_in_disk);
+            if (ret == -1) {
+                if (DEBUG) printf("[SFS - addEntry] Cannot write on disk.\n");
+                return -1; 
+            }
+        }
+        fdb->num_entries += 1;
+        fdb->fcb.size_in_bytes += BLOCK_SIZE;
+        fdb->fcb.size_in_blocks += 1;
+
+        ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - addEntry] Cannot write on disk.\n");
+            return -1; 
+        }
+    }
+    return 0;
+}
+
+static int SimpleFS_createFileLocked(DirectoryHandle* d, const char* filename) {
+
+    if (SimpleFS_exists(d, filename)) {
+        if (DEBUG) printf("[SFS - createFile] File already exists.\n");
+        return -1;
+    }
+
+    FirstDirectoryBlock* fdb = d->dcb;
+
+    int ret;
+    int64_t free_block = DiskDriver_allocBlock(d->sfs->disk, 0);
+    if (free_block == -1) {
+        if (DEBUG) printf("[SFS - createFile] No free block.\n");
+        return -1;
+    }
+
+    FirstFileBlock ffb = {0};
+    ffb.header.previous_block = -1;
+    ffb.header.next_block = -1;
+    ffb.header.block_in_file = 0;
+    ffb.header.block_in_disk = free_block;
+
+    ffb.fcb.directory_block = fdb->header.block_in_disk;
+    ffb.fcb.size_in_bytes = 0;
+    ffb.fcb.size_in_blocks = 1;
+    ffb.fcb.is_dir = 0;
+    ffb.fcb.idx_in_directory = fdb->fcb.is_dir == SFS_DIR_TREE ? -1 : fdb->num_entries;
+    strncpy(ffb.fcb.name, filename, 128);
+
+    ret = DiskDriver_writeBlock(d->sfs->disk, &ffb, free_block);
+    if (ret == -1) {            
+        if (DEBUG) printf("[SFS - createFile] Cannot write on disk.\n");
+        return -1;
+    }
+
+    if (SimpleFS_addEntry(d, filename, free_block) == -1) {
+        DiskDriver_freeBlock(d->sfs->disk, free_block);
+        return -1;
+    }
+
+    DentryCache_insert(&d->sfs->dcache, fdb->header.block_in_disk, filename, free_block, 0);
+    return 0;
+}
+int SimpleFS_createFile(DirectoryHandle* d, const char* filename) {
+    STATS_TIME(STATS_SFS_CREATE_FILE);
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_wrlock(lock);
+    int ret = SimpleFS_reloadDir(d);
+    if (ret == 0)
+        ret = SimpleFS_createFileLocked(d, filename);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+// open addressing set of the names of a batch, by their index in names
+typedef struct {
+    const char** names;
+    int* slots;                      // index of the name + 1, 0 if empty
+    int size;                        // a power of two, more than twice the names
+} NameSet;
+
+static unsigned int NameSet_hash(const char* name) {
+    unsigned int hash = 2166136261u;
+    int idx;
+    for (idx = 0; idx < 128 && name[idx]; idx++) {
+        hash ^= (unsigned char) name[idx];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// returns the slot of name in set, empty if it isn't there
+static int* NameSet_slot(NameSet* set, const char* name) {
+    unsigned int pos = NameSet_hash(name) & (set->size - 1);
+    while (set->slots[pos] && strncmp(set->names[set->slots[pos] - 1], name, 128) != 0)
+        pos = (pos + 1) & (set->size - 1);
+    return &set->slots[pos];
+}
+
+// fills set with the n names, -1 if a name is repeated
+static int NameSet_init(NameSet* set, const char** names, int n) {
+    set->names = names;
+    set->size = 16;
+    while (set->size < 2 * n)
+        set->size *= 2;
+    set->slots = calloc(set->size, sizeof(int));
+
+    int idx;
+    for (idx = 0; idx < n; idx++) {
+        int* slot = NameSet_slot(set, names[idx]);
+        if (*slot)
+            return -1;
+        *slot = idx + 1;
+    }
+    return 0;
+}
+
+// returns 1 if an entry of the directory fdb is called like a name in set,
+// -1 on error. A list directory is read once, a tree one is searched by name
+static int SimpleFS_anyExists(SimpleFS* fs, FirstDirectoryBlock* fdb, NameSet* set, int n) {
+
+    int idx;
+    if (fdb->fcb.is_dir == SFS_DIR_TREE) {
+        for (idx = 0; idx < n; idx++) {
+            if (DirTree_lookup(fs->disk, fdb, set->names[idx]) != -1)
+                return 1;
+        }
+        return 0;
+    }
+
+    BlockList entries = {0};
+    FirstFileBlock ffb;
+    int ret = SimpleFS_listEntries(fs, fdb->header.block_in_disk, &entries);
+    for (idx = 0; ret == 0 && idx < entries.num; idx++) {
+        ret = Pack_readEntry(fs->disk, &ffb, entries.blocks[idx]);
+        if (ret == 0 && *NameSet_slot(set, ffb.fcb.name))
+            ret = 1;
+    }
+    free(entries.blocks);
+    return ret;
+}
+
+// appends the n entries in blocks to the list directory of d, taking the
+// directory blocks it needs from spare. Every directory block touched is
+// written once, the first one last
+static int SimpleFS_appendEntries(DirectoryHandle* d, const int64_t* blocks, int n, const int64_t* spare) {
+
+    DiskDriver* disk = d->sfs->disk;
+    FirstDirectoryBlock* fdb = d->dcb;
+    int added = 0;
+    int ret;
+
+    while (added < n && fdb->num_entries < max_entries_fdb)
+        fdb->file_blocks[fdb->num_entries++] = blocks[added++];
+    if (added == n)
+        return DiskDriver_writeBlock(disk, fdb, fdb->header.block_in_disk);
+
+    // the last directory block, if the directory has one besides fdb
+    DirectoryBlock last;
+    int has_last = fdb->header.next_block != -1;
+    if (has_last) {
+        ret = DiskDriver_readBlock(disk, &last, fdb->header.next_block);
+        while (ret == 0 && last.header.next_block != -1)
+            ret = DiskDriver_readBlock(disk, &last, last.header.next_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - createFiles] Cannot read from disk.\n");
+            return -1;
+        }
+    }
+
+    int entries = fdb->num_entries - max_entries_fdb;
+    int first_new = added;
+    if (has_last && entries % max_entries_db != 0) {
+        while (added < n && entries % max_entries_db != 0)
+            last.file_blocks[entries++ % max_entries_db] = blocks[added++];
+    }
+    int used_last = added - first_new;
+
+    // new blocks are written before the chain links them
+    DirectoryBlock db;
+    int64_t previous = has_last ? last.header.block_in_disk : fdb->header.block_in_disk;
+    int64_t block_in_file = has_last ? last.header.block_in_file : fdb->header.block_in_file;
+    int64_t first_spare = -1;
+    int num_spare = 0;
+    while (added < n) {
+        bzero(&db, sizeof(db));
+        db.header.previous_block = previous;
+        db.header.block_in_file = ++block_in_file;
+        db.header.block_in_disk = spare[num_spare];
+        db.header.next_block = added + max_entries_db < n ? spare[num_spare + 1] : -1;
+        int pos;
+        for (pos = 0; pos < max_entries_db && added < n; pos++)
+            db.file_blocks[pos] = blocks[added++];
+        ret = DiskDriver_writeBlock(disk, &db, db.header.block_in_disk);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - createFiles] Cannot write on disk.\n");
+            return -1;
+        }
+        if (first_spare == -1)
+            first_spare = spare[num_spare];
+        previous = spare[num_spare++];
+    }
+
+    if (has_last && (used_last || first_spare != -1)) {
+        if (first_spare != -1)
+            last.header.next_block = first_spare;
+        ret = DiskDriver_writeBlock(disk, &last, last.header.block_in_disk);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - createFiles] Cannot write on disk.\n");
+            return -1;
+        }
+    }
+    else if (!has_last) {
+        fdb->header.next_block = first_spare;
+    }
+
+    fdb->num_entries += n - first_new;
+    fdb->fcb.size_in_bytes += (n - first_new) * BLOCK_SIZE;
+    fdb->fcb.size_in_blocks += n - first_new;
+    return DiskDriver_writeBlock(disk, fdb, fdb->header.block_in_disk);
+}
+
+static int SimpleFS_createFilesLocked(DirectoryHandle* d, const char** names, int n) {
+
+    SimpleFS* fs = d->sfs;
+    FirstDirectoryBlock* fdb = d->dcb;
+    int tree = fdb->fcb.is_dir == SFS_DIR_TREE;
+    int idx, ret;
+
+    NameSet set;
+    ret = NameSet_init(&set, names, n);
+    if (ret == 0)
+        ret = SimpleFS_anyExists(fs, fdb, &set, n);
+    free(set.slots);
+    if (ret != 0) {
+        if (DEBUG) printf("[SFS - createFiles] A file already exists.\n");
+        return -1;
+    }
+
+    // directory blocks needed past the first one, before and after
+    int num_db = 0;
+    if (!tree) {
+        int before = fdb->num_entries - max_entries_fdb;
+        int after = before + n;
+        before = before > 0 ? (before + max_entries_db - 1) / max_entries_db : 0;
+        after = after > 0 ? (after + max_entries_db - 1) / max_entries_db : 0;
+        num_db = after - before;
+    }
+
+    int64_t* blocks = malloc((n + num_db) * sizeof(int64_t));
+    if (SimpleFS_pickBlocks(fs->disk, fdb->header.block_in_disk, n + num_db, blocks) == -1) {
+        if (DEBUG) printf("[SFS - createFiles] No free blocks.\n");
+        free(blocks);
+        return -1;
+    }
+
+    FirstFileBlock ffb = {0};
+    ffb.header.previous_block = -1;
+    ffb.header.next_block = -1;
+    ffb.fcb.directory_block = fdb->header.block_in_disk;
+    ffb.fcb.size_in_blocks = 1;
+    for (idx = 0, ret = 0; idx < n && ret == 0; idx++) {
+        ffb.header.block_in_disk = blocks[idx];
+        ffb.fcb.idx_in_directory = tree ? -1 : fdb->num_entries + idx;
+        strncpy(ffb.fcb.name, names[idx], 128);
+        ret = DiskDriver_writeBlock(fs->disk, &ffb, blocks[idx]);
+    }
+
+    if (ret == 0 && tree) {
+        for (idx = 0; idx < n && ret == 0; idx++)
+            ret = DirTree_insert(fs->disk, fdb, names[idx], blocks[idx]);
+        // the entries already added are taken out again
+        if (ret == -1) {
+            for (idx -= 2; idx >= 0; idx--)
+                DirTree_remove(fs->disk, fdb, names[idx]);
+        }
+        if (DiskDriver_writeBlock(fs->disk, fdb, fdb->header.block_in_disk) == -1)
+            ret = -1;
+    }
+    else if (ret == 0) {
+        ret = SimpleFS_appendEntries(d, blocks, n, blocks + n);
+    }
+
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - createFiles] Cannot add the entries.\n");
+        DiskDriver_freeBlocks(fs->disk, blocks, n + num_db);
+        free(blocks);
+        return -1;
+    }
+
+    for (idx = 0; idx < n; idx++)
+        DentryCache_insert(&fs->dcache, fdb->header.block_in_disk, names[idx], blocks[idx], 0);
+    free(blocks);
+    return 0;
+}
+
+int SimpleFS_createFiles(DirectoryHandle* d, const char** names, int n) {
+    STATS_TIME(STATS_SFS_CREATE_FILES);
+
+    if (n <= 0)
+        return n == 0 ? 0 : -1;
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_wrlock(lock);
+    int ret = SimpleFS_reloadDir(d);
+    if (ret == 0)
+        ret = SimpleFS_createFilesLocked(d, names, n);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+static int SimpleFS_readDirLocked(char** names, DirectoryHandle* d) {
+ 
+    FirstDirectoryBlock* fdb = d->dcb;
+    int entries = fdb->num_entries;
+    int idx, ret;
+
+    if (fdb->fcb.is_dir == SFS_DIR_TREE) {
+        DirTreeCursor cursor;
+        char name[128];
+        if (DirTree_seek(d->sfs->disk, fdb, "", &cursor) == -1)
+            return -1;
+        for (idx = 0; idx < entries; idx++) {
+            if (DirTree_next(d->sfs->disk, &cursor, name) == -1)
+                return -1;
+            names[idx] = strndup(name, 128);
+        }
+        return 0;
+    }
+
+    for (idx = 0; idx < max_entries_fdb; idx++) {
+        if (idx >= entries)
+            return 0;
+        
+        FirstFileBlock ffb;
+        int64_t block_num = fdb->file_blocks[idx];
+        ret = Pack_readEntry(d->sfs->disk, &ffb, block_num);
+        if (ret == -1)
+            return -1;
+
+        names[idx] = strndup(ffb.fcb.name, 128);
+    }
+
+    entries -= idx;
+    DirectoryBlock db;
+    ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
+        return 0;
+    }
+    for (idx = 0; idx < max_entries_db; idx++) {
+        if (idx >= entries)
+            return 0;
+
+        FirstFileBlock ffb;
+        int64_t block_num = db.file_blocks[idx];
+        ret = Pack_readEntry(d->sfs->disk, &ffb, block_num);
+        if (ret == -1)
+            return -1;
+        
+        int names_idx = max_entries_fdb + idx + max_entries_db * (int) (db.header.block_in_file - 1); 
+        names[names_idx] = strndup(ffb.fcb.name, 128); 
+    }
+    entries -= idx;
+    while (db.header.next_block != -1) {
+        ret = DiskDriver_readBlock(d->sfs->disk, &db, db.header.next_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - createFile] Cannot read from disk.\n");
+            return 0;
+        }
+        for (idx = 0; idx < max_entries_db; idx++) {
+            if (idx >= entries)
+                return 0;
+
+            FirstFileBlock ffb;
+            int64_t block_num = db.file_blocks[idx];
+            ret = Pack_readEntry(d->sfs->disk, &ffb, block_num);
+            if (ret == -1)
+                return -1;
+
+            int names_idx = max_entries_fdb + idx + max_entries_db * (int) (db.header.block_in_file - 1); 
+            names[names_idx] = strndup(ffb.fcb.name, 128); 
+        }
+        entries -= idx;
+    }
+    return 0;
+}
+
+// names are read from the copy of the directory held by d, so
+// they match the number of entries the caller sized names for
+int SimpleFS_readDir(char** names, DirectoryHandle* d) {
+    STATS_TIME(STATS_SFS_READ_DIR);
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_rdlock(lock);
+    int ret = SimpleFS_readDirLocked(names, d);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+static int SimpleFS_compareNames(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// 1 if name starts with prefix and comes after after (if not NULL)
+static int SimpleFS_inRange(const char* name, const char* prefix, const char* after) {
+    return strncmp(name, prefix, strlen(prefix)) == 0 &&
+           (after == NULL || strcmp(name, after) > 0);
+}
+
+static int SimpleFS_scanDirLocked(DirectoryHandle* d, const char* prefix, const char* after,
+                                  char** names, int max) {
+
+    FirstDirectoryBlock* fdb = d->dcb;
+    char name[128];
+    int num = 0;
+    int idx;
+
+    // the names after the first match are in order in the leaves
+    if (fdb->fcb.is_dir == SFS_DIR_TREE) {
+        DirTreeCursor cursor;
+        const char* from = after != NULL && strcmp(after, prefix) > 0 ? after : prefix;
+        if (DirTree_seek(d->sfs->disk, fdb, from, &cursor) == -1)
+            return -1;
+        while (num < max && DirTree_next(d->sfs->disk, &cursor, name) != -1) {
+            if (strncmp(name, prefix, strlen(prefix)) != 0)
+                break;
+            if (SimpleFS_inRange(name, prefix, after))
+                names[num++] = strndup(name, 128);
+        }
+        return num;
+    }
+
+    char** all = calloc(fdb->num_entries, sizeof(char*));
+    int ret = SimpleFS_readDirLocked(all, d);
+    int entries = 0;
+    for (idx = 0; idx < fdb->num_entries; idx++) {
+        if (all[idx] != NULL && ret == 0 && SimpleFS_inRange(all[idx], prefix, after))
+            all[entries++] = all[idx];
+        else
+            free(all[idx]);
+    }
+    qsort(all, entries, sizeof(char*), SimpleFS_compareNames);
+    for (idx = 0; idx < entries; idx++) {
+        if (num < max)
+            names[num++] = all[idx];
+        else
+            free(all[idx]);
+    }
+    free(all);
+    return ret == -1 ? -1 : num;
+}
+
+int SimpleFS_scanDir(DirectoryHandle* d, const char* prefix, const char* after,
+                     char** names, int max) {
+    STATS_TIME(STATS_SFS_SCAN_DIR);
+
+    if (prefix == NULL)
+        prefix = "";
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_rdlock(lock);
+    int ret = SimpleFS_reloadDir(d);
+    if (ret == 0)
+        ret = SimpleFS_scanDirLocked(d, prefix, after, names, max);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+// fills entry from the first block of an entry of the directory dir_block,
+// -1 if the block isn't one of its entries any more. A packed file is
+// rebuilt from its pack block
+static int SimpleFS_fillEntry(SimpleFS* fs, int64_t dir_block, int64_t block_num, SimpleFSEntry* entry) {
+    FirstFileBlock packed;
+    const FirstFileBlock* ffb = &packed;
+    if (!PACK_IS_REF(block_num))
+        ffb = DiskDriver_mapBlock(fs->disk, block_num);
+    else if (Pack_read(fs->disk, block_num, &packed) == -1)
+        ffb = NULL;
+    if (ffb == NULL || ffb->header.block_in_file != 0 || ffb->header.block_in_disk != block_num ||
+            ffb->fcb.directory_block != dir_block)
+        return -1;
+
+    memcpy(entry->name, ffb->fcb.name, sizeof(entry->name));
+    entry->name[sizeof(entry->name) - 1] = 0;
+    entry->block = block_num;
+    entry->size_in_bytes = ffb->fcb.size_in_bytes;
+    entry->is_dir = ffb->fcb.is_dir;
+    return 0;
+}
+
+// the cursor kept from the last call is still good if the key before it
+// is the last entry returned, otherwise the leaf changed meanwhile
+static int SimpleFS_treeCursorValid(DirectoryHandle* d) {
+    if (d->tree_leaf == -1 || d->pos_in_block == 0)
+        return 1;
+    const DirTreeNode* leaf = DiskDriver_mapBlock(d->sfs->disk, d->tree_leaf);
+    return leaf != NULL && leaf->is_leaf && leaf->header.block_in_disk == d->tree_leaf &&
+           d->pos_in_block <= leaf->num_keys && leaf->num_keys < DIRTREE_FANOUT &&
+           leaf->keys[d->pos_in_block - 1].block == d->last_entry;
+}
+
+// the keys are read from the leaves mapped by the disk, the next leaf
+// is prefetched when the cursor enters one
+static int SimpleFS_nextTreeEntry(DirectoryHandle* d, SimpleFSEntry* entry) {
+
+    SimpleFS* fs = d->sfs;
+    int64_t dir_block = d->dcb->header.block_in_disk;
+    if (d->pos_in_dir == 0 || !SimpleFS_treeCursorValid(d)) {
+        // placed again on the last name returned, which is skipped if still there
+        DirTreeCursor cursor;
+        const char* from = d->pos_in_dir == 0 ? "" : d->last_name;
+        if (SimpleFS_reloadDir(d) == -1 || DirTree_seek(fs->disk, d->dcb, from, &cursor) == -1)
+            return -1;
+        if (d->pos_in_dir > 0) {
+            DirTreeCursor peek = cursor;
+            if (DirTree_next(fs->disk, &peek, NULL) == d->last_entry)
+                cursor = peek;
+        }
+        d->tree_leaf = cursor.leaf;
+        d->pos_in_block = cursor.pos;
+    }
+
+    while (d->tree_leaf != -1) {
+        const DirTreeNode* leaf = DiskDriver_mapBlock(fs->disk, d->tree_leaf);
+        if (leaf == NULL) {
+            if (DEBUG) printf("[SFS - nextEntry] Cannot read from disk.\n");
+            return -1;
+        }
+        if (d->pos_in_block >= leaf->num_keys) {
+            d->tree_leaf = leaf->header.next_block;
+            d->pos_in_block = 0;
+            DiskDriver_prefetchBlock(fs->disk, d->tree_leaf);
+            continue;
+        }
+
+        int64_t block_num = leaf->keys[d->pos_in_block++].block;
+        if (d->pos_in_block < leaf->num_keys)
+            DiskDriver_prefetchBlock(fs->disk, leaf->keys[d->pos_in_block].block);
+        if (SimpleFS_fillEntry(fs, dir_block, block_num, entry) == 0) {
+            d->last_entry = block_num;
+            strcpy(d->last_name, entry->name);
+            d->pos_in_dir += 1;
+            return 1;
+        }
+    }
+    d->pos_in_block = 0;
+    return 0;
+}
+
+// the entries of a list directory are read from the copy of its first block
+// taken at the last rewind and from the following blocks, loaded in block_buf
+// once per block. When a block is loaded the next one is prefetched, and each
+// entry prefetches the one after it
+static int SimpleFS_nextListEntry(DirectoryHandle* d, SimpleFSEntry* entry) {
+
+    SimpleFS* fs = d->sfs;
+    FirstDirectoryBlock* fdb = d->dcb;
+    int64_t dir_block = fdb->header.block_in_disk;
+    if (d->pos_in_dir == 0 && d->pos_in_block == 0)
+        DiskDriver_prefetchBlock(fs->disk, fdb->header.next_block);
+
+    while (d->pos_in_dir < fdb->num_entries) {
+        int first = d->current_block == &fdb->header;
+        int capacity = first ? max_entries_fdb : max_entries_db;
+        int64_t* slots = first ? fdb->file_blocks : d->block_buf.file_blocks;
+
+        if (d->pos_in_block == capacity) {
+            // a directory that shrank may have lost its next block: the end
+            int64_t next_block = d->current_block->next_block;
+            if (next_block == -1 || DiskDriver_readBlock(fs->disk, &d->block_buf, next_block) == -1)
+                return 0;
+            d->current_block = &d->block_buf.header;
+            d->pos_in_block = 0;
+            DiskDriver_prefetchBlock(fs->disk, d->block_buf.header.next_block);
+            continue;
+        }
+
+        int64_t block_num = slots[d->pos_in_block++];
+        d->pos_in_dir += 1;
+        if (d->pos_in_block < capacity && d->pos_in_dir < fdb->num_entries)
+            DiskDriver_prefetchBlock(fs->disk, slots[d->pos_in_block]);
+        // an entry removed since the rewind is skipped
+        if (SimpleFS_fillEntry(fs, dir_block, block_num, entry) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int SimpleFS_rewindDir(DirectoryHandle* d) {
+    STATS_TIME(STATS_SFS_REWIND_DIR);
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_rdlock(lock);
+    int ret = SimpleFS_reloadDir(d);
+    pthread_rwlock_unlock(lock);
+    d->current_block = &d->dcb->header;
+    d->pos_in_dir = 0;
+    d->pos_in_block = 0;
+    return ret;
+}
+
+int SimpleFS_nextEntry(DirectoryHandle* d, SimpleFSEntry* entry) {
+    STATS_TIME(STATS_SFS_NEXT_ENTRY);
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_rdlock(lock);
+    int ret = d->dcb->fcb.is_dir == SFS_DIR_TREE ? SimpleFS_nextTreeEntry(d, entry)
+                                                 : SimpleFS_nextListEntry(d, entry);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+// a handle on the directory starting at dir_block, for walking it:
+// its parent isn't read. NULL if it isn't a directory
+static DirectoryHandle* SimpleFS_openDirBlock(SimpleFS* fs, int64_t dir_block) {
+
+    DirectoryHandle* dh = calloc(1, sizeof(DirectoryHandle));
+    dh->sfs = fs;
+    dh->dcb = malloc(sizeof(FirstDirectoryBlock));
+    dh->directory = NULL;
+    dh->current_block = &dh->dcb->header;
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(fs, dir_block);
+    pthread_rwlock_rdlock(lock);
+    int ret = DiskDriver_readBlock(fs->disk, dh->dcb, dir_block);
+    pthread_rwlock_unlock(lock);
+    if (ret == -1 || dh->dcb->fcb.is_dir == 0) {
+        if (DEBUG) printf("[SFS - walk] Cannot open the directory.\n");
+        SimpleFS_closeDir(dh);
+        return NULL;
+    }
+    return dh;
+}
+
+int SimpleFS_walk(DirectoryHandle* d, const char* path, SimpleFSWalkFn fn, void* arg) {
+    STATS_TIME(STATS_SFS_WALK);
+
+    int64_t first_block = SimpleFS_lookupPath(d, path);
+    DirectoryHandle* top = first_block == -1 ? NULL : SimpleFS_openDirBlock(d->sfs, first_block);
+    if (top == NULL)
+        return -1;
+
+    // one handle and one path length for each level being walked
+    int depth = 1, max_depth = 16;
+    DirectoryHandle** stack = malloc(max_depth * sizeof(DirectoryHandle*));
+    int* lengths = malloc(max_depth * sizeof(int));
+    int path_capacity = 1024;
+    char* sub_path = malloc(path_capacity);
+    stack[0] = top;
+    lengths[0] = 0;
+    sub_path[0] = 0;
+
+    SimpleFSEntry entry;
+    int ret = 0;
+    while (ret == 0 && depth > 0) {
+        DirectoryHandle* dir = stack[depth - 1];
+        int len = lengths[depth - 1];
+        int next = SimpleFS_nextEntry(dir, &entry);
+        if (next != 1) {
+            ret = next;
+            SimpleFS_closeDir(dir);
+            depth -= 1;
+            continue;
+        }
+
+        int name_len = strlen(entry.name);
+        if (len + name_len + 2 > path_capacity) {
+            path_capacity = 2 * (len + name_len + 2);
+            sub_path = realloc(sub_path, path_capacity);
+        }
+        sprintf(sub_path + len, len > 0 ? "/%s" : "%s", entry.name);
+        ret = fn(sub_path, &entry, arg);
+        if (ret != 0 || !entry.is_dir)
+            continue;
+
+        DirectoryHandle* child = SimpleFS_openDirBlock(d->sfs, entry.block);
+        if (child == NULL) {
+            ret = -1;
+            continue;
+        }
+        if (depth == max_depth) {
+            max_depth *= 2;
+            stack = realloc(stack, max_depth * sizeof(DirectoryHandle*));
+            lengths = realloc(lengths, max_depth * sizeof(int));
+        }
+        stack[depth] = child;
+        lengths[depth] = (int) strlen(sub_path);
+        depth += 1;
+    }
+    while (depth > 0)
+        SimpleFS_closeDir(stack[--depth]);
+    free(stack);
+    free(lengths);
+    free(sub_path);
+    return ret;
+}
+
+int SimpleFS_closeDir(DirectoryHandle* d) {
+    STATS_TIME(STATS_SFS_CLOSE_DIR);
+    if (d->directory != NULL)
+        free(d->directory);
+    free(d->dcb);
+    free(d);
+    return 0;
+}
+
+FileHandle* SimpleFS_openFile(DirectoryHandle* d, const char* filename) {
+    STATS_TIME(STATS_SFS_OPEN_FILE);
+
+    // the directory stays locked until the file is in the open file table,
+    // so it can't be removed in between
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_rdlock(lock);
+    int64_t block_num = SimpleFS_reloadDir(d) == 0 ? SimpleFS_exists(d, filename) : 0;
+    if (block_num == 0) {
+        pthread_rwlock_unlock(lock);
+        if (DEBUG) printf("[SFS - openFile] File doesn't exists.\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&d->sfs->table_lock);
+    OpenFileEntry* entry = SimpleFS_getOpenFile(d->sfs, block_num);
+    pthread_mutex_unlock(&d->sfs->table_lock);
+    pthread_rwlock_unlock(lock);
+    if (entry == NULL) {
+        if (DEBUG) printf("[SFS - openFile] Cannot open file.\n");
+        return NULL;
+    }
+
+    FileHandle* new_fh = calloc(1, sizeof(FileHandle));
+    new_fh->sfs = d->sfs;
+    new_fh->fcb = entry->fcb;
+    new_fh->entry = entry;
+    new_fh->current_block = &entry->fcb->header;
+    new_fh->pos_in_file = 0;
+    new_fh->generation = entry->generation;
+
+    return new_fh;
+}
+
+int SimpleFS_closeFile(FileHandle* f) {
+    STATS_TIME(STATS_SFS_CLOSE_FILE);
+
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == 0)
+        ret = SimpleFS_flushBlock(f);
+    pthread_rwlock_unlock(&f->entry->lock);
+
+    pthread_mutex_lock(&f->sfs->table_lock);
+    if (SimpleFS_putOpenFile(f->sfs, f->entry) == -1)
+        ret = -1;
+    pthread_mutex_unlock(&f->sfs->table_lock);
+    free(f->pending);
+    free(f);
+    return ret;
+}
+
+static int SimpleFS_flushLocked(FileHandle* f) {
+
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == -1)
+        return -1;
+    ret = SimpleFS_flushBlock(f);
+    if (ret == -1)
+        return -1;
+    return SimpleFS_writeBackFcb(f->sfs, f->entry);
+}
+
+static int SimpleFS_setWriteBackLocked(FileHandle* f, int enable) {
+
+    f->write_back = enable;
+    if (!enable)
+        return SimpleFS_flushLocked(f);
+    return 0;
+}
+
+static int SimpleFS_writeLocked(FileHandle* f, void* data, int size) {
+
+    if (size < 0)
+        return -1;
+
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == -1)
+        return -1;
+
+    if (f->write_back) {
+        int64_t chain_end = SimpleFS_blockStart(f->fcb->fcb.size_in_blocks);
+        if (f->pending_size > 0 || f->pos_in_file + size > chain_end) {
+            int in_chain = 0;
+            if (f->pending_size == 0) {
+                in_chain = (int) (chain_end - f->pos_in_file);
+                if (in_chain > 0 && SimpleFS_writeChain(f, data, in_chain) == -1)
+                    return -1;
+                f->pending_start = chain_end;
+            }
+            ret = SimpleFS_pendData(f, data + in_chain, size - in_chain);
+            return ret == -1 ? -1 : size;
+        }
+    }
+
+    ret = SimpleFS_reserveLocked(f, f->pos_in_file + size);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - write] No free block.\n");
+        return -1;
+    }
+
+    int written = SimpleFS_writeChain(f, data, size);
+    if (written == -1)
+        return -1;
+
+    if (!f->write_back) {
+        ret = SimpleFS_flushLocked(f);
+        if (ret == -1)
+            return -1;
+    }
+    return written;
+}
+
+static int SimpleFS_readLocked(FileHandle* f, void* data, int size) {
+
+    if (size < 0)
+        return -1;
+
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == -1)
+        return -1;
+
+    int64_t available = f->fcb->fcb.size_in_bytes - f->pos_in_file;
+    if (size > available)
+        size = (int) available;
+
+    int read = 0;
+    while (read < size) {
+        int64_t block_in_file = f->current_block->block_in_file;
+        int offset = (int) (f->pos_in_file - SimpleFS_blockStart(block_in_file));
+        int capacity = block_in_file == 0 ? max_data_ffb : max_data_fb;
+
+        if (offset == capacity) {
+            ret = SimpleFS_nextBlock(f, 0);
+            if (ret == -1)
+                return read > 0 ? read : -1;
+            continue;
+        }
+
+        int chunk = capacity - offset;
+        if (chunk > size - read)
+            chunk = size - read;
+
+        if (block_in_file == 0) {
+            memcpy(data + read, f->fcb->data + offset, chunk);
+        }
+        else {
+            ret = SimpleFS_refreshBlock(f);
+            if (ret == -1)
+                return read > 0 ? read : -1;
+            memcpy(data + read, f->block_buf.data + offset, chunk);
+        }
+        read += chunk;
+        f->pos_in_file += chunk;
+    }
+    return read;
+}
+
+static int64_t SimpleFS_seekLocked(FileHandle* f, int64_t pos) {
+
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == -1)
+        return -1;
+
+    if (pos < 0 || pos > f->fcb->fcb.size_in_bytes) {
+        if (DEBUG) printf("[SFS - seek] Position out of file.\n");
+        return -1;
+    }
+
+    int64_t block_in_file = SimpleFS_blocksFor(pos) - 1;
+    ret = SimpleFS_gotoBlock(f, block_in_file);
+    if (ret == -1)
+        return -1;
+
+    f->pos_in_file = pos;
+    return pos;
+}
+
+static int SimpleFS_reserveLocked(FileHandle* f, int64_t size) {
+
+    if (size < 0)
+        return -1;
+
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == -1)
+        return -1;
+
+    int64_t needed = SimpleFS_blocksFor(size) - f->fcb->fcb.size_in_blocks;
+    if (needed <= 0)
+        return 0;
+    if (needed > __atomic_load_n(&f->sfs->disk->header->free_blocks, __ATOMIC_RELAXED)) {
+        if (DEBUG) printf("[SFS - reserve] No free block.\n");
+        return -1;
+    }
+
+    // a large reservation is added in runs of at most SFS_ALLOC_BATCH blocks
+    while (ret == 0 && needed > 0) {
+        int count = needed < SFS_ALLOC_BATCH ? (int) needed : SFS_ALLOC_BATCH;
+        ret = SimpleFS_gotoBlock(f, f->fcb->fcb.size_in_blocks - 1);
+        if (ret == 0)
+            ret = SimpleFS_appendBlocks(f, count, NULL, 0);
+        needed -= count;
+    }
+    if (SimpleFS_gotoBlock(f, SimpleFS_blocksFor(f->pos_in_file) - 1) == -1)
+        ret = -1;
+    if (ret == 0 && !f->write_back)
+        ret = SimpleFS_writeBackFcb(f->sfs, f->entry);
+    return ret;
+}
+
+static int SimpleFS_truncateLocked(FileHandle* f, int64_t size) {
+
+    if (size < 0)
+        return -1;
+
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == -1)
+        return -1;
+
+    FirstFileBlock* ffb = f->fcb;
+    if (size >= ffb->fcb.size_in_bytes) {
+        ret = SimpleFS_reserveLocked(f, size);
+        if (ret == -1)
+            return -1;
+        ffb->fcb.size_in_bytes = size;
+        f->entry->dirty = 1;
+        return f->write_back ? 0 : SimpleFS_writeBackFcb(f->sfs, f->entry);
+    }
+
+    ret = SimpleFS_flushBlock(f);
+    if (ret == -1)
+        return -1;
+    f->current_block = &ffb->header;
+
+    // find the new last block, clearing the bytes after the new end
+    int64_t keep = SimpleFS_blocksFor(size);
+    int end = (int) (size - SimpleFS_blockStart(keep - 1));
+    FileBlock last;
+    BlockHeader* cut = &ffb->header;
+    if (keep == 1) {
+        bzero(ffb->data + end, max_data_ffb - end);
+    }
+    else {
+        int64_t next_block = ffb->header.next_block;
+        do {
+            ret = DiskDriver_readBlock(f->sfs->disk, &last, next_block);
+            if (ret == -1) {
+                if (DEBUG) printf("[SFS - truncate] Cannot read from disk.\n");
+                return -1;
+            }
+            next_block = last.header.next_block;
+        } while (last.header.block_in_file < keep - 1);
+        bzero(last.data + end, max_data_fb - end);
+        cut = &last.header;
+    }
+
+    // the tail of the chain is cut off first, then released in batches
+    int64_t tail = cut->next_block;
+    cut->next_block = -1;
+    if (cut != &ffb->header) {
+        ret = DiskDriver_writeBlock(f->sfs->disk, &last, last.header.block_in_disk);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - truncate] Cannot write on disk.\n");
+            return -1;
+        }
+    }
+
+    BlockList freed = {0};
+    ret = SimpleFS_freeChain(f->sfs, tail, &freed);
+    if (BlockList_release(f->sfs->disk, &freed, 1) == -1)
+        ret = -1;
+    free(freed.blocks);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - truncate] Cannot free blocks on disk.\n");
+        return -1;
+    }
+
+    ffb->fcb.size_in_blocks = keep;
+    ffb->fcb.size_in_bytes = size;
+    f->entry->dirty = 1;
+    f->entry->generation += 1;
+
+    ret = SimpleFS_syncHandle(f);
+    if (ret == 0 && !f->write_back)
+        ret = SimpleFS_writeBackFcb(f->sfs, f->entry);
+    return ret;
+}
+
+// the operations on a file handle run under the lock of the open file,
+// the *Locked versions above expect it to be held
+int SimpleFS_flush(FileHandle* f) {
+    STATS_TIME(STATS_SFS_FLUSH);
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_flushLocked(f);
+    pthread_rwlock_unlock(&f->entry->lock);
+    return ret;
+}
+
+int SimpleFS_setWriteBack(FileHandle* f, int enable) {
+    STATS_TIME(STATS_SFS_SET_WRITE_BACK);
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_setWriteBackLocked(f, enable);
+    pthread_rwlock_unlock(&f->entry->lock);
+    return ret;
+}
+
+int SimpleFS_write(FileHandle* f, void* data, int size) {
+    STATS_TIME(STATS_SFS_WRITE);
+    if (SimpleFS_unpack(f) == -1)
+        return -1;
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_writeLocked(f, data, size);
+    pthread_rwlock_unlock(&f->entry->lock);
+    STATS_BYTES(STATS_SFS_WRITE, ret);
+    return ret;
+}
+
+int SimpleFS_read(FileHandle* f, void* data, int size) {
+    STATS_TIME(STATS_SFS_READ);
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_readLocked(f, data, size);
+    pthread_rwlock_unlock(&f->entry->lock);
+    STATS_BYTES(STATS_SFS_READ, ret);
+    return ret;
+}
+
+int64_t SimpleFS_seek(FileHandle* f, int64_t pos) {
+    STATS_TIME(STATS_SFS_SEEK);
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int64_t ret = SimpleFS_seekLocked(f, pos);
+    pthread_rwlock_unlock(&f->entry->lock);
+    return ret;
+}
+
+int SimpleFS_reserve(FileHandle* f, int64_t size) {
+    STATS_TIME(STATS_SFS_RESERVE);
+    if (SimpleFS_unpack(f) == -1)
+        return -1;
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_reserveLocked(f, size);
+    pthread_rwlock_unlock(&f->entry->lock);
+    return ret;
+}
+
+int SimpleFS_truncate(FileHandle* f, int64_t size) {
+    STATS_TIME(STATS_SFS_TRUNCATE);
+    if (SimpleFS_unpack(f) == -1)
+        return -1;
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_truncateLocked(f, size);
+    pthread_rwlock_unlock(&f->entry->lock);
+    return ret;
+}
+
+// returns the disk block of the data block holding position pos of the file
+// (past the first block), -1 if the chain is shorter. The cursor isn't moved,
+// but the walk starts from its block when that comes before pos
+static int64_t SimpleFS_blockAt(FileHandle* f, int64_t pos) {
+
+    FirstFileBlock* ffb = f->fcb;
+    int64_t block_num = ffb->header.next_block;
+    BlockHeader* cursor = f->current_block;
+    if (cursor != &ffb->header && f->generation == f->entry->generation &&
+            SimpleFS_blockStart(cursor->block_in_file) <= pos)
+        block_num = cursor->block_in_disk;
+
+    FileBlock fb;
+    while (block_num != -1) {
+        int ret = DiskDriver_readBlock(f->sfs->disk, &fb, block_num);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - blockAt] Cannot read from disk.\n");
+            return -1;
+        }
+        if (SimpleFS_blockStart(fb.header.block_in_file) + max_data_fb > pos)
+            return block_num;
+        block_num = fb.header.next_block;
+    }
+    return -1;
+}
+
+// copies size bytes from position offset of the file into data,
+// without using the cursor. The caller holds the lock of the file,
+// shared is enough. Returns the number of bytes read
+static int SimpleFS_readAt(FileHandle* f, char* data, int size, int64_t offset) {
+
+    FirstFileBlock* ffb = f->fcb;
+    if (offset >= ffb->fcb.size_in_bytes)
+        return 0;
+    if (size > ffb->fcb.size_in_bytes - offset)
+        size = (int) (ffb->fcb.size_in_bytes - offset);
+
+    int done = 0;
+    if (offset < max_data_ffb) {
+        done = max_data_ffb - offset < size ? (int) (max_data_ffb - offset) : size;
+        memcpy(data, ffb->data + offset, done);
+    }
+
+    int64_t pos = offset + done;
+    int64_t next_block = done < size ? SimpleFS_blockAt(f, pos) : -1;
+
+    FileBlock fb;
+    while (done < size && next_block != -1) {
+        int ret = DiskDriver_readBlock(f->sfs->disk, &fb, next_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - pread] Cannot read from disk.\n");
+            return done > 0 ? done : -1;
+        }
+        next_block = fb.header.next_block;
+
+        int64_t start = SimpleFS_blockStart(fb.header.block_in_file);
+        int chunk = (int) (start + max_data_fb - pos);
+        if (chunk > size - done)
+            chunk = size - done;
+        memcpy(data + done, fb.data + pos - start, chunk);
+        done += chunk;
+        pos += chunk;
+    }
+    return done;
+}
+
+// writes size bytes of data at position offset of the file, allocating
+// the blocks needed, without moving the cursor. The caller holds the
+// lock of the file exclusively. Returns the number of bytes written
+static int SimpleFS_writeAt(FileHandle* f, const char* data, int size, int64_t offset) {
+
+    // the data buffered by the handle must not overwrite this one later
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == 0)
+        ret = SimpleFS_flushBlock(f);
+    if (ret == 0)
+        ret = SimpleFS_reserveLocked(f, offset + size);
+    if (ret == -1)
+        return -1;
+
+    FirstFileBlock* ffb = f->fcb;
+    int done = 0;
+    if (offset < max_data_ffb) {
+        done = max_data_ffb - offset < size ? (int) (max_data_ffb - offset) : size;
+        memcpy(ffb->data + offset, data, done);
+        f->entry->dirty = 1;
+    }
+
+    int64_t pos = offset + done;
+    int64_t next_block = done < size ? SimpleFS_blockAt(f, pos) : -1;
+
+    FileBlock fb;
+    while (done < size && next_block != -1) {
+        ret = DiskDriver_readBlock(f->sfs->disk, &fb, next_block);
+        if (ret == -1)
+            break;
+
+        int64_t start = SimpleFS_blockStart(fb.header.block_in_file);
+        int chunk = (int) (start + max_data_fb - pos);
+        if (chunk > size - done)
+            chunk = size - done;
+        memcpy(fb.data + pos - start, data + done, chunk);
+        ret = DiskDriver_writeBlock(f->sfs->disk, &fb, next_block);
+        if (ret == -1)
+            break;
+        done += chunk;
+        pos += chunk;
+        next_block = fb.header.next_block;
+    }
+    if (ret == -1 && DEBUG) printf("[SFS - pwrite] Cannot access the disk.\n");
+
+    // other handles reload the blocks they buffered
+    f->entry->data_version += 1;
+    if (offset + done > ffb->fcb.size_in_bytes) {
+        ffb->fcb.size_in_bytes = offset + done;
+        f->entry->dirty = 1;
+    }
+    if (!f->write_back && SimpleFS_writeBackFcb(f->sfs, f->entry) == -1)
+        return -1;
+    return done > 0 || size == 0 ? done : -1;
+}
+
+// takes the lock of the file to read it without the cursor: readers share
+// it, unless the handle has data to write first. 0 on success, -1 on error
+static int SimpleFS_lockShared(FileHandle* f) {
+
+    pthread_rwlock_t* lock = &f->entry->lock;
+    pthread_rwlock_rdlock(lock);
+    if (!f->block_dirty && f->pending_size == 0)
+        return 0;
+
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_wrlock(lock);
+    int ret = SimpleFS_syncHandle(f);
+    if (ret == 0)
+        ret = SimpleFS_flushPending(f);
+    if (ret == 0)
+        ret = SimpleFS_flushBlock(f);
+    if (ret == -1)
+        pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+int SimpleFS_pread(FileHandle* f, void* data, int size, int64_t offset) {
+    STATS_TIME(STATS_SFS_PREAD);
+
+    if (size < 0 || offset < 0)
+        return -1;
+
+    if (SimpleFS_lockShared(f) == -1)
+        return -1;
+    int ret = SimpleFS_readAt(f, data, size, offset);
+    pthread_rwlock_unlock(&f->entry->lock);
+    STATS_BYTES(STATS_SFS_PREAD, ret);
+    return ret;
+}
+
+const void* SimpleFS_mapFile(FileHandle* f, int64_t offset, int len) {
+    STATS_TIME(STATS_SFS_MAP_FILE);
+
+    if (offset < 0 || len <= 0)
+        return NULL;
+
+    if (SimpleFS_lockShared(f) == -1)
+        return NULL;
+
+    const void* view = NULL;
+    FirstFileBlock* ffb = f->fcb;
+    if (offset + len > ffb->fcb.size_in_bytes) {
+        if (DEBUG) printf("[SFS - mapFile] Range out of file.\n");
+    }
+    else if (offset + len <= max_data_ffb) {
+        view = ffb->data + offset;
+    }
+    else {
+        int64_t block_num = offset >= max_data_ffb ? SimpleFS_blockAt(f, offset) : -1;
+        FileBlock* fb = block_num == -1 ? NULL : DiskDriver_mapBlock(f->sfs->disk, block_num);
+        int64_t start = fb == NULL ? 0 : SimpleFS_blockStart(fb->header.block_in_file);
+        if (fb != NULL && offset + len <= start + max_data_fb) {
+            view = fb->data + offset - start;
+        }
+        else {
+            // the data of a block is preceded by its header, a range spanning
+            // blocks is never contiguous in the disk: gather it
+            char* copy = malloc(len);
+            if (SimpleFS_readAt(f, copy, len, offset) == len)
+                view = copy;
+            else
+                free(copy);
+        }
+    }
+    pthread_rwlock_unlock(&f->entry->lock);
+    if (view != NULL)
+        STATS_BYTES(STATS_SFS_MAP_FILE, len);
+    return view;
+}
+
+void SimpleFS_unmapFile(FileHandle* f, const void* view) {
+    STATS_TIME(STATS_SFS_UNMAP_FILE);
+
+    const char* p = view;
+    const char* fcb = (const char*) f->fcb;
+    if (p >= fcb && p < fcb + sizeof(FirstFileBlock))
+        return;
+    if (DiskDriver_contains(f->sfs->disk, view))
+        return;
+    free((void*) view);
+}
+
+int SimpleFS_pwrite(FileHandle* f, void* data, int size, int64_t offset) {
+    STATS_TIME(STATS_SFS_PWRITE);
+
+    if (size < 0 || offset < 0 || SimpleFS_unpack(f) == -1)
+        return -1;
+
+    pthread_rwlock_wrlock(&f->entry->lock);
+    int ret = SimpleFS_writeAt(f, data, size, offset);
+    pthread_rwlock_unlock(&f->entry->lock);
+    STATS_BYTES(STATS_SFS_PWRITE, ret);
+    return ret;
+}
+
+static int SimpleFS_changeDirPath(DirectoryHandle* d, const char* path) {
+
+    int64_t dir_block = SimpleFS_lookupPath(d, path);
+    if (dir_block == -1) {
+        if (DEBUG) printf("[SFS - changeDir] Directory doesn't exists.\n");
+        return -1;
+    }
+
+    FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, dir_block);
+    pthread_rwlock_rdlock(lock);
+    int ret = DiskDriver_readBlock(d->sfs->disk, fdb, dir_block);
+    pthread_rwlock_unlock(lock);
+    if (ret == -1 || fdb->fcb.is_dir == 0) {
+        if (DEBUG) printf("[SFS - changeDir] Given path is not a directory.\n");
+        free(fdb);
+        return -1;
+    }
+
+    FirstDirectoryBlock* parent = NULL;
+    if (fdb->fcb.directory_block != -1) {
+        parent = calloc(1, sizeof(FirstDirectoryBlock));
+        lock = SimpleFS_dirLock(d->sfs, fdb->fcb.directory_block);
+        pthread_rwlock_rdlock(lock);
+        ret = DiskDriver_readBlock(d->sfs->disk, parent, fdb->fcb.directory_block);
+        pthread_rwlock_unlock(lock);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
+            free(parent);
+            free(fdb);
+            return -1;
+        }
+    }
+
+    if (d->directory != NULL)
+        free(d->directory);
+    free(d->dcb);
+
+    d->dcb = fdb;
+    d->directory = parent;
+    d->current_block = &fdb->header;
+    d->pos_in_dir = 0;
+    d->pos_in_block = 0;
+    return 0;
+}
+
+DirectoryHandle* SimpleFS_openDir(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_OPEN_DIR);
+
+    DirectoryHandle* dh = calloc(1, sizeof(DirectoryHandle));
+    dh->sfs = d->sfs;
+    dh->dcb = malloc(sizeof(FirstDirectoryBlock));
+    memcpy(dh->dcb, d->dcb, sizeof(FirstDirectoryBlock));
+    dh->directory = NULL;
+    dh->current_block = &dh->dcb->header;
+
+    if (SimpleFS_changeDirPath(dh, path) == -1) {
+        SimpleFS_closeDir(dh);
+        return NULL;
+    }
+    return dh;
+}
+
+int SimpleFS_changeDir(DirectoryHandle* d, char* dirname) {
+    STATS_TIME(STATS_SFS_CHANGE_DIR);
+    
+    if (strchr(dirname, '/') != NULL && strcmp(dirname, "/") != 0)
+        return SimpleFS_changeDirPath(d, dirname);
+
+    if (strcmp(d->dcb->fcb.name, dirname) == 0)
+        return 0;
+
+    if (strcmp(dirname, ".") == 0) 
+        return 0;
+
+    if (strcmp(dirname, "..") == 0) {
+        if (strcmp(d->dcb->fcb.name, "/") == 0)
+            return 0;
+
+        free(d->dcb);
+        d->dcb = d->directory;
+        d->directory = NULL;
+        d->current_block = &d->dcb->header;
+        d->pos_in_dir = 0;
+        d->pos_in_block = 0;
+        
+        int64_t parent_block = d->dcb->fcb.directory_block;
+        if (parent_block != -1) {
+            FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
+            int ret = DiskDriver_readBlock(d->sfs->disk, fdb, parent_block);
+            if (ret == -1) {
+                if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
+                free(fdb);
+                return -1;
+            }
+
+            d->directory = fdb;
+        }
+
+        return 0;
+    }
+
+    if (strcmp(dirname, "/") == 0) {
+        free(d->dcb);    
+        free(d->directory);   
+
+        d->directory = NULL;
+
+        FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
+        int ret = DiskDriver_readBlock(d->sfs->disk, fdb, 0);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
+            free(fdb);
+            return -1;
+        }
+
+        d->dcb = fdb;
+        d->current_block = &fdb->header;
+        d->pos_in_dir = 0;
+        d->pos_in_block = 0;
+
+        return 0;
+    }
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_rdlock(lock);
+    int64_t dir_block = SimpleFS_reloadDir(d) == 0 ? SimpleFS_exists(d, dirname) : 0;
+    pthread_rwlock_unlock(lock);
+    if (dir_block) {
+        if (d->directory != NULL)
+            free(d->directory);
+        d->directory = d->dcb;
+
+        FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
+        int ret = DiskDriver_readBlock(d->sfs->disk, fdb, dir_block);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
+            free(fdb);
+            return -1;
+        }
+
+        if (fdb->fcb.is_dir == 0) {
+            free(fdb);
+            if (DEBUG) printf("[SFS - changeDir] Given dirname is not a directory.\n");
+            return -1;
+        }
+
+        d->dcb = fdb;
+        d->current_block = &fdb->header;
+        d->pos_in_dir = 0;
+        d->pos_in_block = 0;
+
+        return 0;
+    }
+
+    if (DEBUG) printf("[SFS - changeDir] Directory doesn't exists.\n");
+    return -1;
+}
+// creates dirname in the directory of d, is_dir gives the format
+// of the new directory (1 for a list of blocks or SFS_DIR_TREE)
+static int SimpleFS_mkDirLocked(DirectoryHandle* d, char* dirname, int is_dir) {
+
+    if (SimpleFS_exists(d, dirname)) {
+        if (DEBUG) printf("[SFS - mkDir] Directory already exists.\n");
+        return -1;
+    }
+
+    FirstDirectoryBlock* fdb = d->dcb;
+
+    int ret;
+    int64_t free_block = DiskDriver_allocBlock(d->sfs->disk, 0);
+    if (free_block == -1) {
+        if (DEBUG) printf("[SFS - mkDir] No free block.\n");
+        return -1;
+    }
+
+    FirstDirectoryBlock new_fdb = {0};
+    new_fdb.header.previous_block = -1;
+    new_fdb.header.next_block = -1;
+    new_fdb.header.block_in_file = 0;
+    new_fdb.header.block_in_disk = free_block;
+
+    new_fdb.fcb.directory_block = fdb->header.block_in_disk;
+    new_fdb.fcb.size_in_bytes = BLOCK_SIZE;
+    new_fdb.fcb.size_in_blocks = 1;
+    new_fdb.fcb.is_dir = 1;
+    new_fdb.fcb.idx_in_directory = fdb->fcb.is_dir == SFS_DIR_TREE ? -1 : fdb->num_entries;
+    strncpy(new_fdb.fcb.name, dirname, 128);
+
+    new_fdb.num_entries = 0;
+
+    if (is_dir == SFS_DIR_TREE && DirTree_init(d->sfs->disk, &new_fdb) == -1) {
+        if (DEBUG) printf("[SFS - mkDir] No free block.\n");
+        DiskDriver_freeBlock(d->sfs->disk, free_block);
+        return -1;
+    }
+
+    ret = DiskDriver_writeBlock(d->sfs->disk, &new_fdb, free_block);
+    if (ret == -1) {            
+        if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
+        return -1;
+    }
+
+    if (SimpleFS_addEntry(d, dirname, free_block) == -1) {
+        if (is_dir == SFS_DIR_TREE)
+            DirTree_destroy(d->sfs->disk, &new_fdb);
+        DiskDriver_freeBlock(d->sfs->disk, free_block);
+        return -1;
+    }
+
+    DentryCache_purgeDir(&d->sfs->dcache, free_block);
+    DentryCache_insert(&d->sfs->dcache, fdb->header.block_in_disk, dirname, free_block, is_dir);
+    return 0;
+}
+
+int SimpleFS_mkDir(DirectoryHandle* d, char* dirname) {
+    STATS_TIME(STATS_SFS_MKDIR);
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_wrlock(lock);
+    int ret = SimpleFS_reloadDir(d);
+    if (ret == 0)
+        ret = SimpleFS_mkDirLocked(d, dirname, 1);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+int SimpleFS_mkDirTree(DirectoryHandle* d, char* dirname) {
+    STATS_TIME(STATS_SFS_MKDIR_TREE);
+
+    pthread_rwlock_t* lock = SimpleFS_dirLock(d->sfs, d->dcb->header.block_in_disk);
+    pthread_rwlock_wrlock(lock);
+    int ret = SimpleFS_reloadDir(d);
+    if (ret == 0)
+        ret = SimpleFS_mkDirLocked(d, dirname, SFS_DIR_TREE);
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+int SimpleFS_remove(DirectoryHandle* d, char* filename) {
+    STATS_TIME(STATS_SFS_REMOVE);
+    return SimpleFS_removeEntries(d, filename, 0);
+}
+
+int64_t SimpleFS_lookupPath(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_LOOKUP_PATH);
+
+    if (path == NULL || *path == 0)
+        return -1;
+
+    int64_t current = *path == '/' ? 0 : d->dcb->header.block_in_disk;
+    int is_dir = 1;
+    char name[128];
+    int ret;
+
+    while ((ret = SimpleFS_nextComponent(&path, name)) == 1) {
+        if (!is_dir) {
+            if (DEBUG) printf("[SFS - lookupPath] Not a directory.\n");
+            return -1;
+        }
+        if (strcmp(name, ".") == 0)
+            continue;
+
+        current = SimpleFS_lookupEntry(d->sfs, current, name, &is_dir);
+        if (current == -1) {
+            if (DEBUG) printf("[SFS - lookupPath] No such file or directory.\n");
+            return -1;
+        }
+    }
+    return ret == -1 ? -1 : current;
+}
+
+FileHandle* SimpleFS_openFilePath(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_OPEN_FILE_PATH);
+
+    DirectoryHandle parent;
+    char name[128];
+    if (SimpleFS_openParent(d, path, &parent, name) == -1)
+        return NULL;
+
+    FileHandle* fh = SimpleFS_openFile(&parent, name);
+    SimpleFS_releaseParent(d, &parent);
+    return fh;
+}
+
+int SimpleFS_createFilePath(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_CREATE_FILE_PATH);
+
+    DirectoryHandle parent;
+    char name[128];
+    if (SimpleFS_openParent(d, path, &parent, name) == -1)
+        return -1;
+
+    int ret = SimpleFS_createFile(&parent, name);
+    SimpleFS_releaseParent(d, &parent);
+    return ret;
+}
+
+int SimpleFS_removeTree(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_REMOVE_TREE);
+
+    DirectoryHandle parent;
+    char name[128];
+    if (SimpleFS_openParent(d, path, &parent, name) == -1)
+        return -1;
+
+    int ret = SimpleFS_removeEntries(&parent, name, 1);
+    SimpleFS_releaseParent(d, &parent);
+    return ret;
+}
+
+int SimpleFS_removePath(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_REMOVE_PATH);
+
+    DirectoryHandle parent;
+    char name[128];
+    if (SimpleFS_openParent(d, path, &parent, name) == -1)
+        return -1;
+
+    int ret = SimpleFS_remove(&parent, name);
+    SimpleFS_releaseParent(d, &parent);
+    return ret;
+}
+// lists the directories and the files below first_block breadth first, each
+// directory read under its read lock. The parent of every file goes in parents
+static int SimpleFS_walkTree(SimpleFS* fs, int64_t first_block, BlockList* dirs,
+                             BlockList* files, BlockList* parents) {
+
+    FirstFileBlock ffb;
+    int ret = Pack_readEntry(fs->disk, &ffb, first_block);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - walkTree] Cannot read from disk.\n");
+        return -1;
+    }
+    if (ffb.fcb.is_dir == 0) {
+        BlockList_push(files, first_block);
+        BlockList_push(parents, ffb.fcb.directory_block);
+        return 0;
+    }
+    BlockList_push(dirs, first_block);
+
+    BlockList entries = {0};
+    int next_dir, idx;
+    for (next_dir = 0; ret == 0 && next_dir < dirs->num; next_dir++) {
+        int64_t dir_block = dirs->blocks[next_dir];
+        pthread_rwlock_t* lock = SimpleFS_dirLock(fs, dir_block);
+        pthread_rwlock_rdlock(lock);
+        entries.num = 0;
+        ret = SimpleFS_listEntries(fs, dir_block, &entries);
+        for (idx = 0; ret == 0 && idx < entries.num; idx++) {
+            ret = Pack_readEntry(fs->disk, &ffb, entries.blocks[idx]);
+            if (ret == 0 && ffb.fcb.is_dir) {
+                BlockList_push(dirs, entries.blocks[idx]);
+            }
+            else if (ret == 0) {
+                BlockList_push(files, entries.blocks[idx]);
+                BlockList_push(parents, dir_block);
+            }
+        }
+        pthread_rwlock_unlock(lock);
+    }
+    if (ret == -1)
+        if (DEBUG) printf("[SFS - walkTree] Cannot read the tree.\n");
+    free(entries.blocks);
+    return ret;
+}
+
+// adds to frag the blocks and the extents of the chain starting at first_block,
+// pushing its blocks in chain if it isn't NULL. The walk is bounded by the
+// size of the disk, a chain changed meanwhile can't make it loop.
+// A packed file counts as a file of one block, and has no chain
+static int SimpleFS_readChain(SimpleFS* fs, int64_t first_block, BlockList* chain,
+                              SimpleFSFragmentation* frag) {
+
+    if (PACK_IS_REF(first_block)) {
+        frag->files += 1;
+        frag->blocks += 1;
+        frag->extents += 1;
+        return 0;
+    }
+
+    FileBlock fb;
+    int64_t block_num = first_block;
+    int64_t previous = -2;
+    int64_t steps = 0;
+    while (block_num != -1 && steps++ < fs->disk->header->num_blocks) {
+        int ret = DiskDriver_readBlock(fs->disk, &fb, block_num);
+        if (ret == -1) {
+            if (DEBUG) printf("[SFS - readChain] Cannot read from disk.\n");
+            return -1;
+        }
+        if (chain != NULL)
+            BlockList_push(chain, block_num);
+        frag->blocks += 1;
+        if (block_num != previous + 1)
+            frag->extents += 1;
+        previous = block_num;
+        block_num = fb.header.next_block;
+    }
+    frag->files += 1;
+    return 0;
+}
+
+// number of runs of free blocks on the disk
+static int64_t SimpleFS_freeExtents(DiskDriver* disk) {
+
+    BitMap bmap = {
+        .num_bits = disk->header->num_blocks,
+        .entries = disk->bitmap_data
+    };
+    int64_t runs = 0;
+    int64_t pos = BitMap_get(&bmap, 0, 0);
+    while (pos != -1) {
+        runs++;
+        pos = BitMap_get(&bmap, pos, 1);
+        if (pos != -1)
+            pos = BitMap_get(&bmap, pos, 0);
+    }
+    return runs;
+}
 
-        FileBlock new_block = {0};
-        new_block.header.previous_block = f->current_block->block_in_disk;
-        new_block.header.next_block = -1;
-        new_block.header.block_in_file = f->current_block->block_in_file + 1;
-        new_block.header.block_in_disk = free_block;
-        
-        f->current_block->next_block = free_block;
+int SimpleFS_fragmentation(DirectoryHandle* d, const char* path, SimpleFSFragmentation* frag) {
+    STATS_TIME(STATS_SFS_FRAGMENTATION);
 
-        ret = DiskDriver_writeBlock(f->sfs->disk, &new_block, free_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - write] Cannot write on disk.\n");
-            return -1; 
-        }
+    SimpleFS* fs = d->sfs;
+    memset(frag, 0, sizeof(SimpleFSFragmentation));
+    int64_t first_block = SimpleFS_lookupPath(d, path);
+    if (first_block == -1)
+        return -1;
 
-        int written = SimpleFS_write(f, data, size);
-        if (written == -1)
-            return -1;
-        return written;
+    BlockList dirs = {0}, files = {0}, parents = {0};
+    int ret = SimpleFS_walkTree(fs, first_block, &dirs, &files, &parents);
+    int idx;
+    for (idx = 0; ret == 0 && idx < files.num; idx++) {
+        // a file removed after the walk is left out
+        SimpleFSFragmentation file = {0};
+        if (SimpleFS_readChain(fs, files.blocks[idx], NULL, &file) == 0) {
+            frag->files += file.files;
+            frag->blocks += file.blocks;
+            frag->extents += file.extents;
+        }
     }
+    free(dirs.blocks);
+    free(files.blocks);
+    free(parents.blocks);
+    if (ret == -1)
+        return -1;
+
+    frag->free_extents = SimpleFS_freeExtents(fs->disk);
+    if (frag->blocks > frag->files)
+        frag->score = (double) (frag->extents - frag->files) / (double) (frag->blocks - frag->files);
+    return 0;
 }
 
-int SimpleFS_read(FileHandle* f, void* data, int size) {
+// makes the entry first_block of the directory fdb point to block_num,
+// where the first block was moved. The caller holds the write lock of fdb
+static int SimpleFS_pointEntry(SimpleFS* fs, FirstDirectoryBlock* fdb, FirstFileBlock* ffb,
+                               int64_t first_block, int64_t block_num) {
 
-    int readable_bytes, ret;
+    if (fdb->fcb.is_dir == SFS_DIR_TREE)
+        return DirTree_relocate(fs->disk, fdb, ffb->fcb.name, block_num);
 
-    if (f->current_block->block_in_file == 0) 
-        readable_bytes = max_data_ffb - f->pos_in_file;
-    else 
-        readable_bytes = max_data_fb - ((f->pos_in_file - max_data_ffb) % max_data_fb);
+    DirectoryBlock db;
+    int idx = SimpleFS_entryIndex(fs, fdb, first_block, ffb->fcb.idx_in_directory);
+    int64_t* slot = idx == -1 ? NULL : SimpleFS_entrySlot(fs, fdb, idx, &db);
+    if (slot == NULL)
+        return -1;
+    *slot = block_num;
+    if (idx < max_entries_fdb)
+        return DiskDriver_writeBlock(fs->disk, fdb, fdb->header.block_in_disk);
+    return DiskDriver_writeBlock(fs->disk, &db, db.header.block_in_disk);
+}
 
-    if (size <= readable_bytes) {
-        if (f->current_block->block_in_file == 0) 
-            memcpy(data, f->fcb->data, size);
-        else
-            memcpy(data, ((FileBlock*) f->current_block)->data, size);
+// moves the chain of the file first_block, an entry of dir_block, into a run
+// of free blocks. The caller holds the write lock of dir_block, so the file
+// can't be opened meanwhile. Returns 1 if the file was moved, 0 if it was left
+static int SimpleFS_relocateLocked(SimpleFS* fs, int64_t dir_block, int64_t first_block) {
 
-        f->pos_in_file += size;
-        return size;
+    // a packed file has no chain to move
+    if (PACK_IS_REF(first_block))
+        return 0;
+
+    FirstDirectoryBlock fdb;
+    FirstFileBlock ffb;
+    if (DiskDriver_readBlock(fs->disk, &fdb, dir_block) == -1 ||
+            DiskDriver_readBlock(fs->disk, &ffb, first_block) == -1) {
+        if (DEBUG) printf("[SFS - defrag] Cannot read from disk.\n");
+        return -1;
     }
-    else {
-        if (f->current_block->block_in_file == 0) 
-            memcpy(data, f->fcb->data, readable_bytes);
-        else
-            memcpy(data, ((FileBlock*) f->current_block)->data, readable_bytes);
-        f->pos_in_file += readable_bytes;
 
-        if (f->current_block->next_block != -1) {     
+    // the file may have been removed since the tree was walked
+    if (ffb.fcb.is_dir || ffb.fcb.directory_block != dir_block || ffb.header.block_in_file != 0)
+        return 0;
+    if (fdb.fcb.is_dir == SFS_DIR_TREE ?
+            DirTree_lookup(fs->disk, &fdb, ffb.fcb.name) != first_block :
+            SimpleFS_entryIndex(fs, &fdb, first_block, ffb.fcb.idx_in_directory) == -1)
+        return 0;
 
-            FileBlock* next = calloc(1, sizeof(FileBlock));
-            ret = DiskDriver_readBlock(f->sfs->disk, next, f->current_block->next_block);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - read] Cannot read from disk.\n");
-                return -1; 
-            }
+    // handles keep the block numbers of the chain
+    pthread_mutex_lock(&fs->table_lock);
+    int open = SimpleFS_findOpenFile(fs, first_block) != NULL;
+    pthread_mutex_unlock(&fs->table_lock);
+    if (open)
+        return 0;
 
-            if (f->current_block != (BlockHeader*) f->fcb)
-                free(f->current_block);
-            
-            f->current_block = &next->header;
+    BlockList chain = {0};
+    SimpleFSFragmentation frag = {0};
+    if (SimpleFS_readChain(fs, first_block, &chain, &frag) == -1 || frag.extents == 1) {
+        free(chain.blocks);
+        return frag.extents == 1 ? 0 : -1;
+    }
 
-            int read = SimpleFS_read(f, data + readable_bytes, size - readable_bytes);
-            if (read == -1)
-                return -1;
-            return readable_bytes + read;
-        }
-        else {
-            return readable_bytes;
-        }
+    int count = chain.num;
+    int64_t* blocks = malloc(count * sizeof(int64_t));
+    int idx, extents = 1;
+    int ret = SimpleFS_pickBlocks(fs->disk, 0, count, blocks);
+    for (idx = 1; ret == 0 && idx < count; idx++) {
+        if (blocks[idx] != blocks[idx - 1] + 1)
+            extents += 1;
     }
-}
-int SimpleFS_changeDir(DirectoryHandle* d, char* dirname) {
-    
-    if (strcmp(d->dcb->fcb.name, dirname) == 0)
+    if (ret == -1 || extents >= frag.extents) {
+        if (ret == 0)
+            DiskDriver_freeBlocks(fs->disk, blocks, count);
+        free(blocks);
+        free(chain.blocks);
         return 0;
+    }
 
-    if (strcmp(dirname, ".") == 0) 
-        return 0;
+    // the new chain is complete on disk before the directory points to it
+    FileBlock fb;
+    for (idx = 0; ret == 0 && idx < count; idx++) {
+        ret = DiskDriver_readBlock(fs->disk, &fb, chain.blocks[idx]);
+        fb.header.previous_block = idx > 0 ? blocks[idx - 1] : -1;
+        fb.header.next_block = idx + 1 < count ? blocks[idx + 1] : -1;
+        fb.header.block_in_disk = blocks[idx];
+        if (ret == 0)
+            ret = DiskDriver_writeBlock(fs->disk, &fb, blocks[idx]);
+    }
+    if (ret == 0)
+        ret = SimpleFS_pointEntry(fs, &fdb, &ffb, first_block, blocks[0]);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - defrag] Cannot move the file.\n");
+        DiskDriver_freeBlocks(fs->disk, blocks, count);
+    }
+    else {
+        DentryCache_insert(&fs->dcache, dir_block, ffb.fcb.name, blocks[0], 0);
+        ret = DiskDriver_freeBlocks(fs->disk, chain.blocks, count) == -1 ? -1 : 1;
+    }
+    free(blocks);
+    free(chain.blocks);
+    return ret;
+}
 
-    if (strcmp(dirname, "..") == 0) {
-        if (strcmp(d->dcb->fcb.name, "/") == 0)
-            return 0;
+int SimpleFS_defrag(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_DEFRAG);
 
-        free(d->dcb);
-        d->dcb = d->directory;
-        d->directory = NULL;
-        d->current_block = &d->dcb->header;
-        d->pos_in_dir = 0;
-        d->pos_in_block = 0;
-        
-        int parent_block = d->dcb->fcb.directory_block;
-        if (parent_block != -1) {
-            FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
-            int ret = DiskDriver_readBlock(d->sfs->disk, fdb, parent_block);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
-                free(fdb);
-                return -1;
-            }
+    SimpleFS* fs = d->sfs;
+    int64_t first_block = SimpleFS_lookupPath(d, path);
+    if (first_block == -1)
+        return -1;
 
-            d->directory = fdb;
-        }
+    BlockList dirs = {0}, files = {0}, parents = {0};
+    int ret = SimpleFS_walkTree(fs, first_block, &dirs, &files, &parents);
+    int moved = 0;
+    int idx;
+    for (idx = 0; ret != -1 && idx < files.num; idx++) {
+        pthread_rwlock_t* lock = SimpleFS_dirLock(fs, parents.blocks[idx]);
+        pthread_rwlock_wrlock(lock);
+        ret = SimpleFS_relocateLocked(fs, parents.blocks[idx], files.blocks[idx]);
+        pthread_rwlock_unlock(lock);
+        if (ret == 1)
+            moved += 1;
+    }
+    free(dirs.blocks);
+    free(files.blocks);
+    free(parents.blocks);
+    return ret == -1 ? -1 : moved;
+}
+
+// moves the small file first_block, an entry of dir_block, into the pack
+// block *pack_block of the directory, or into a new one stored in *pack_block
+// when it is full or no longer a pack of the directory. The caller holds the
+// write lock of dir_block, so the file can't be opened meanwhile.
+// Returns 1 if the file was packed, 0 if it was left
+static int SimpleFS_packLocked(SimpleFS* fs, int64_t dir_block, int64_t first_block, int64_t* pack_block) {
 
+    if (PACK_IS_REF(first_block))
         return 0;
+
+    FirstDirectoryBlock fdb;
+    FirstFileBlock ffb;
+    if (DiskDriver_readBlock(fs->disk, &fdb, dir_block) == -1 ||
+            DiskDriver_readBlock(fs->disk, &ffb, first_block) == -1) {
+        if (DEBUG) printf("[SFS - pack] Cannot read from disk.\n");
+        return -1;
     }
 
-    if (strcmp(dirname, "/") == 0) {
-        free(d->dcb);    
-        free(d->directory);   
+    // the file may have been removed or grown since the tree was walked
+    if (ffb.fcb.is_dir || ffb.fcb.directory_block != dir_block || ffb.header.block_in_file != 0 ||
+            !Pack_fits(&ffb))
+        return 0;
+    if (fdb.fcb.is_dir == SFS_DIR_TREE ?
+            DirTree_lookup(fs->disk, &fdb, ffb.fcb.name) != first_block :
+            SimpleFS_entryIndex(fs, &fdb, first_block, ffb.fcb.idx_in_directory) == -1)
+        return 0;
 
-        d->directory = NULL;
+    // handles keep the first block of the file
+    pthread_mutex_lock(&fs->table_lock);
+    int open = SimpleFS_findOpenFile(fs, first_block) != NULL;
+    pthread_mutex_unlock(&fs->table_lock);
+    if (open)
+        return 0;
 
-        FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
-        int ret = DiskDriver_readBlock(d->sfs->disk, fdb, 0);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
-            free(fdb);
+    PackBlock pack;
+    int slot = -1;
+    if (*pack_block != -1 && Pack_load(fs->disk, &pack, *pack_block, dir_block) == 0)
+        slot = Pack_add(&pack, &ffb);
+    if (slot == -1) {
+        int64_t block_num = DiskDriver_allocBlock(fs->disk, dir_block);
+        if (block_num == -1) {
+            if (DEBUG) printf("[SFS - pack] Disk is full.\n");
             return -1;
         }
+        Pack_init(&pack, block_num, dir_block);
+        slot = Pack_add(&pack, &ffb);
+        *pack_block = block_num;
+    }
 
-        d->dcb = fdb;
-        d->current_block = &fdb->header;
-        d->pos_in_dir = 0;
-        d->pos_in_block = 0;
-
-        return 0;
+    // the pack is complete on disk before the directory points to it
+    int64_t ref = PACK_REF(*pack_block, slot);
+    int ret = DiskDriver_writeBlock(fs->disk, &pack, *pack_block);
+    if (ret == 0)
+        ret = SimpleFS_pointEntry(fs, &fdb, &ffb, first_block, ref);
+    if (ret == -1) {
+        if (DEBUG) printf("[SFS - pack] Cannot pack the file.\n");
+        Pack_remove(fs->disk, ref);
+        return -1;
     }
+    DentryCache_insert(&fs->dcache, dir_block, ffb.fcb.name, ref, 0);
+    return DiskDriver_freeBlock(fs->disk, first_block) == -1 ? -1 : 1;
+}
 
-    int dir_block;
-    if ((dir_block = SimpleFS_exists(d, dirname))) {
-        if (d->directory != NULL)
-            free(d->directory);
-        d->directory = d->dcb;
+int SimpleFS_pack(DirectoryHandle* d, const char* path) {
+    STATS_TIME(STATS_SFS_PACK);
 
-        FirstDirectoryBlock* fdb = calloc(1, sizeof(FirstDirectoryBlock));
-        int ret = DiskDriver_readBlock(d->sfs->disk, fdb, dir_block);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - changeDir] Cannot read from disk.\n");
-            free(fdb);
-            return -1;
-        }
+    SimpleFS* fs = d->sfs;
+    int64_t first_block = SimpleFS_lookupPath(d, path);
+    if (first_block == -1)
+        return -1;
 
-        if (fdb->fcb.is_dir == 0) {
-            free(fdb);
-            if (DEBUG) printf("[SFS - changeDir] Given dirname is not a directory.\n");
-            return -1;
+    BlockList dirs = {0}, files = {0}, parents = {0};
+    int ret = SimpleFS_walkTree(fs, first_block, &dirs, &files, &parents);
+    int packed = 0;
+    int64_t pack_block = -1;
+    int idx;
+    for (idx = 0; ret != -1 && idx < files.num; idx++) {
+        // the files of a directory are listed together: they fill the pack
+        // started for the first of them, or one packed by an earlier run
+        if (idx > 0 && parents.blocks[idx] != parents.blocks[idx - 1])
+            pack_block = -1;
+        if (PACK_IS_REF(files.blocks[idx])) {
+            if (pack_block == -1)
+                pack_block = PACK_BLOCK(files.blocks[idx]);
+            continue;
         }
+        pthread_rwlock_t* lock = SimpleFS_dirLock(fs, parents.blocks[idx]);
+        pthread_rwlock_wrlock(lock);
+        ret = SimpleFS_packLocked(fs, parents.blocks[idx], files.blocks[idx], &pack_block);
+        pthread_rwlock_unlock(lock);
+        if (ret == 1)
+            packed += 1;
+    }
+    free(dirs.blocks);
+    free(files.blocks);
+    free(parents.blocks);
+    return ret == -1 ? -1 : packed;
+}
 
-        d->dcb = fdb;
-        d->current_block = &fdb->header;
-        d->pos_in_dir = 0;
-        d->pos_in_block = 0;
+// gives the packed file of f a first block of its own before it is changed,
+// see pack.h. The directory is locked before the open file table and the
+// file, as everywhere; the shared copy of the first block takes the new
+// block number, which is also its key in the table
+static int SimpleFS_unpack(FileHandle* f) {
 
+    SimpleFS* fs = f->sfs;
+    FirstFileBlock* ffb = f->fcb;
+    if (!PACK_IS_REF(__atomic_load_n(&ffb->header.block_in_disk, __ATOMIC_ACQUIRE)))
         return 0;
+
+    // an open file isn't removed, so its directory stays
+    int64_t dir_block = ffb->fcb.directory_block;
+    pthread_rwlock_t* lock = SimpleFS_dirLock(fs, dir_block);
+    pthread_rwlock_wrlock(lock);
+    pthread_mutex_lock(&fs->table_lock);
+    pthread_rwlock_wrlock(&f->entry->lock);
+
+    // another handle of the file may have done it meanwhile
+    int ret = 0;
+    int64_t ref = ffb->header.block_in_disk;
+    if (PACK_IS_REF(ref)) {
+        FirstDirectoryBlock fdb;
+        FirstFileBlock copy = *ffb;
+        int64_t block_num = DiskDriver_allocBlock(fs->disk, PACK_BLOCK(ref));
+        ret = block_num == -1 ? -1 : DiskDriver_readBlock(fs->disk, &fdb, dir_block);
+        if (ret == 0) {
+            copy.header.block_in_disk = block_num;
+            copy.fcb.block_in_disk = block_num;
+            ret = DiskDriver_writeBlock(fs->disk, &copy, block_num);
+        }
+        if (ret == 0)
+            ret = SimpleFS_pointEntry(fs, &fdb, ffb, ref, block_num);
+        if (ret == 0) {
+            // the first block is the key of the entry, which changes bucket
+            SimpleFS_unlinkOpenFile(fs, f->entry);
+            __atomic_store_n(&ffb->header.block_in_disk, block_num, __ATOMIC_RELEASE);
+            SimpleFS_linkOpenFile(fs, f->entry);
+            ffb->fcb.block_in_disk = block_num;
+            DentryCache_insert(&fs->dcache, dir_block, ffb->fcb.name, block_num, 0);
+            ret = Pack_remove(fs->disk, ref);
+        }
+        else if (block_num != -1) {
+            DiskDriver_freeBlock(fs->disk, block_num);
+        }
+        if (ret == -1)
+            if (DEBUG) printf("[SFS - unpack] Cannot move the file out of its pack.\n");
     }
 
-    if (DEBUG) printf("[SFS - changeDir] Directory doesn't exists.\n");
-    return -1;
+    pthread_rwlock_unlock(&f->entry->lock);
+    pthread_mutex_unlock(&fs->table_lock);
+    pthread_rwlock_unlock(lock);
+    return ret;
 }
-int SimpleFS_mkDir(DirectoryHandle* d, char* dirname) {
-
-    if (SimpleFS_exists(d, dirname)) {
-        if (DEBUG) printf("[SFS - mkDir] Directory already exists.\n");
-        return -1;
-    }
 
-    int max_entries_fdb = (BLOCK_SIZE - sizeof(BlockHeader) -
-                           sizeof(FileControlBlock) - sizeof(int)) / sizeof(int);
-    int max_entries_db = (BLOCK_SIZE - sizeof(BlockHeader)) / sizeof(int);
+#define SFS_COPY_BUFFER (1 << 20)  // bytes read from the host by each step of SimpleFS_importFile
+#define SFS_COPY_IOV    256        // blocks written to the host by each writev of SimpleFS_exportFile
 
-    FirstDirectoryBlock* fdb = d->dcb;
+// joins a directory and a name into a new string
+static char* SimpleFS_joinPath(const char* dir, const char* name) {
+    size_t len = strlen(dir);
+    char* path = malloc(len + strlen(name) + 2);
+    sprintf(path, len > 0 && dir[len - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
 
-    int ret;
-    int free_block = DiskDriver_getFreeBlock(d->sfs->disk, 0);
-    if (free_block == -1) {
-        if (DEBUG) printf("[SFS - mkDir] No free block.\n");
+// copies the host file open on fd into the file at path, created or emptied
+// first. The blocks are reserved in one go, the data passes through buf
+// Returns the bytes copied, -1 on error
+static int64_t SimpleFS_importData(DirectoryHandle* d, int fd, int64_t size,
+                                   const char* path, char* buf) {
+
+    FileHandle* f = SimpleFS_openFilePath(d, path);
+    if (f == NULL && SimpleFS_createFilePath(d, path) == 0)
+        f = SimpleFS_openFilePath(d, path);
+    if (f == NULL) {
+        if (DEBUG) printf("[SFS - importFile] Cannot create %s.\n", path);
         return -1;
     }
 
-    FirstDirectoryBlock new_fdb = {0};
-    new_fdb.header.previous_block = -1;
-    new_fdb.header.next_block = -1;
-    new_fdb.header.block_in_file = 0;
-    new_fdb.header.block_in_disk = free_block;
-
-    new_fdb.fcb.directory_block = fdb->header.block_in_disk;
-    new_fdb.fcb.size_in_bytes = BLOCK_SIZE;
-    new_fdb.fcb.size_in_blocks = 1;
-    new_fdb.fcb.is_dir = 1;
-    new_fdb.fcb.idx_in_directory = fdb->num_entries;
-    strncpy(new_fdb.fcb.name, dirname, 128);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int ret = SimpleFS_truncate(f, 0);
+    if (ret == 0)
+        ret = SimpleFS_reserve(f, size);
+    if (ret == 0)
+        ret = SimpleFS_setWriteBack(f, 1);
+
+    int64_t done = 0;
+    while (ret == 0) {
+        ssize_t num = read(fd, buf, SFS_COPY_BUFFER);
+        if (num == -1 && errno == EINTR)
+            continue;
+        if (num <= 0) {
+            ret = (int) num;
+            break;
+        }
+        if (SimpleFS_write(f, buf, (int) num) != num)
+            ret = -1;
+        done += num;
+    }
+    if (ret == 0)
+        ret = SimpleFS_flush(f);
+    SimpleFS_closeFile(f);
+    return ret == -1 ? -1 : done;
+}
 
-    new_fdb.num_entries = 0;
+static int64_t SimpleFS_importPath(DirectoryHandle* d, const char* host_path,
+                                   const char* path, char* buf) {
 
-    ret = DiskDriver_writeBlock(d->sfs->disk, &new_fdb, free_block);
-    if (ret == -1) {            
-        if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
+    int fd = open(host_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (DEBUG) printf("[SFS - importFile] Cannot open %s.\n", host_path);
+        if (fd != -1)
+            close(fd);
         return -1;
     }
+    if (S_ISREG(st.st_mode)) {
+        int64_t ret = SimpleFS_importData(d, fd, st.st_size, path, buf);
+        close(fd);
+        return ret;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        // devices, pipes and sockets have no data to keep
+        close(fd);
+        return 0;
+    }
 
-    if (fdb->num_entries < max_entries_fdb) {
-        fdb->file_blocks[fdb->num_entries] = free_block;
-        fdb->num_entries += 1;
-        
-        ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
-            return -1; 
+    DIR* dir = fdopendir(fd);
+    DirectoryHandle* sub = SimpleFS_openDir(d, path);
+    if (sub == NULL) {
+        DirectoryHandle parent;
+        char name[128];
+        if (SimpleFS_openParent(d, path, &parent, name) == 0) {
+            if (SimpleFS_mkDir(&parent, name) == 0)
+                sub = SimpleFS_openDir(d, path);
+            SimpleFS_releaseParent(d, &parent);
         }
     }
-    else {
-        int entries = fdb->num_entries - max_entries_fdb;
-        if (entries == 0 || entries % max_entries_db == 0) {
-            int block_free_block = DiskDriver_getFreeBlock(d->sfs->disk, 0);
-            if (block_free_block == -1) {
-                if (DEBUG) printf("[SFS - mkDir] No free block.\n");
-                return -1;
-            }
-
-            DirectoryBlock new_block = {0};
-            new_block.header.next_block = -1;
-            new_block.header.block_in_disk = block_free_block;
+    if (dir == NULL || sub == NULL) {
+        if (DEBUG) printf("[SFS - importFile] Cannot copy the directory %s.\n", host_path);
+        if (dir != NULL)
+            closedir(dir);
+        else
+            close(fd);
+        if (sub != NULL)
+            SimpleFS_closeDir(sub);
+        return -1;
+    }
 
-            if (entries == 0) {
-                new_block.header.block_in_file = fdb->header.block_in_file + 1;
-                new_block.header.previous_block = fdb->header.block_in_disk;
-                new_block.file_blocks[0] = free_block;
-                fdb->header.next_block = block_free_block;
-            }
-            else {
-                DirectoryBlock last_block;
-                ret = DiskDriver_readBlock(d->sfs->disk, &last_block, fdb->header.next_block);
-                if (ret == -1) {
-                    if (DEBUG) printf("[SFS - mkDir] Cannot read from disk.\n");
-                    return -1;
-                }
-                while (last_block.header.next_block != -1) {
-                    ret = DiskDriver_readBlock(d->sfs->disk, &last_block, last_block.header.next_block);
-                    if (ret == -1) {
-                        if (DEBUG) printf("[SFS - mkDir] Cannot read from disk.\n");
-                        return -1;
-                    }
-                }
+    int64_t done = 0;
+    struct dirent* ent;
+    while (done != -1 && (ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        char* child = SimpleFS_joinPath(host_path, ent->d_name);
+        int64_t ret = SimpleFS_importPath(sub, child, ent->d_name, buf);
+        done = ret == -1 ? -1 : done + ret;
+        free(child);
+    }
+    closedir(dir);
+    SimpleFS_closeDir(sub);
+    return done;
+}
 
-                new_block.header.block_in_file = last_block.header.block_in_file + 1;
-                new_block.header.previous_block = last_block.header.block_in_disk;
-                new_block.file_blocks[0] = free_block;
-                last_block.header.next_block = block_free_block;
+int64_t SimpleFS_importFile(DirectoryHandle* d, const char* host_path, const char* path) {
+    STATS_TIME(STATS_SFS_IMPORT_FILE);
 
-                ret = DiskDriver_writeBlock(d->sfs->disk, &last_block, last_block.header.block_in_disk);
-                if (ret == -1) {
-                    if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
-                    return -1; 
-                }
-            }
-            ret = DiskDriver_writeBlock(d->sfs->disk, &new_block, new_block.header.block_in_disk);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
-                return -1; 
-            }
-        }
-        else {
-            DirectoryBlock db;
-            ret = DiskDriver_readBlock(d->sfs->disk, &db, fdb->header.next_block);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - mkDir] Cannot read from disk.\n");
-                return -1;
-            }
-            while (db.header.next_block != -1) {
-                ret = DiskDriver_readBlock(d->sfs->disk, &db, db.header.next_block);
-                if (ret == -1) {
-                    if (DEBUG) printf("[SFS - mkDir] Cannot read from disk.\n");
-                    return -1;
-                }
-            }
+    char* buf = malloc(SFS_COPY_BUFFER);
+    int64_t ret = SimpleFS_importPath(d, host_path, path, buf);
+    free(buf);
+    STATS_BYTES(STATS_SFS_IMPORT_FILE, ret);
+    return ret;
+}
 
-            db.file_blocks[entries % max_entries_db] = free_block;
-            ret = DiskDriver_writeBlock(d->sfs->disk, &db, db.header.block_in_disk);
-            if (ret == -1) {
-                if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
-                return -1; 
-            }
+// writes the iovs to fd, going on after the short writes
+static int SimpleFS_writeAll(int fd, struct iovec* iov, int num) {
+    while (num > 0) {
+        ssize_t written = writev(fd, iov, num);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        while (num > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            num--;
         }
-        fdb->num_entries += 1;
-        fdb->fcb.size_in_bytes += BLOCK_SIZE;
-        fdb->fcb.size_in_blocks += 1;
-
-        ret = DiskDriver_writeBlock(d->sfs->disk, fdb, fdb->header.block_in_disk);
-        if (ret == -1) {
-            if (DEBUG) printf("[SFS - mkDir] Cannot write on disk.\n");
-            return -1; 
+        if (num > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
         }
     }
     return 0;
 }
 
-int SimpleFS_remove(DirectoryHandle* d, char* filename) {
-
-    int first_block;
-    if ((first_block = SimpleFS_exists(d, filename)) == 0) {
-        if (DEBUG) printf("[SFS - remove] File/Dir doesn't exists.\n");
-        return -1;
+// writes the data of the file to fd straight from the blocks mapped by the
+// disk, SFS_COPY_IOV blocks per system call: the data of a block follows its
+// header, so the file is never contiguous in the image. The caller holds
+// the lock of the file, shared is enough. Returns the bytes written, -1 on error
+static int64_t SimpleFS_exportData(FileHandle* f, int fd) {
+
+    FirstFileBlock* ffb = f->fcb;
+    int64_t size = ffb->fcb.size_in_bytes;
+    struct iovec iov[SFS_COPY_IOV];
+    iov[0].iov_base = ffb->data;
+    iov[0].iov_len = size < max_data_ffb ? (size_t) size : (size_t) max_data_ffb;
+    int num = 1;
+    int64_t queued = (int64_t) iov[0].iov_len;
+    int64_t block_num = ffb->header.next_block;
+
+    while (1) {
+        if (num == SFS_COPY_IOV || queued == size) {
+            if (SimpleFS_writeAll(fd, iov, num) == -1)
+                return -1;
+            num = 0;
+            if (queued == size)
+                return size;
+        }
+        FileBlock* fb = block_num == -1 ? NULL : DiskDriver_mapBlock(f->sfs->disk, block_num);
+        if (fb == NULL) {
+            if (DEBUG) printf("[SFS - exportFile] Chain shorter than the file.\n");
+            return -1;
+        }
+        iov[num].iov_base = fb->data;
+        iov[num].iov_len = size - queued < max_data_fb ? (size_t) (size - queued) : (size_t) max_data_fb;
+        queued += (int64_t) iov[num].iov_len;
+        num++;
+        block_num = fb->header.next_block;
     }
+}
 
-    int ret;
+static int64_t SimpleFS_exportPath(DirectoryHandle* d, const char* path, const char* host_path) {
 
-    void* block = calloc(1, BLOCK_SIZE);
-    ret = DiskDriver_readBlock(d->sfs->disk, block, first_block);
-    if (ret == -1) {
-        if (DEBUG) printf("[SFS - remove] Cannot read from disk.\n");
-        return -1; 
+    DirectoryHandle* sub = SimpleFS_openDir(d, path);
+    if (sub == NULL) {
+        FileHandle* f = SimpleFS_openFilePath(d, path);
+        if (f == NULL) {
+            if (DEBUG) printf("[SFS - exportFile] Cannot open %s.\n", path);
+            return -1;
+        }
+        int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int64_t ret = -1;
+        if (fd != -1 && SimpleFS_lockShared(f) == 0) {
+            ret = SimpleFS_exportData(f, fd);
+            pthread_rwlock_unlock(&f->entry->lock);
+        }
+        if (fd != -1 && close(fd) == -1)
+            ret = -1;
+        SimpleFS_closeFile(f);
+        return ret;
     }
 
-    if (((FirstFileBlock*) block)->fcb.is_dir == 0) {
-        ret = SimpleFS_removeFile(d, (FirstFileBlock*) block);
-    }
-    else if (((FirstDirectoryBlock*) block)->num_entries == 0) {
-        ret = SimpleFS_removeDir(d, (FirstDirectoryBlock*) block);
+    int64_t done = 0;
+    if (mkdir(host_path, 0755) == -1 && errno != EEXIST) {
+        if (DEBUG) printf("[SFS - exportFile] Cannot make the directory %s.\n", host_path);
+        done = -1;
     }
-    else {
-        if (DEBUG) printf("[SFS - remove] Directory is not empty.\n");
-        ret = -1;
+    SimpleFSEntry entry;
+    int next;
+    while (done != -1 && (next = SimpleFS_nextEntry(sub, &entry)) != 0) {
+        char* child = next == -1 ? NULL : SimpleFS_joinPath(host_path, entry.name);
+        int64_t ret = next == -1 ? -1 : SimpleFS_exportPath(sub, entry.name, child);
+        done = ret == -1 ? -1 : done + ret;
+        free(child);
     }
+    SimpleFS_closeDir(sub);
+    return done;
+}
 
-    free(block);
+int64_t SimpleFS_exportFile(DirectoryHandle* d, const char* path, const char* host_path) {
+    STATS_TIME(STATS_SFS_EXPORT_FILE);
+
+    int64_t ret = SimpleFS_exportPath(d, path, host_path);
+    STATS_BYTES(STATS_SFS_EXPORT_FILE, ret);
     return ret;
-}
\ No newline at end of file
+}
+
+void SimpleFS_getStats(Stats* stats) {
+    Stats_get(stats);
+}
+
+void SimpleFS_resetStats(void) {
+    Stats_reset();
+}
@@ -0,0 +1,226 @@
+#include <stats.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// the figures of a thread, written only by it
+typedef struct StatsShard {
+    Stats stats;
+    struct StatsShard* next;
+} StatsShard;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatsShard* stats_shards = NULL;   // shards of the running threads
+static Stats stats_gone;                  // sum of the shards of the threads gone
+static Stats stats_baseline;              // sum of all the shards at the last reset
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread StatsShard* stats_local = NULL;
+
+static const char* stats_op_names[STATS_NUM_OPS] = {
+    "SimpleFS_init",
+    "SimpleFS_format",
+    "SimpleFS_createFile",
+    "SimpleFS_createFiles",
+    "SimpleFS_readDir",
+    "SimpleFS_scanDir",
+    "SimpleFS_rewindDir",
+    "SimpleFS_nextEntry",
+    "SimpleFS_walk",
+    "SimpleFS_openFile",
+    "SimpleFS_closeFile",
+    "SimpleFS_openDir",
+    "SimpleFS_closeDir",
+    "SimpleFS_changeDir",
+    "SimpleFS_mkDir",
+    "SimpleFS_mkDirTree",
+    "SimpleFS_remove",
+    "SimpleFS_removeTree",
+    "SimpleFS_lookupPath",
+    "SimpleFS_openFilePath",
+    "SimpleFS_createFilePath",
+    "SimpleFS_removePath",
+    "SimpleFS_read",
+    "SimpleFS_write",
+    "SimpleFS_pread",
+    "SimpleFS_pwrite",
+    "SimpleFS_mapFile",
+    "SimpleFS_unmapFile",
+    "SimpleFS_seek",
+    "SimpleFS_flush",
+    "SimpleFS_setWriteBack",
+    "SimpleFS_reserve",
+    "SimpleFS_truncate",
+    "SimpleFS_fragmentation",
+    "SimpleFS_defrag",
+    "SimpleFS_pack",
+    "SimpleFS_importFile",
+    "SimpleFS_exportFile",
+    "DiskDriver_open",
+    "DiskDriver_readBlock",
+    "DiskDriver_peekBlock",
+    "DiskDriver_mapBlock",
+    "DiskDriver_prefetchBlock",
+    "DiskDriver_contains",
+    "DiskDriver_writeBlock",
+    "DiskDriver_freeBlock",
+    "DiskDriver_freeBlocks",
+    "DiskDriver_getFreeBlock",
+    "DiskDriver_getFreeRun",
+    "DiskDriver_claimBlock",
+    "DiskDriver_allocBlock",
+    "DiskDriver_flush",
+    "DiskDriver_close",
+    "DiskDriver_save",
+    "DiskDriver_clear",
+    "DiskDriver_rebuild",
+    "DiskDriver_print",
+    "DiskDriver_startTrace",
+    "DiskDriver_stopTrace"
+};
+
+static const char* stats_counter_names[STATS_NUM_COUNTERS] = {
+    "blocks read",
+    "blocks written",
+    "blocks allocated",
+    "blocks freed",
+    "bitmap bits scanned"
+};
+
+// adds (sign 1) or subtracts (sign -1) src to dest, field by field
+static void Stats_merge(Stats* dest, Stats* src, int sign) {
+    int64_t* d = (int64_t*) dest;
+    int64_t* s = (int64_t*) src;
+    size_t idx;
+    for (idx = 0; idx < sizeof(Stats) / sizeof(int64_t); idx++)
+        d[idx] += sign * __atomic_load_n(&s[idx], __ATOMIC_RELAXED);
+}
+
+// folds the shard of a thread leaving in stats_gone
+static void Stats_retire(void* arg) {
+    StatsShard* shard = arg;
+    pthread_mutex_lock(&stats_lock);
+    StatsShard** link = &stats_shards;
+    while (*link != shard)
+        link = &(*link)->next;
+    *link = shard->next;
+    Stats_merge(&stats_gone, &shard->stats, 1);
+    pthread_mutex_unlock(&stats_lock);
+    free(shard);
+}
+
+static void Stats_makeKey(void) {
+    pthread_key_create(&stats_key, Stats_retire);
+}
+
+static StatsShard* Stats_shard(void) {
+    if (stats_local != NULL)
+        return stats_local;
+
+    pthread_once(&stats_once, Stats_makeKey);
+    StatsShard* shard = calloc(1, sizeof(StatsShard));
+    pthread_mutex_lock(&stats_lock);
+    shard->next = stats_shards;
+    stats_shards = shard;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, shard);
+    stats_local = shard;
+    return shard;
+}
+
+// only the owner writes a shard: a plain increment, published
+// without tearing to the threads summing it
+static inline void Stats_bump(int64_t* field, int64_t n) {
+    __atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// current time in ns, on the monotonic clock (never 0)
+static uint64_t Stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec + 1;
+}
+
+StatsTimer Stats_start(StatsOpId op) {
+    StatsTimer timer = { op, 0 };
+    if (Stats_shard()->stats.ops[op].calls % STATS_SAMPLE == 0)
+        timer.start = Stats_now();
+    return timer;
+}
+
+void Stats_stop(StatsTimer* timer) {
+    StatsOp* op = &Stats_shard()->stats.ops[timer->op];
+    Stats_bump(&op->calls, 1);
+    if (timer->start == 0)
+        return;
+
+    uint64_t elapsed = Stats_now() - timer->start;
+    int bucket = elapsed == 0 ? 0 : 64 - __builtin_clzll(elapsed);
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    Stats_bump(&op->timed, 1);
+    Stats_bump(&op->total_ns, (int64_t) elapsed);
+    Stats_bump(&op->histogram[bucket], 1);
+}
+
+void Stats_addBytes(StatsOpId op, int64_t bytes) {
+    if (bytes > 0)
+        Stats_bump(&Stats_shard()->stats.ops[op].bytes, bytes);
+}
+
+void Stats_add(StatsCounterId counter, int64_t n) {
+    Stats_bump(&Stats_shard()->stats.counters[counter], n);
+}
+
+// sums all the shards, the caller holds stats_lock
+static void Stats_sum(Stats* stats) {
+    memcpy(stats, &stats_gone, sizeof(Stats));
+    StatsShard* shard;
+    for (shard = stats_shards; shard != NULL; shard = shard->next)
+        Stats_merge(stats, &shard->stats, 1);
+}
+
+void Stats_get(Stats* stats) {
+    pthread_mutex_lock(&stats_lock);
+    Stats_sum(stats);
+    Stats_merge(stats, &stats_baseline, -1);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void Stats_reset(void) {
+    pthread_mutex_lock(&stats_lock);
+    Stats_sum(&stats_baseline);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+const char* Stats_opName(StatsOpId op) {
+    if (op < 0 || op >= STATS_NUM_OPS)
+        return "unknown";
+    return stats_op_names[op];
+}
+
+const char* Stats_counterName(StatsCounterId counter) {
+    if (counter < 0 || counter >= STATS_NUM_COUNTERS)
+        return "unknown";
+    return stats_counter_names[counter];
+}
+
+uint64_t Stats_percentile(const StatsOp* op, double fraction) {
+    if (op->timed <= 0)
+        return 0;
+
+    int64_t wanted = (int64_t) (fraction * (double) op->timed);
+    if (wanted < 1)
+        wanted = 1;
+    int64_t seen = 0;
+    int bucket;
+    for (bucket = 0; bucket < STATS_BUCKETS - 1; bucket++) {
+        seen += op->histogram[bucket];
+        if (seen >= wanted)
+            break;
+    }
+    return (uint64_t) 1 << bucket;
+}
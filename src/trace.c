@@ -0,0 +1,160 @@
+#include <trace.h>
+#include <common.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char* trace_op_names[TRACE_NUM_OPS] = {
+    "read",
+    "write",
+    "alloc",
+    "free",
+    "flush"
+};
+
+static uint64_t Trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// writes to the file the records published since the last drain
+// only the drainer (or Trace_stop, once it is gone) calls it
+static void Trace_drain(Trace* trace) {
+    TraceRecord batch[256];
+    uint64_t tail = trace->tail;
+    while (1) {
+        int num = 0;
+        while (num < 256) {
+            TraceSlot* slot = &trace->ring[tail & (TRACE_RING - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+                break;
+            batch[num++] = slot->rec;
+            tail ++;
+        }
+        if (num == 0)
+            return;
+
+        // the slots are free again once tail moves past them
+        __atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+        // after a short write the file is cut, the rest is only drained
+        if (trace->write_error)
+            continue;
+        size_t written = fwrite(batch, sizeof(TraceRecord), num, trace->file);
+        if (written != (size_t) num) {
+            if (DEBUG) printf("[TR - drain] Cannot write the trace.\n");
+            trace->write_error = 1;
+        }
+        trace->header.records += written;
+    }
+}
+
+static void* Trace_drainer(void* arg) {
+
+    Trace* trace = arg;
+    pthread_mutex_lock(&trace->lock);
+    while (!trace->stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&trace->wake, &trace->lock, &until);
+        pthread_mutex_unlock(&trace->lock);
+        Trace_drain(trace);
+        pthread_mutex_lock(&trace->lock);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+Trace* Trace_start(const char* filename, int64_t num_blocks) {
+
+    Trace* trace = calloc(1, sizeof(Trace));
+    trace->ring = calloc(TRACE_RING, sizeof(TraceSlot));
+    trace->file = fopen(filename, "w");
+    if (trace->ring == NULL || trace->file == NULL) {
+        if (DEBUG) printf("[TR - start] Cannot create %s.\n", filename);
+        if (trace->file != NULL)
+            fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+
+    trace->header.magic = TRACE_MAGIC;
+    trace->header.version = TRACE_VERSION;
+    trace->header.num_blocks = num_blocks;
+    // the header is written again with the totals by Trace_stop
+    if (fwrite(&trace->header, sizeof(TraceHeader), 1, trace->file) != 1)
+        trace->write_error = 1;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->wake, NULL);
+    trace->start_ns = Trace_now();
+    if (pthread_create(&trace->drainer, NULL, Trace_drainer, trace) != 0) {
+        if (DEBUG) printf("[TR - start] Cannot start the drainer.\n");
+        pthread_mutex_destroy(&trace->lock);
+        pthread_cond_destroy(&trace->wake);
+        fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+void Trace_record(Trace* trace, TraceOp op, int64_t block_num) {
+
+    uint64_t pos = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    do {
+        if (pos - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+            __atomic_add_fetch(&trace->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace->head, &pos, pos + 1,
+                                          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    TraceSlot* slot = &trace->ring[pos & (TRACE_RING - 1)];
+    slot->rec.time_ns = Trace_now() - trace->start_ns;
+    slot->rec.block_op = (uint64_t) block_num << 8 | (uint64_t) op;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // half full: don't wait for the timeout, a lost wake up only delays the drain
+    if (pos - __atomic_load_n(&trace->tail, __ATOMIC_RELAXED) == TRACE_RING / 2)
+        pthread_cond_signal(&trace->wake);
+}
+
+int64_t Trace_stop(Trace* trace) {
+
+    pthread_mutex_lock(&trace->lock);
+    trace->stopping = 1;
+    pthread_cond_signal(&trace->wake);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->drainer, NULL);
+    Trace_drain(trace);
+
+    trace->header.dropped = trace->dropped;
+    int ret = fseek(trace->file, 0, SEEK_SET) == 0 &&
+              fwrite(&trace->header, sizeof(TraceHeader), 1, trace->file) == 1 ? 0 : -1;
+    if (trace->write_error || ferror(trace->file))
+        ret = -1;
+    if (fclose(trace->file) != 0)
+        ret = -1;
+    int64_t dropped = trace->dropped;
+
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->wake);
+    free(trace->ring);
+    free(trace);
+    return ret == -1 ? -1 : dropped;
+}
+
+const char* Trace_opName(TraceOp op) {
+    if (op < 0 || op >= TRACE_NUM_OPS)
+        return "unknown";
+    return trace_op_names[op];
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <fsck.h>
+
+// exit codes, as the ones of fsck(8)
+#define FSCK_OK        0
+#define FSCK_REPAIRED  1
+#define FSCK_ERRORS    4
+#define FSCK_FAILED    8
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-r] [-j threads] <image>\n", prog);
+    fprintf(stderr, "  -r          rebuild the bitmap from the blocks reached\n");
+    fprintf(stderr, "  -j threads  threads walking the tree (default one per cpu)\n");
+}
+
+int main(int argc, char* argv[]) {
+
+    int repair = 0;
+    int num_threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch (opt) {
+        case 'r':
+            repair = 1;
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return FSCK_FAILED;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_FAILED;
+    }
+
+    // DiskDriver_init would make a new disk out of a missing file
+    const char* image = argv[optind];
+    if (access(image, R_OK | W_OK) == -1) {
+        perror(image);
+        return FSCK_FAILED;
+    }
+
+    DiskDriver disk;
+    DiskDriver_init(&disk, image, 0);
+
+    FsckReport report;
+    if (Fsck_check(&disk, num_threads, repair, stdout, &report) == -1) {
+        fprintf(stderr, "%s: no file system on the disk\n", image);
+        DiskDriver_close(&disk);
+        return FSCK_FAILED;
+    }
+    int64_t num_blocks = disk.header->num_blocks;
+    DiskDriver_close(&disk);
+
+    printf("%s: %" PRId64 " dirs, %" PRId64 " files, %" PRId64 "/%" PRId64 " blocks used\n",
+           image, report.dirs, report.files, report.used_blocks, num_blocks);
+    printf("%" PRId64 " errors, %" PRId64 " leaked blocks, %" PRId64 " lost blocks, %" PRId64 " bad regions%s\n",
+           report.errors, report.leaked_blocks, report.lost_blocks, report.bad_regions,
+           report.repaired ? ", bitmap rebuilt" : "");
+
+    if (report.errors)
+        return FSCK_ERRORS;
+    if (report.repaired)
+        return FSCK_REPAIRED;
+    if (report.leaked_blocks || report.lost_blocks || report.bad_regions)
+        return FSCK_ERRORS;
+    return FSCK_OK;
+}
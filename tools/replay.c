@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <disk_driver.h>
+
+/*
+   Runs again on a disk the block operations recorded by DiskDriver_startTrace
+   and reports the throughput. The disk is made with the size of the one
+   traced if the image doesn't exist. With -t the records are issued at the
+   times they were recorded, otherwise as fast as possible.
+
+   The trace has no data: the blocks written get 0xab bytes, so the file
+   system on the image is lost. With -r the trace runs on a RAM disk
+   instead, a copy of the image if one is given, which is left as it is.
+*/
+
+#define REPLAY_BATCH 4096
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t] [-r] <trace> <image>\n", prog);
+    fprintf(stderr, "       %s [-t] -r <trace>\n", prog);
+    fprintf(stderr, "  -t  keep the timing of the trace\n");
+    fprintf(stderr, "  -r  replay on a RAM disk, a copy of image if given\n");
+    fprintf(stderr, "the blocks written are filled with 0xab, overwriting the image without -r\n");
+}
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// waits until ns after start
+static void waitUntil(uint64_t start, uint64_t ns) {
+    uint64_t elapsed = now() - start;
+    if (elapsed >= ns)
+        return;
+    struct timespec ts = {
+        .tv_sec = (time_t) ((ns - elapsed) / 1000000000ull),
+        .tv_nsec = (long) ((ns - elapsed) % 1000000000ull)
+    };
+    nanosleep(&ts, NULL);
+}
+
+int main(int argc, char* argv[]) {
+
+    int timed = 0;
+    int memory = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "tr")) != -1) {
+        switch (opt) {
+        case 't':
+            timed = 1;
+            break;
+        case 'r':
+            memory = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 2 && !(memory && optind == argc - 1)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(argv[optind], "r");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(TraceHeader), 1, file) != 1 ||
+            header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    DiskDriver disk;
+    const char* image = optind + 1 < argc ? argv[optind + 1] : NULL;
+    if (memory && image != NULL)
+        DiskDriver_load(&disk, image, 0);
+    else if (memory)
+        DiskDriver_initMemory(&disk, header.num_blocks, 0);
+    else
+        DiskDriver_init(&disk, image, header.num_blocks);
+
+    static TraceRecord batch[REPLAY_BATCH];
+    char data[BLOCK_SIZE];
+    memset(data, 0xab, BLOCK_SIZE);
+    int64_t done[TRACE_NUM_OPS] = { 0 };
+    int64_t failed = 0, skipped = 0;
+    uint64_t last_ns = 0;
+
+    uint64_t start = now();
+    size_t num;
+    while ((num = fread(batch, sizeof(TraceRecord), REPLAY_BATCH, file)) > 0) {
+        size_t idx;
+        for (idx = 0; idx < num; idx++) {
+            TraceRecord* rec = &batch[idx];
+            int64_t block_num = TRACE_BLOCK(rec);
+            if (block_num >= disk.header->num_blocks) {
+                skipped ++;
+                continue;
+            }
+            if (timed)
+                waitUntil(start, rec->time_ns);
+            last_ns = rec->time_ns;
+
+            int ret = 0;
+            switch (TRACE_OP(rec)) {
+            case TRACE_READ:
+                ret = DiskDriver_readBlock(&disk, data, block_num);
+                break;
+            case TRACE_WRITE:
+                ret = DiskDriver_writeBlock(&disk, data, block_num);
+                break;
+            case TRACE_ALLOC:
+                ret = DiskDriver_claimBlock(&disk, block_num);
+                break;
+            case TRACE_FREE:
+                ret = DiskDriver_freeBlock(&disk, block_num);
+                break;
+            case TRACE_FLUSH:
+                ret = DiskDriver_flush(&disk);
+                break;
+            default:
+                skipped ++;
+                continue;
+            }
+            done[TRACE_OP(rec)] ++;
+            if (ret == -1)
+                failed ++;
+        }
+    }
+    double seconds = (double) (now() - start) / 1e9;
+    fclose(file);
+    DiskDriver_close(&disk);
+
+    int64_t total = 0;
+    int op;
+    for (op = 0; op < TRACE_NUM_OPS; op++) {
+        printf("%-6s %12" PRId64 "\n", Trace_opName(op), done[op]);
+        total += done[op];
+    }
+    double mb = (double) (done[TRACE_READ] + done[TRACE_WRITE]) * BLOCK_SIZE / (1024.0 * 1024.0);
+    printf("%" PRId64 " operations in %.3f s (traced in %.3f s): %.0f ops/s, %.1f MB/s\n",
+           total, seconds, (double) last_ns / 1e9,
+           seconds > 0 ? (double) total / seconds : 0.0, seconds > 0 ? mb / seconds : 0.0);
+    printf("%" PRId64 " failed, %" PRId64 " skipped, %" PRId64 " dropped while tracing\n",
+           failed, skipped, header.dropped);
+    return EXIT_SUCCESS;
+}
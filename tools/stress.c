@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <fsck.h>
+
+/*
+   Stress test of the locking of SimpleFS. Threads make and remove files
+   and directories by path in a few shared directories, so that they keep
+   racing on the same names: a directory is removed while another thread
+   holds a handle on it, an entry is created in a directory being removed,
+   a file is written while removals move it in its directory or while it
+   is packed with the other small files of the directory.
+   The operations may fail, the file system must stay consistent: every
+   ops / checks operations the threads stop and the disk is checked with
+   Fsck_check, the exit status is nonzero if it found anything.
+
+   The disk is kept in memory; with -k it is saved at the end.
+*/
+
+#define STRESS_MAX_THREADS 64
+#define STRESS_DIRS        4               // top level directories d<n>
+#define STRESS_NAMES       8               // names f<n> and s<n> in each directory
+#define STRESS_WRITE       1000            // most bytes written by a write
+
+typedef struct {
+  DirectoryHandle* root;
+  unsigned int seed;
+  int64_t ops;
+  int64_t done;                            // operations that succeeded
+  pthread_t thread;
+} Worker;
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-n ops] [-c checks] [-s seed] [-b blocks] [-k image]\n", prog);
+    fprintf(stderr, "  -t threads  threads running at once (default 8)\n");
+    fprintf(stderr, "  -n ops      operations of each thread (default 20000)\n");
+    fprintf(stderr, "  -c checks   times the disk is checked, the threads stop meanwhile (default 10)\n");
+    fprintf(stderr, "  -s seed     seed of the generators (default 1)\n");
+    fprintf(stderr, "  -b blocks   blocks of the disk (default 65536)\n");
+    fprintf(stderr, "  -k image    save the disk on image at the end\n");
+}
+
+// a random directory: a top level one, or one of its subdirectories
+static void randomDir(Worker* w, char* path) {
+    int top = rand_r(&w->seed) % STRESS_DIRS;
+    if (rand_r(&w->seed) % 2)
+        sprintf(path, "/d%d", top);
+    else
+        sprintf(path, "/d%d/s%d", top, rand_r(&w->seed) % STRESS_NAMES);
+}
+
+static int stressOp(Worker* w) {
+
+    char dir[64], path[80], name[16];
+    randomDir(w, dir);
+    sprintf(name, "f%d", rand_r(&w->seed) % STRESS_NAMES);
+    sprintf(path, "%s/%s", dir, name);
+
+    switch (rand_r(&w->seed) % 9) {
+    case 0: {
+        // makes a subdirectory through a handle, that may outlive the directory
+        sprintf(dir, "d%d", rand_r(&w->seed) % STRESS_DIRS);
+        sprintf(name, "s%d", rand_r(&w->seed) % STRESS_NAMES);
+        DirectoryHandle* d = SimpleFS_openDir(w->root, dir);
+        if (d == NULL)
+            return SimpleFS_mkDir(w->root, dir);
+        int ret = SimpleFS_mkDir(d, name);
+        SimpleFS_closeDir(d);
+        return ret;
+    }
+    case 1:
+    case 2:
+        return SimpleFS_createFilePath(w->root, path);
+    case 3:
+        return SimpleFS_removePath(w->root, path);
+    case 4:
+    case 5:
+    case 6: {
+        char data[STRESS_WRITE];
+        int size = 1 + rand_r(&w->seed) % STRESS_WRITE;
+        memset(data, 'a' + size % 26, size);
+        FileHandle* f = SimpleFS_openFilePath(w->root, path);
+        if (f == NULL)
+            return -1;
+        int ret = SimpleFS_write(f, data, size) == size ? 0 : -1;
+        if (SimpleFS_closeFile(f) == -1)
+            ret = -1;
+        return ret;
+    }
+    case 7:
+        return SimpleFS_pack(w->root, dir) == -1 ? -1 : 0;
+    default:
+        return SimpleFS_removeTree(w->root, dir);
+    }
+}
+
+static void* stressWork(void* arg) {
+    Worker* w = arg;
+    int64_t idx;
+    for (idx = 0; idx < w->ops; idx++) {
+        if (stressOp(w) == 0)
+            w->done ++;
+    }
+    return NULL;
+}
+
+// runs ops operations on each thread, then checks the disk
+static int stressRound(DiskDriver* disk, DirectoryHandle* top, Worker* workers, int threads,
+                       int64_t ops, FsckReport* report) {
+    int idx;
+    for (idx = 0; idx < threads; idx++) {
+        workers[idx].root = SimpleFS_openDir(top, "/");
+        workers[idx].ops = ops;
+        pthread_create(&workers[idx].thread, NULL, stressWork, &workers[idx]);
+    }
+    for (idx = 0; idx < threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        SimpleFS_closeDir(workers[idx].root);
+    }
+
+    int ret = Fsck_check(disk, 0, 0, stdout, report);
+    if (ret == -1 || report->errors || report->leaked_blocks || report->lost_blocks || report->bad_regions)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+    int threads = 8;
+    int64_t ops = 20000;
+    int checks = 10;
+    unsigned int seed = 1;
+    int64_t num_blocks = 65536;
+    const char* keep = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:c:s:b:k:")) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'n': ops = atoll(optarg); break;
+        case 'c': checks = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'b': num_blocks = atoll(optarg); break;
+        case 'k': keep = optarg; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || threads < 1 || threads > STRESS_MAX_THREADS || ops < 0 || checks < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    DiskDriver disk;
+    SimpleFS fs;
+    DiskDriver_initMemory(&disk, num_blocks, 0);
+    DirectoryHandle* top = SimpleFS_init(&fs, &disk);
+    SimpleFS_format(&fs);
+
+    static Worker workers[STRESS_MAX_THREADS];
+    int idx;
+    for (idx = 0; idx < threads; idx++)
+        workers[idx].seed = seed * 7919u + idx;
+
+    // the damage done by a race may be undone by later operations,
+    // as when the file is removed: the disk is checked several times
+    FsckReport report;
+    int ret = 0;
+    int round;
+    for (round = 0; round < checks && ret == 0; round++) {
+        int64_t round_ops = ops / checks + (round < ops % checks);
+        ret = stressRound(&disk, top, workers, threads, round_ops, &report);
+        if (ret == -1)
+            printf("check %d of %d failed\n", round + 1, checks);
+    }
+    SimpleFS_closeDir(top);
+
+    int64_t done = 0;
+    for (idx = 0; idx < threads; idx++)
+        done += workers[idx].done;
+    printf("%d threads, %" PRId64 " operations, %" PRId64 " succeeded\n",
+           threads, ops * threads, done);
+    printf("%" PRId64 " dirs, %" PRId64 " files, %" PRId64 " errors, %" PRId64 " leaked blocks, %" PRId64 " lost blocks\n",
+           report.dirs, report.files, report.errors, report.leaked_blocks, report.lost_blocks);
+    if (keep != NULL && DiskDriver_save(&disk, keep) == -1)
+        fprintf(stderr, "%s: cannot save the disk\n", keep);
+    DiskDriver_close(&disk);
+    return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}